@@ -17,20 +17,29 @@ namespace mapManager{
 		this->nh_ = nh;
 		this->initParam();
 		this->initESDFParam();
+		this->initPrebuiltMap();
 		this->registerPub();
 		this->registerESDFPub();
 		this->registerCallback();
 		this->registerESDFCallback();
+		this->startStageWorkers();
+	}
+
+	ESDFMap::~ESDFMap(){
+		// stage threads may still run ESDF callbacks
+		this->stopStageWorkers();
 	}
 
 	void ESDFMap::initMap(const ros::NodeHandle& nh){
 		this->nh_ = nh;
 		this->initParam();
 		this->initESDFParam();
+		this->initPrebuiltMap();
 		this->registerPub();
 		this->registerESDFPub();
 		this->registerCallback();
 		this->registerESDFCallback();
+		this->startStageWorkers();
 	}
 
 	void ESDFMap::initESDFParam(){
@@ -40,6 +49,50 @@ namespace mapManager{
 		this->esdfDistancePos_.resize(reservedSize, 10000);
 		this->esdfDistanceNeg_.resize(reservedSize, 10000);
 		this->esdfDistance_.resize(reservedSize, 10000);
+		this->esdfInflated_.resize(reservedSize, 0);
+
+		// query cache
+		if (not this->nh_.getParam(this->ns_ + "/esdf_query_cache", this->esdfQueryCache_)){
+			this->esdfQueryCache_ = false;
+			cout << this->hint_ << ": No ESDF query cache option. Use default: false." << endl;
+		}
+		else{
+			cout << this->hint_ << ": ESDF query cache: " << this->esdfQueryCache_ << endl;
+		}
+		if (this->esdfQueryCache_){
+			this->esdfCellBuffer_.assign(size_t(reservedSize) * 8 + 8, 10000.0f);
+			uintptr_t base = reinterpret_cast<uintptr_t>(this->esdfCellBuffer_.data());
+			this->esdfCell_ = reinterpret_cast<esdfCell*>((base + 31) & ~uintptr_t(31));
+		}
+	}
+
+	uint32_t ESDFMap::getSnapshotLayers(){
+		return occMap::getSnapshotLayers() | SNAPSHOT_LAYER_ESDF;
+	}
+
+	void ESDFMap::writeSnapshotLayers(mapSnapshot& snapshot, int beginAddress, int endAddress){
+		occMap::writeSnapshotLayers(snapshot, beginAddress, endAddress);
+		if (endAddress <= beginAddress) return;
+		memcpy(snapshot.esdf() + beginAddress, this->esdfDistance_.data() + beginAddress, (endAddress - beginAddress) * sizeof(double));
+	}
+
+	void ESDFMap::readSnapshotLayers(mapSnapshot& snapshot){
+		occMap::readSnapshotLayers(snapshot);
+		if (snapshot.esdf() != nullptr){
+			memcpy(this->esdfDistance_.data(), snapshot.esdf(), this->esdfDistance_.size() * sizeof(double));
+			if (this->esdfQueryCache_){
+				this->updateESDFCell(this->mapVoxelMin_, this->mapVoxelMax_ - Eigen::Vector3i (1, 1, 1));
+			}
+		}
+		else{
+			// snapshot from occupancy map only, recompute the distance field for the stored range
+			const snapshotHeader& header = snapshot.header();
+			this->posToIndex(Eigen::Vector3d (header.currMapRangeMin[0], header.currMapRangeMin[1], header.currMapRangeMin[2]), this->localBoundMin_);
+			this->posToIndex(Eigen::Vector3d (header.currMapRangeMax[0], header.currMapRangeMax[1], header.currMapRangeMax[2]), this->localBoundMax_);
+			this->boundIndex(this->localBoundMin_);
+			this->boundIndex(this->localBoundMax_);
+			this->esdfNeedUpdate_ = true;
+		}
 	}
 
 	void ESDFMap::registerESDFPub(){
@@ -47,8 +100,8 @@ namespace mapManager{
 	}
 
 	void ESDFMap::registerESDFCallback(){
-		this->esdfTimer_ = this->nh_.createTimer(ros::Duration(0.05), &ESDFMap::updateESDFCB, this);
-		this->esdfPubTimer_ = this->nh_.createTimer(ros::Duration(0.05), &ESDFMap::ESDFPubCB, this);
+		this->esdfTimer_ = this->stageNh_[STAGE_ESDF].createTimer(ros::Duration(0.05), &ESDFMap::updateESDFCB, this);
+		this->esdfPubTimer_ = this->stageNh_[STAGE_ESDF].createTimer(ros::Duration(0.05), &ESDFMap::ESDFPubCB, this);
 	}
 
 	void ESDFMap::updateESDFCB(const ros::TimerEvent& ){
@@ -67,13 +120,27 @@ namespace mapManager{
 	}
 
 	void ESDFMap::updateESDF3D(){
-		Eigen::Vector3i minRange = this->localBoundMin_;
-		Eigen::Vector3i maxRange = this->localBoundMax_;
+		this->clearESDFRegions();
+
+		// the range and its inflated map are taken in one consistent copy, the distance transform runs without the map lock
+		Eigen::Vector3i minRange, maxRange;
+		{
+			std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+			minRange = this->localBoundMin_;
+			maxRange = this->localBoundMax_;
+			for (int x=minRange(0); x<=maxRange(0); ++x){
+				for (int y=minRange(1); y<=maxRange(1); ++y){
+					this->forEachZRun(x, y, minRange(2), maxRange(2), [&](int address, int length){
+						std::copy(this->occupancyInflated_.begin() + address, this->occupancyInflated_.begin() + address + length, this->esdfInflated_.begin() + address);
+					});
+				}
+			}
+		}
 
 		// positive DT
 		for (int x=minRange(0); x<=maxRange(0); ++x){
 			for (int y=minRange(1); y<=maxRange(1); ++y){
-		  		this->fillESDF([&](int z){return this->occupancyInflated_[this->indexToAddress(x, y, z)] == true ? 0 : std::numeric_limits<double>::max();},
+		  		this->fillESDF([&](int z){return this->esdfInflated_[this->indexToAddress(x, y, z)] ? 0 : std::numeric_limits<double>::max();},
 		      			 [&](int z, double val) {this->esdfTemp1_[this->indexToAddress(x, y, z)] = val;}, minRange(2), maxRange(2), 2);
 			}
 		}
@@ -95,7 +162,7 @@ namespace mapManager{
 		// negative DT
 		for (int x=minRange(0); x<=maxRange(0); ++x){
 			for (int y=minRange(1); y<=maxRange(1); ++y){
-				this->fillESDF([&](int z){return this->occupancyInflated_[this->indexToAddress(x, y, z)] == false ? 0 : std::numeric_limits<double>::max();},
+				this->fillESDF([&](int z){return not this->esdfInflated_[this->indexToAddress(x, y, z)] ? 0 : std::numeric_limits<double>::max();},
 		  		[&](int z, double val){this->esdfTemp1_[this->indexToAddress(x, y, z)]=val;}, minRange(2), maxRange(2), 2);
 			}
 		}
@@ -127,6 +194,90 @@ namespace mapManager{
 				}
 			}
 		}
+
+		// cells with a corner in the updated range
+		if (this->esdfQueryCache_){
+			this->updateESDFCell(minRange - Eigen::Vector3i (1, 1, 1), maxRange);
+		}
+	}
+
+	void ESDFMap::updateESDFCell(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		Eigen::Vector3i minRange = minIdx;
+		Eigen::Vector3i maxRange = maxIdx;
+		this->boundIndex(minRange);
+		this->boundIndex(maxRange);
+		// corners outside the map take the distance of the border voxel (same as getDistance)
+		const Eigen::Vector3i borderIdx = this->mapVoxelMax_ - Eigen::Vector3i (1, 1, 1);
+		for (int x=minRange(0); x<=maxRange(0); ++x){
+			int xs[2] = {x, std::min(x + 1, borderIdx(0))};
+			for (int y=minRange(1); y<=maxRange(1); ++y){
+				int ys[2] = {y, std::min(y + 1, borderIdx(1))};
+				for (int z=minRange(2); z<=maxRange(2); ++z){
+					int zs[2] = {z, std::min(z + 1, borderIdx(2))};
+					float* dist = this->esdfCell_[this->indexToAddress(x, y, z)].dist;
+					for (int i=0; i<8; ++i){
+						dist[i] = this->esdfDistance_[this->indexToAddress(xs[i >> 2], ys[(i >> 1) & 1], zs[i & 1])];
+					}
+				}
+			}
+		}
+	}
+
+	void ESDFMap::clearRegionLayers(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		// called by the integration stage, the distances belong to the ESDF stage which resets them in its next update
+		// (the local map shell is cleared every cycle, a box still pending is not queued again)
+		std::lock_guard<std::mutex> clearLock (this->esdfClearMutex_);
+		for (const std::pair<Eigen::Vector3i, Eigen::Vector3i>& box : this->esdfClearBoxes_){
+			if (box.first == minIdx and box.second == maxIdx){
+				return;
+			}
+		}
+		this->esdfClearBoxes_.push_back(std::make_pair(minIdx, maxIdx));
+	}
+
+	void ESDFMap::clearESDFRegions(){
+		std::vector<std::pair<Eigen::Vector3i, Eigen::Vector3i>> clearBoxes;
+		{
+			std::lock_guard<std::mutex> clearLock (this->esdfClearMutex_);
+			clearBoxes.swap(this->esdfClearBoxes_);
+		}
+
+		// cleared voxels go back to the initial distance, cached cells with a corner in the region are refreshed
+		for (const std::pair<Eigen::Vector3i, Eigen::Vector3i>& box : clearBoxes){
+			const Eigen::Vector3i& minIdx = box.first;
+			const Eigen::Vector3i& maxIdx = box.second;
+			for (int x=minIdx(0); x<=maxIdx(0); ++x){
+				for (int y=minIdx(1); y<=maxIdx(1); ++y){
+					this->forEachZRun(x, y, minIdx(2), maxIdx(2), [&](int address, int length){
+						std::fill(this->esdfDistance_.begin() + address, this->esdfDistance_.begin() + address + length, 10000.0);
+						std::fill(this->esdfDistancePos_.begin() + address, this->esdfDistancePos_.begin() + address + length, 10000.0);
+						std::fill(this->esdfDistanceNeg_.begin() + address, this->esdfDistanceNeg_.begin() + address + length, 10000.0);
+					});
+				}
+			}
+			if (this->esdfQueryCache_){
+				this->updateESDFCell(minIdx - Eigen::Vector3i (1, 1, 1), maxIdx);
+			}
+		}
+	}
+
+	inline void ESDFMap::getCellDistance(const Eigen::Vector3i& idxMinus, double values[2][2][2]){
+		if (this->esdfQueryCache_ and (idxMinus.array() >= 0).all() and (idxMinus.array() < this->mapVoxelMax_.array()).all()){
+			// one cached cell instead of 8 scattered voxels
+			const float* dist = this->esdfCell_[this->indexToAddress(idxMinus)].dist;
+			for (int i=0; i<8; ++i){
+				values[i >> 2][(i >> 1) & 1][i & 1] = dist[i];
+			}
+			return;
+		}
+		for (int x=0; x<2; ++x){
+			for (int y=0; y<2; ++y){
+				for (int z=0; z<2; ++z){
+					Eigen::Vector3i currIdx = idxMinus + Eigen::Vector3i(x, y, z);
+					values[x][y][z] = this->getDistance(currIdx);
+				}
+			}
+		}
 	}
 
 	template <typename F_get_val, typename F_set_val>
@@ -189,14 +340,7 @@ namespace mapManager{
 		diff = (pos - idxMinusPos) * this->mapRes_;
 
 		double values[2][2][2];
-		for (int x=0; x<2; ++x){
-			for (int y=0; y<2; ++y){
-				for (int z=0; z<2; ++z){
-					Eigen::Vector3i currIdx = idxMinus + Eigen::Vector3i(x, y, z);
-					values[x][y][z] = this->getDistance(currIdx);
-				}
-			}
-		}
+		this->getCellDistance(idxMinus, values);
 
 		// interpolation for distance
 		double v00 = (1 - diff[0]) * values[0][0][0] + diff[0] * values[1][0][0];
@@ -222,14 +366,7 @@ namespace mapManager{
 		diff = (pos - idxMinusPos) * this->mapRes_;
 
 		double values[2][2][2];
-		for (int x=0; x<2; ++x){
-			for (int y=0; y<2; ++y){
-				for (int z=0; z<2; ++z){
-					Eigen::Vector3i currIdx = idxMinus + Eigen::Vector3i(x, y, z);
-					values[x][y][z] = this->getDistance(currIdx);
-				}
-			}
-		}
+		this->getCellDistance(idxMinus, values);
 
 		// interpolation for distance
 		double v00 = (1 - diff[0]) * values[0][0][0] + diff[0] * values[1][0][0];
@@ -265,13 +402,18 @@ namespace mapManager{
 		const double minDist = 0.0;
 		const double maxDist = 5.0;
 
-		Eigen::Vector3i minRange = this->localBoundMin_;
-		Eigen::Vector3i maxRange = this->localBoundMax_;
+		Eigen::Vector3i minRange, maxRange;
+		double height;
+		{
+			std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+			minRange = this->localBoundMin_;
+			maxRange = this->localBoundMax_;
+			height = this->position_(2);
+		}
 		this->boundIndex(minRange);
 		this->boundIndex(maxRange);
 
 		Eigen::Vector3d pos;
-		double height = this->position_(2);
 		for (int x=minRange(0); x<=maxRange(0); ++x){
 			for (int y=minRange(1); y<=maxRange(1); ++y){
 				this->indexToPos(Eigen::Vector3i(x, y, 1), pos);
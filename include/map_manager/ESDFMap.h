@@ -8,6 +8,11 @@
 #include <map_manager/occupancyMap.h>
 
 namespace mapManager{
+	// distances at the 8 corners of one trilinear cell (corner (x, y, z) at x*4 + y*2 + z), half a cache line
+	struct alignas(32) esdfCell{
+		float dist[8];
+	};
+
 	class ESDFMap : public occMap{
 	private:
 
@@ -21,16 +26,34 @@ namespace mapManager{
 		std::vector<double> esdfDistancePos_;
 		std::vector<double> esdfDistanceNeg_;
 		std::vector<double> esdfDistance_;
+		std::vector<uint8_t> esdfInflated_; // inflated map of the updated range, copied under the map lock
+		std::mutex esdfClearMutex_;
+		std::vector<std::pair<Eigen::Vector3i, Eigen::Vector3i>> esdfClearBoxes_; // regions cleared by integration, reset by the ESDF stage
+
+		// QUERY CACHE (cell of each voxel as lower corner, refreshed in the updated local bound)
+		bool esdfQueryCache_;
+		std::vector<float> esdfCellBuffer_;
+		esdfCell* esdfCell_ = nullptr; // 32 byte aligned view of esdfCellBuffer_
 
 	public:
 		ESDFMap(); // empty constructor
 		ESDFMap(const ros::NodeHandle& nh);
+		virtual ~ESDFMap();
 		void initMap(const ros::NodeHandle& nh);
 		void initESDFParam();
 		void registerESDFPub();
 		void registerESDFCallback();
 		void updateESDFCB(const ros::TimerEvent& );
 		void updateESDF3D();
+		void clearESDFRegions();
+		void updateESDFCell(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
+		void getCellDistance(const Eigen::Vector3i& idxMinus, double values[2][2][2]);
+		virtual void clearRegionLayers(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx) override;
+
+		// snapshot
+		virtual uint32_t getSnapshotLayers() override;
+		virtual void writeSnapshotLayers(mapSnapshot& snapshot, int beginAddress, int endAddress) override;
+		virtual void readSnapshotLayers(mapSnapshot& snapshot) override;
 
 		template <typename F_get_val, typename F_set_val>
 		void fillESDF(F_get_val f_get_val, F_set_val f_set_val, int start, int end, int dim);
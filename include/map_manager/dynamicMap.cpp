@@ -20,16 +20,53 @@ namespace mapManager{
 		this->initMap(nh, freeMap);
 	}
 
+	dynamicMap::~dynamicMap(){
+		// stage threads may still run map clearing and prediction callbacks
+		this->stopStageWorkers();
+	}
+
 	void dynamicMap::initMap(const ros::NodeHandle& nh, bool freeMap){
 		this->nh_ = nh;
 		this->initParam();
+		this->initDynamicParam();
 		this->initPrebuiltMap();
 		this->registerPub();
 		this->registerCallback();
 		this->detector_.reset(new onboardDetector::dynamicDetector (this->nh_));
 		if (freeMap){
-        	this->freeMapTimer_ = this->nh_.createTimer(ros::Duration(0.033), &dynamicMap::freeMapCB, this);
+        	this->freeMapTimer_ = this->stageNh_[STAGE_INTEGRATION].createTimer(ros::Duration(0.033), &dynamicMap::freeMapCB, this);
 		}
+		if (this->predictionHorizon_ > 0){
+			this->predictionTimer_ = this->stageNh_[STAGE_QUERY].createTimer(ros::Duration(0.033), &dynamicMap::predictionCB, this); // does not touch the map
+		}
+		this->startStageWorkers();
+	}
+
+	void dynamicMap::initDynamicParam(){
+		// prediction horizon
+		if (not this->nh_.getParam(this->ns_ + "/prediction_horizon", this->predictionHorizon_)){
+			this->predictionHorizon_ = 2.0;
+			cout << this->hint_ << ": No prediction horizon. Use default: 2.0 s." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Prediction horizon: " << this->predictionHorizon_ << " s." << endl;
+		}
+
+		// prediction cell size
+		if (not this->nh_.getParam(this->ns_ + "/prediction_cell_size", this->predictionCellSize_)){
+			this->predictionCellSize_ = 1.0;
+			cout << this->hint_ << ": No prediction cell size. Use default: 1.0 m." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Prediction cell size: " << this->predictionCellSize_ << " m." << endl;
+		}
+		this->predictionCellSize_ = std::max(this->predictionCellSize_, this->mapRes_);
+
+		this->predGridDim_(0) = ceil((this->mapSizeMax_(0) - this->mapSizeMin_(0))/this->predictionCellSize_);
+		this->predGridDim_(1) = ceil((this->mapSizeMax_(1) - this->mapSizeMin_(1))/this->predictionCellSize_);
+		std::shared_ptr<predictionLayer> layer = std::make_shared<predictionLayer> ();
+		layer->cellStart.assign(this->predGridDim_(0) * this->predGridDim_(1) + 1, 0);
+		std::atomic_store(&this->predLayer_, std::shared_ptr<const predictionLayer> (layer));
 	}
 
 	void dynamicMap::freeMapCB(const ros::TimerEvent&){
@@ -41,15 +78,95 @@ namespace mapManager{
 			Eigen::Vector3d upperBound (ob.x+ob.x_width/2+0.3, ob.y+ob.y_width/2+2*this->mapRes_+0.3, ob.z+ob.z_width+0.3);
 			freeRegions.push_back(std::make_pair(lowerBound, upperBound));
 		}
+		std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
 		this->freeRegions(freeRegions);
 		this->updateFreeRegions(freeRegions);
 	}
 
+	void dynamicMap::predictionCB(const ros::TimerEvent&){
+		std::vector<onboardDetector::box3D> dynamicBBoxes;
+		this->detector_->getDynamicObstacles(dynamicBBoxes);
+		this->updatePrediction(dynamicBBoxes);
+	}
+
+	void dynamicMap::updatePrediction(const std::vector<onboardDetector::box3D>& dynamicBBoxes){
+		// swept xy box of every obstacle over the horizon, bucketed into the cells it overlaps (counting sort)
+		// the layer is built aside and replaces the current one at once, queries keep the layer they started with
+		std::shared_ptr<predictionLayer> layer = std::make_shared<predictionLayer> ();
+		layer->stamp = ros::Time::now();
+		std::vector<Eigen::Vector4i> cellRanges; // cx min, cy min, cx max, cy max
+		for (const onboardDetector::box3D& ob : dynamicBBoxes){
+			predictedObstacle pred;
+			pred.pos = Eigen::Vector3d (ob.x, ob.y, ob.z);
+			pred.vel = Eigen::Vector3d (ob.Vx, ob.Vy, 0);
+			pred.halfSize = Eigen::Vector3d (ob.x_width, ob.y_width, ob.z_width)/2 + this->robotSize_/2;
+
+			Eigen::Vector3d endPos = pred.pos + this->predictionHorizon_ * pred.vel;
+			Eigen::Vector3d sweptMin = pred.pos.cwiseMin(endPos) - pred.halfSize - this->mapSizeMin_;
+			Eigen::Vector3d sweptMax = pred.pos.cwiseMax(endPos) + pred.halfSize - this->mapSizeMin_;
+			Eigen::Vector4i range;
+			range(0) = std::max(0, int(floor(sweptMin(0)/this->predictionCellSize_)));
+			range(1) = std::max(0, int(floor(sweptMin(1)/this->predictionCellSize_)));
+			range(2) = std::min(this->predGridDim_(0) - 1, int(floor(sweptMax(0)/this->predictionCellSize_)));
+			range(3) = std::min(this->predGridDim_(1) - 1, int(floor(sweptMax(1)/this->predictionCellSize_)));
+			if (range(0) > range(2) or range(1) > range(3)){
+				continue; // never inside the map
+			}
+			layer->obstacles.push_back(pred);
+			cellRanges.push_back(range);
+		}
+
+		layer->cellStart.assign(this->predGridDim_(0) * this->predGridDim_(1) + 1, 0);
+		for (const Eigen::Vector4i& range : cellRanges){
+			for (int cx=range(0); cx<=range(2); ++cx){
+				for (int cy=range(1); cy<=range(3); ++cy){
+					layer->cellStart[cx * this->predGridDim_(1) + cy + 1] += 1;
+				}
+			}
+		}
+		for (size_t i=1; i<layer->cellStart.size(); ++i){
+			layer->cellStart[i] += layer->cellStart[i-1];
+		}
+		layer->cellObstacles.resize(layer->cellStart.back());
+		std::vector<int> cellFill (layer->cellStart.begin(), layer->cellStart.end() - 1);
+		for (size_t i=0; i<cellRanges.size(); ++i){
+			for (int cx=cellRanges[i](0); cx<=cellRanges[i](2); ++cx){
+				for (int cy=cellRanges[i](1); cy<=cellRanges[i](3); ++cy){
+					layer->cellObstacles[cellFill[cx * this->predGridDim_(1) + cy]++] = i;
+				}
+			}
+		}
+		std::atomic_store(&this->predLayer_, std::shared_ptr<const predictionLayer> (layer));
+	}
+
+	bool dynamicMap::isTrajectoryOccupied(const predictionLayer& layer, const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& times, int& firstCollision){
+		// positions[i] is reached at times[i] (seconds after layer.stamp)
+		firstCollision = -1;
+		if (layer.obstacles.empty()){
+			return false;
+		}
+		for (size_t i=0; i<positions.size() and i<times.size(); ++i){
+			if (this->isOccupiedAt(layer, positions[i], times[i])){
+				firstCollision = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool dynamicMap::isTrajectoryOccupied(const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& times, int& firstCollision){
+		// the whole trajectory is checked against one layer
+		return this->isTrajectoryOccupied(*this->getPredictionLayer(), positions, times, firstCollision);
+	}
+
 	void dynamicMap::getDynamicObstacles(std::vector<Eigen::Vector3d>& obstaclePos,
 										 std::vector<Eigen::Vector3d>& obstacleVel,
 										 std::vector<Eigen::Vector3d>& obstacleSize){
 		std::vector<onboardDetector::box3D> dynamicBBoxes;
 		this->detector_->getDynamicObstacles(dynamicBBoxes);
+		obstaclePos.reserve(obstaclePos.size() + dynamicBBoxes.size());
+		obstacleVel.reserve(obstacleVel.size() + dynamicBBoxes.size());
+		obstacleSize.reserve(obstacleSize.size() + dynamicBBoxes.size());
 		for (size_t i=0 ; i<dynamicBBoxes.size() ; ++i){
 			Eigen::Vector3d pos(dynamicBBoxes[i].x, dynamicBBoxes[i].y, dynamicBBoxes[i].z);
 			Eigen::Vector3d vel(dynamicBBoxes[i].Vx, dynamicBBoxes[i].Vy, 0);
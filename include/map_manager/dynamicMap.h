@@ -11,6 +11,20 @@
 #include <onboard_detector/dynamicDetector.h>
 
 namespace mapManager{
+	// dynamic obstacle of the prediction layer (constant velocity in xy)
+	struct predictedObstacle{
+		Eigen::Vector3d pos;
+		Eigen::Vector3d vel;
+		Eigen::Vector3d halfSize; // inflated by half of the robot size
+	};
+
+	// prediction layer (built as a whole, never changed after it is published)
+	struct predictionLayer{
+		ros::Time stamp; // time the layer was built from the detector output (t = 0)
+		std::vector<predictedObstacle> obstacles;
+		std::vector<int> cellStart; // swept boxes overlapping cell c: cellObstacles[cellStart[c], cellStart[c+1])
+		std::vector<int> cellObstacles;
+	};
 
 	class dynamicMap : public occMap{
 	private:
@@ -18,24 +32,86 @@ namespace mapManager{
 	protected:
 		std::shared_ptr<onboardDetector::dynamicDetector> detector_;
 		ros::Timer freeMapTimer_;
+		ros::Timer predictionTimer_;
 
+		// PREDICTION
+		double predictionHorizon_; // swept volumes cover t in [0, horizon] seconds
+		double predictionCellSize_; // xy cell size of the swept volume grid
+		Eigen::Vector2i predGridDim_;
+		std::shared_ptr<const predictionLayer> predLayer_; // swapped with std::atomic_store, queries take one std::atomic_load
 
 	public:
 		dynamicMap();
 		dynamicMap(const ros::NodeHandle& nh, bool freeMap=true);
+		virtual ~dynamicMap();
 
 		
 		void initMap(const ros::NodeHandle& nh, bool freeMap=true);
+		void initDynamicParam();
 
 		// dynamic clean 
 		void freeMapCB(const ros::TimerEvent&);
 
+		// prediction
+		void predictionCB(const ros::TimerEvent&);
+		void updatePrediction(const std::vector<onboardDetector::box3D>& dynamicBBoxes);
+		bool getPredictionCell(const Eigen::Vector3d& pos, int& cell);
+
 		// user function
 		void getDynamicObstacles(std::vector<Eigen::Vector3d>& obstaclePos, 
 								 std::vector<Eigen::Vector3d>& obstaclesVel, 
 			                     std::vector<Eigen::Vector3d>& obstacleSize);
+		std::shared_ptr<const predictionLayer> getPredictionLayer(); // stamp and obstacles of one layer
+		bool isOccupiedAt(const predictionLayer& layer, const Eigen::Vector3d& pos, double t); // t: seconds after layer.stamp, clamped to the horizon
+		bool isOccupiedAt(const Eigen::Vector3d& pos, double t); // on the current layer
+		bool isTrajectoryOccupied(const predictionLayer& layer, const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& times, int& firstCollision);
+		bool isTrajectoryOccupied(const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& times, int& firstCollision); // on the current layer
+		ros::Time getPredictionStamp(); // stamp of the current layer (may be replaced before a later query, see getPredictionLayer)
+		double getPredictionHorizon();
 	};
 
+	inline bool dynamicMap::getPredictionCell(const Eigen::Vector3d& pos, int& cell){
+		int cx = floor((pos(0) - this->mapSizeMin_(0))/this->predictionCellSize_);
+		int cy = floor((pos(1) - this->mapSizeMin_(1))/this->predictionCellSize_);
+		if (cx < 0 or cx >= this->predGridDim_(0) or cy < 0 or cy >= this->predGridDim_(1)){
+			return false;
+		}
+		cell = cx * this->predGridDim_(1) + cy;
+		return true;
+	}
+
+	inline std::shared_ptr<const predictionLayer> dynamicMap::getPredictionLayer(){
+		return std::atomic_load(&this->predLayer_);
+	}
+
+	inline bool dynamicMap::isOccupiedAt(const predictionLayer& layer, const Eigen::Vector3d& pos, double t){
+		int cell;
+		if (layer.obstacles.empty() or not this->getPredictionCell(pos, cell)){
+			return false;
+		}
+		t = std::min(std::max(t, 0.0), this->predictionHorizon_);
+		for (int i=layer.cellStart[cell]; i<layer.cellStart[cell+1]; ++i){
+			const predictedObstacle& ob = layer.obstacles[layer.cellObstacles[i]];
+			Eigen::Vector3d diff = pos - ob.pos - t * ob.vel;
+			if ((diff.cwiseAbs().array() <= ob.halfSize.array()).all()){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline bool dynamicMap::isOccupiedAt(const Eigen::Vector3d& pos, double t){
+		return this->isOccupiedAt(*this->getPredictionLayer(), pos, t);
+	}
+
+	inline ros::Time dynamicMap::getPredictionStamp(){
+		return this->getPredictionLayer()->stamp;
+	}
+
+	inline double dynamicMap::getPredictionHorizon(){
+		return this->predictionHorizon_;
+	}
+
 }
 
 #endif
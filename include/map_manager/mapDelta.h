@@ -0,0 +1,66 @@
+/*
+	FILE: mapDelta.h
+	--------------------------------------
+	block codec of incremental map stream
+*/
+#ifndef MAPMANAGER_MAPDELTA
+#define MAPMANAGER_MAPDELTA
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace mapManager{
+	// voxel states in the map stream (2 bits)
+	const uint8_t DELTA_VOXEL_UNKNOWN = 0;
+	const uint8_t DELTA_VOXEL_FREE = 1;
+	const uint8_t DELTA_VOXEL_OCCUPIED = 2;
+	const uint8_t DELTA_VOXEL_INFLATED = 3; // not occupied but inside inflated obstacles
+
+	// blocks are 8x8x8 voxels, local voxel order is x-major (x, y, z)
+	const int DELTA_BLOCK_SHIFT = 3;
+	const int DELTA_BLOCK_SIZE = 1 << DELTA_BLOCK_SHIFT;
+	const int DELTA_BLOCK_VOXELS = DELTA_BLOCK_SIZE * DELTA_BLOCK_SIZE * DELTA_BLOCK_SIZE;
+
+	// block payload: one byte mode followed by data
+	// mode 0-3: the whole block has this state (no data)
+	// mode 4: 2 bits per voxel (128 bytes)
+	const uint8_t DELTA_BLOCK_PACKED = 4;
+
+	inline void encodeDeltaBlock(const uint8_t* states, std::vector<uint8_t>& payload){
+		bool uniform = true;
+		for (int i=1; i<DELTA_BLOCK_VOXELS and uniform; ++i){
+			uniform = (states[i] == states[0]);
+		}
+		if (uniform){
+			payload.push_back(states[0]);
+			return;
+		}
+
+		payload.push_back(DELTA_BLOCK_PACKED);
+		for (int i=0; i<DELTA_BLOCK_VOXELS; i+=4){
+			payload.push_back(states[i] | (states[i+1] << 2) | (states[i+2] << 4) | (states[i+3] << 6));
+		}
+	}
+
+	// return the number of payload bytes consumed (0 if malformed)
+	inline size_t decodeDeltaBlock(const uint8_t* payload, size_t size, uint8_t* states){
+		if (size == 0) return 0;
+		if (payload[0] < DELTA_BLOCK_PACKED){
+			for (int i=0; i<DELTA_BLOCK_VOXELS; ++i){
+				states[i] = payload[0];
+			}
+			return 1;
+		}
+		if (payload[0] != DELTA_BLOCK_PACKED or size < size_t(1 + DELTA_BLOCK_VOXELS/4)) return 0;
+		for (int i=0; i<DELTA_BLOCK_VOXELS; i+=4){
+			uint8_t byte = payload[1 + i/4];
+			states[i] = byte & 0x3;
+			states[i+1] = (byte >> 2) & 0x3;
+			states[i+2] = (byte >> 4) & 0x3;
+			states[i+3] = (byte >> 6) & 0x3;
+		}
+		return 1 + DELTA_BLOCK_VOXELS/4;
+	}
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+	FILE: mapDeltaClient.cpp
+	--------------------------------------
+	function definition of incremental map stream client
+*/
+#include <map_manager/mapDeltaClient.h>
+
+namespace mapManager{
+	bool mapDeltaClient::applyDelta(const map_manager::MapDelta& msg){
+		if (msg.keyframe){
+			this->res_ = msg.resolution;
+			this->origin_ = Eigen::Vector3d (msg.origin[0], msg.origin[1], msg.origin[2]);
+			this->mapVoxel_ = Eigen::Vector3i (msg.map_voxel[0], msg.map_voxel[1], msg.map_voxel[2]);
+			this->blockNum_ = (this->mapVoxel_ + Eigen::Vector3i::Constant(DELTA_BLOCK_SIZE - 1)) / DELTA_BLOCK_SIZE;
+			this->states_.assign(size_t(this->mapVoxel_(0)) * this->mapVoxel_(1) * this->mapVoxel_(2), DELTA_VOXEL_UNKNOWN);
+			this->initialized_ = true;
+		}
+		else if (not this->initialized_ or msg.sequence != this->lastSequence_ + 1){
+			this->initialized_ = false; // lost a delta, wait for the next keyframe
+			return false;
+		}
+		this->lastSequence_ = msg.sequence;
+
+		uint8_t blockStates[DELTA_BLOCK_VOXELS];
+		size_t payloadPos = 0;
+		for (uint32_t blockID : msg.block_ids){
+			size_t used = decodeDeltaBlock(msg.payload.data() + payloadPos, msg.payload.size() - payloadPos, blockStates);
+			if (used == 0){
+				this->initialized_ = false;
+				return false;
+			}
+			payloadPos += used;
+
+			Eigen::Vector3i blockIdx;
+			blockIdx(0) = blockID / (this->blockNum_(1) * this->blockNum_(2));
+			blockIdx(1) = (blockID / this->blockNum_(2)) % this->blockNum_(1);
+			blockIdx(2) = blockID % this->blockNum_(2);
+			Eigen::Vector3i blockMin = blockIdx * DELTA_BLOCK_SIZE;
+			int i = 0;
+			for (int x=blockMin(0); x<blockMin(0)+DELTA_BLOCK_SIZE; ++x){
+				for (int y=blockMin(1); y<blockMin(1)+DELTA_BLOCK_SIZE; ++y){
+					for (int z=blockMin(2); z<blockMin(2)+DELTA_BLOCK_SIZE; ++z, ++i){
+						if (x < this->mapVoxel_(0) and y < this->mapVoxel_(1) and z < this->mapVoxel_(2)){
+							this->states_[(size_t(x) * this->mapVoxel_(1) + y) * this->mapVoxel_(2) + z] = blockStates[i];
+						}
+					}
+				}
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,73 @@
+/*
+	FILE: mapDeltaClient.h
+	--------------------------------------
+	client of incremental map stream header file
+*/
+#ifndef MAPMANAGER_MAPDELTACLIENT
+#define MAPMANAGER_MAPDELTACLIENT
+#include <Eigen/Eigen>
+#include <map_manager/MapDelta.h>
+#include <map_manager/mapDelta.h>
+
+namespace mapManager{
+	// rebuilds the voxel map of a remote map node from its map_delta topic
+	class mapDeltaClient{
+	private:
+		bool initialized_ = false; // a keyframe has been applied
+		uint32_t lastSequence_ = 0;
+		double res_ = 0.0;
+		Eigen::Vector3d origin_;
+		Eigen::Vector3i mapVoxel_;
+		Eigen::Vector3i blockNum_;
+		std::vector<uint8_t> states_;
+
+	public:
+		// return false if the message cannot be applied (waiting for keyframe)
+		bool applyDelta(const map_manager::MapDelta& msg);
+		bool isInitialized() const;
+		double getRes() const;
+
+		uint8_t getState(const Eigen::Vector3d& pos) const;
+		bool isOccupied(const Eigen::Vector3d& pos) const;
+		bool isInflatedOccupied(const Eigen::Vector3d& pos) const;
+		bool isFree(const Eigen::Vector3d& pos) const;
+		bool isUnknown(const Eigen::Vector3d& pos) const;
+	};
+
+	inline bool mapDeltaClient::isInitialized() const{
+		return this->initialized_;
+	}
+
+	inline double mapDeltaClient::getRes() const{
+		return this->res_;
+	}
+
+	inline uint8_t mapDeltaClient::getState(const Eigen::Vector3d& pos) const{
+		if (not this->initialized_) return DELTA_VOXEL_UNKNOWN;
+		Eigen::Vector3i idx;
+		for (int i=0; i<3; ++i){
+			idx(i) = floor((pos(i) - this->origin_(i))/this->res_);
+			if (idx(i) < 0 or idx(i) >= this->mapVoxel_(i)) return DELTA_VOXEL_UNKNOWN;
+		}
+		return this->states_[(size_t(idx(0)) * this->mapVoxel_(1) + idx(1)) * this->mapVoxel_(2) + idx(2)];
+	}
+
+	inline bool mapDeltaClient::isOccupied(const Eigen::Vector3d& pos) const{
+		return this->getState(pos) == DELTA_VOXEL_OCCUPIED;
+	}
+
+	inline bool mapDeltaClient::isInflatedOccupied(const Eigen::Vector3d& pos) const{
+		uint8_t state = this->getState(pos);
+		return state == DELTA_VOXEL_OCCUPIED or state == DELTA_VOXEL_INFLATED;
+	}
+
+	inline bool mapDeltaClient::isFree(const Eigen::Vector3d& pos) const{
+		return this->getState(pos) == DELTA_VOXEL_FREE;
+	}
+
+	inline bool mapDeltaClient::isUnknown(const Eigen::Vector3d& pos) const{
+		return this->getState(pos) == DELTA_VOXEL_UNKNOWN;
+	}
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*
+	FILE: mapGeometry.h
+	--------------------------------------
+	voxel addressing policies and index math of the map arrays
+*/
+#ifndef MAPMANAGER_MAPGEOMETRY
+#define MAPMANAGER_MAPGEOMETRY
+#include <Eigen/Eigen>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// addressing policy of all voxel arrays, selected at compile time (cmake -DMAP_ADDRESSING=linear/linear_pow2/tiled/morton)
+#define MAP_ADDRESSING_LINEAR 0
+#define MAP_ADDRESSING_TILED 1
+#define MAP_ADDRESSING_MORTON 2
+#define MAP_ADDRESSING_LINEAR_POW2 3
+#ifndef MAP_ADDRESSING
+#define MAP_ADDRESSING MAP_ADDRESSING_LINEAR
+#endif
+
+namespace mapManager{
+	// x-major linear addressing: (x * Ny + y) * Nz + z
+	class linearAddressing{
+	private:
+		int dimY_ = 0, dimZ_ = 0;
+		int size_ = 0;
+
+	public:
+		static const uint32_t ID = MAP_ADDRESSING_LINEAR;
+		static const int Z_RUN = 1 << 30; // z runs of this aligned length are contiguous in memory
+
+		void init(const Eigen::Vector3i& mapVoxelMax){
+			this->dimY_ = mapVoxelMax(1);
+			this->dimZ_ = mapVoxelMax(2);
+			this->size_ = mapVoxelMax(0) * mapVoxelMax(1) * mapVoxelMax(2);
+		}
+
+		int size() const{
+			return this->size_;
+		}
+
+		int address(int x, int y, int z) const{
+			return (x * this->dimY_ + y) * this->dimZ_ + z;
+		}
+
+		void index(int address, Eigen::Vector3i& idx) const{
+			int sliceSize = this->dimY_ * this->dimZ_;
+			idx(0) = address / sliceSize;
+			address -= idx(0) * sliceSize;
+			idx(1) = address / this->dimZ_;
+			idx(2) = address - idx(1) * this->dimZ_;
+		}
+	};
+
+	// x-major linear addressing with y and z padded to powers of two: (x << (yBits + zBits)) | (y << zBits) | z
+	class linearPow2Addressing{
+	private:
+		int shiftX_ = 0, shiftY_ = 0;
+		int maskY_ = 0, maskZ_ = 0;
+		int size_ = 0;
+
+	public:
+		static const uint32_t ID = MAP_ADDRESSING_LINEAR_POW2;
+		static const int Z_RUN = 1 << 30;
+
+		void init(const Eigen::Vector3i& mapVoxelMax){
+			int yBits = 0, zBits = 0;
+			while ((1 << yBits) < mapVoxelMax(1)) ++yBits;
+			while ((1 << zBits) < mapVoxelMax(2)) ++zBits;
+			this->shiftY_ = zBits;
+			this->shiftX_ = yBits + zBits;
+			this->maskY_ = (1 << yBits) - 1;
+			this->maskZ_ = (1 << zBits) - 1;
+			this->size_ = mapVoxelMax(0) << this->shiftX_;
+		}
+
+		int size() const{
+			return this->size_;
+		}
+
+		int address(int x, int y, int z) const{
+			return (x << this->shiftX_) | (y << this->shiftY_) | z;
+		}
+
+		void index(int address, Eigen::Vector3i& idx) const{
+			idx(0) = address >> this->shiftX_;
+			idx(1) = (address >> this->shiftY_) & this->maskY_;
+			idx(2) = address & this->maskZ_;
+		}
+	};
+
+	// 8x8x8 bricks in x-major order, x-major voxels inside a brick (each axis padded to a multiple of 8)
+	class tiledAddressing{
+	private:
+		int brickNumY_ = 0, brickNumZ_ = 0;
+		int size_ = 0;
+
+	public:
+		static const uint32_t ID = MAP_ADDRESSING_TILED;
+		static const int Z_RUN = 8;
+
+		void init(const Eigen::Vector3i& mapVoxelMax){
+			Eigen::Vector3i brickNum = (mapVoxelMax + Eigen::Vector3i::Constant(7)) / 8;
+			this->brickNumY_ = brickNum(1);
+			this->brickNumZ_ = brickNum(2);
+			this->size_ = brickNum(0) * brickNum(1) * brickNum(2) * 512;
+		}
+
+		int size() const{
+			return this->size_;
+		}
+
+		int address(int x, int y, int z) const{
+			int brick = ((x >> 3) * this->brickNumY_ + (y >> 3)) * this->brickNumZ_ + (z >> 3);
+			return (brick << 9) | ((x & 7) << 6) | ((y & 7) << 3) | (z & 7);
+		}
+
+		void index(int address, Eigen::Vector3i& idx) const{
+			int brick = address >> 9;
+			int brickX = brick / (this->brickNumY_ * this->brickNumZ_);
+			brick -= brickX * this->brickNumY_ * this->brickNumZ_;
+			int brickY = brick / this->brickNumZ_;
+			int brickZ = brick - brickY * this->brickNumZ_;
+			idx(0) = (brickX << 3) | ((address >> 6) & 7);
+			idx(1) = (brickY << 3) | ((address >> 3) & 7);
+			idx(2) = (brickZ << 3) | (address & 7);
+		}
+	};
+
+	// Morton (Z-order) addressing: each axis is padded to a power of two and the coordinate bits are
+	// interleaved z, y, x from the lowest bit while the axis still has bits (table lookups both ways)
+	class mortonAddressing{
+	private:
+		std::vector<int> bits_[3]; // address bits of each coordinate value
+		std::vector<Eigen::Vector3i> inverse_[4]; // coordinates of each byte of an address
+		int size_ = 0;
+
+	public:
+		static const uint32_t ID = MAP_ADDRESSING_MORTON;
+		static const int Z_RUN = 2;
+
+		void init(const Eigen::Vector3i& mapVoxelMax){
+			// axis and level of each address bit
+			int axisBits[3] = {0, 0, 0};
+			for (int i=0; i<3; ++i){
+				while ((1 << axisBits[i]) < mapVoxelMax(i)) ++axisBits[i];
+			}
+			int bitAxis[32], bitLevel[32];
+			int bitNum = 0;
+			for (int level=0; level<std::max(axisBits[0], std::max(axisBits[1], axisBits[2])); ++level){
+				for (int i=2; i>=0; --i){ // z first
+					if (level < axisBits[i]){
+						bitAxis[bitNum] = i;
+						bitLevel[bitNum] = level;
+						++bitNum;
+					}
+				}
+			}
+
+			for (int i=0; i<3; ++i){
+				this->bits_[i].assign(1 << axisBits[i], 0);
+			}
+			for (int b=0; b<4; ++b){
+				this->inverse_[b].assign(256, Eigen::Vector3i::Zero());
+			}
+			for (int n=0; n<bitNum; ++n){
+				std::vector<int>& bits = this->bits_[bitAxis[n]];
+				for (int v=0; v<int(bits.size()); ++v){
+					if (v & (1 << bitLevel[n])) bits[v] |= 1 << n;
+				}
+				for (int byte=0; byte<256; ++byte){
+					if (byte & (1 << (n % 8))) this->inverse_[n / 8][byte](bitAxis[n]) |= 1 << bitLevel[n];
+				}
+			}
+			this->size_ = 1 << bitNum;
+		}
+
+		int size() const{
+			return this->size_;
+		}
+
+		int address(int x, int y, int z) const{
+			return this->bits_[0][x] | this->bits_[1][y] | this->bits_[2][z];
+		}
+
+		void index(int address, Eigen::Vector3i& idx) const{
+			idx = this->inverse_[0][address & 0xff] + this->inverse_[1][(address >> 8) & 0xff] + this->inverse_[2][(address >> 16) & 0xff] + this->inverse_[3][(address >> 24) & 0xff];
+		}
+	};
+
+#if MAP_ADDRESSING == MAP_ADDRESSING_TILED
+	typedef tiledAddressing mapAddressing;
+#elif MAP_ADDRESSING == MAP_ADDRESSING_MORTON
+	typedef mortonAddressing mapAddressing;
+#elif MAP_ADDRESSING == MAP_ADDRESSING_LINEAR_POW2
+	typedef linearPow2Addressing mapAddressing;
+#else
+	typedef linearAddressing mapAddressing;
+#endif
+
+	// index math of a map (voxel index range is [0, dim)): multiplies by the precomputed inverse resolution,
+	// floors without a libm call and checks bounds with one unsigned compare per axis
+	template <typename Addressing>
+	class mapGeometry{
+	private:
+		Eigen::Vector3d origin_; // min corner of the map
+		double res_ = 0.0, resInv_ = 0.0;
+		Eigen::Vector3i dim_ = Eigen::Vector3i::Zero();
+		Addressing addressing_;
+
+	public:
+		typedef Addressing addressing;
+
+		void init(const Eigen::Vector3d& origin, double res, const Eigen::Vector3i& dim){
+			this->origin_ = origin;
+			this->res_ = res;
+			this->resInv_ = 1.0 / res;
+			this->dim_ = dim;
+			this->addressing_.init(dim);
+		}
+
+		int size() const{
+			return this->addressing_.size();
+		}
+
+		double resInv() const{
+			return this->resInv_;
+		}
+
+		void posToIndex(const Eigen::Vector3d& pos, Eigen::Vector3i& idx) const{
+			for (int i=0; i<3; ++i){
+				double v = (pos(i) - this->origin_(i)) * this->resInv_;
+				int vi = int(v);
+				idx(i) = vi - (v < vi); // floor
+			}
+		}
+
+		// continuous voxel coordinates (floor gives posToIndex)
+		Eigen::Vector3d posToVoxel(const Eigen::Vector3d& pos) const{
+			return (pos - this->origin_) * this->resInv_;
+		}
+
+		void indexToPos(const Eigen::Vector3i& idx, Eigen::Vector3d& pos) const{
+			for (int i=0; i<3; ++i){
+				pos(i) = (idx(i) + 0.5) * this->res_ + this->origin_(i);
+			}
+		}
+
+		bool isInMap(const Eigen::Vector3i& idx) const{
+			return (unsigned(idx(0)) < unsigned(this->dim_(0))) & (unsigned(idx(1)) < unsigned(this->dim_(1))) & (unsigned(idx(2)) < unsigned(this->dim_(2)));
+		}
+
+		int address(int x, int y, int z) const{
+			return this->addressing_.address(x, y, z);
+		}
+
+		void index(int address, Eigen::Vector3i& idx) const{
+			this->addressing_.index(address, idx);
+		}
+	};
+}
+
+#endif
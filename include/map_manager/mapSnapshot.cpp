@@ -0,0 +1,208 @@
+/*
+	FILE: mapSnapshot.cpp
+	--------------------------------------
+	function definition of binary map snapshot and compact map file
+*/
+#include <map_manager/mapSnapshot.h>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace mapManager{
+	static const char SNAPSHOT_MAGIC[8] = {'M', 'M', 'S', 'N', 'A', 'P', '\0', '\0'};
+	static const uint64_t SNAPSHOT_ALIGN = 4096;
+	static const char COMPACT_MAP_MAGIC[8] = {'M', 'M', 'C', 'O', 'M', 'P', '\0', '\0'};
+
+	static uint64_t alignUp(uint64_t x){
+		return (x + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+	}
+
+	static uint64_t snapshotFileSize(const snapshotHeader& header){
+		uint64_t size = alignUp(sizeof(snapshotHeader));
+		if (header.layers & SNAPSHOT_LAYER_OCCUPANCY) size = std::max(size, header.occupancyOffset + alignUp(header.voxelNum * sizeof(double)));
+		if (header.layers & SNAPSHOT_LAYER_INFLATED) size = std::max(size, header.inflatedOffset + alignUp(header.voxelNum * sizeof(uint8_t)));
+		if (header.layers & SNAPSHOT_LAYER_ESDF) size = std::max(size, header.esdfOffset + alignUp(header.voxelNum * sizeof(double)));
+		return size;
+	}
+
+	mapSnapshot::~mapSnapshot(){
+		this->close();
+	}
+
+	bool mapSnapshot::isSnapshotFile(const std::string& path){
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		char magic[8];
+		bool isSnapshot = (::read(fd, magic, sizeof(magic)) == sizeof(magic)) and (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0);
+		::close(fd);
+		return isSnapshot;
+	}
+
+	void mapSnapshot::initHeader(snapshotHeader& header, uint32_t layers, uint64_t voxelNum){
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.version = SNAPSHOT_VERSION;
+		header.headerSize = sizeof(snapshotHeader);
+		header.layers = layers;
+		header.voxelNum = voxelNum;
+
+		uint64_t offset = alignUp(sizeof(snapshotHeader));
+		if (layers & SNAPSHOT_LAYER_OCCUPANCY){
+			header.occupancyOffset = offset;
+			offset += alignUp(voxelNum * sizeof(double));
+		}
+		if (layers & SNAPSHOT_LAYER_INFLATED){
+			header.inflatedOffset = offset;
+			offset += alignUp(voxelNum * sizeof(uint8_t));
+		}
+		if (layers & SNAPSHOT_LAYER_ESDF){
+			header.esdfOffset = offset;
+			offset += alignUp(voxelNum * sizeof(double));
+		}
+	}
+
+	bool mapSnapshot::open(const std::string& path, bool writable){
+		this->close();
+		this->fd_ = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+		if (this->fd_ < 0) return false;
+
+		struct stat st;
+		if (fstat(this->fd_, &st) != 0 or size_t(st.st_size) < sizeof(snapshotHeader)){
+			this->close();
+			return false;
+		}
+
+		this->size_ = st.st_size;
+		void* ptr = mmap(nullptr, this->size_, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, this->fd_, 0);
+		if (ptr == MAP_FAILED){
+			this->close();
+			return false;
+		}
+		this->data_ = static_cast<unsigned char*>(ptr);
+
+		// validate header before anyone touches the layers
+		const snapshotHeader& header = this->header();
+		if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 or header.version != SNAPSHOT_VERSION or
+			header.headerSize != sizeof(snapshotHeader) or snapshotFileSize(header) > this->size_){
+			this->close();
+			return false;
+		}
+		return true;
+	}
+
+	bool mapSnapshot::create(const std::string& path, const snapshotHeader& header){
+		this->close();
+		this->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (this->fd_ < 0) return false;
+
+		this->size_ = snapshotFileSize(header);
+		if (ftruncate(this->fd_, this->size_) != 0){
+			this->close();
+			return false;
+		}
+
+		void* ptr = mmap(nullptr, this->size_, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd_, 0);
+		if (ptr == MAP_FAILED){
+			this->close();
+			return false;
+		}
+		this->data_ = static_cast<unsigned char*>(ptr);
+		memcpy(this->data_, &header, sizeof(snapshotHeader));
+		return true;
+	}
+
+	bool mapSnapshot::sync(){
+		if (not this->isOpen()) return false;
+		return msync(this->data_, this->size_, MS_SYNC) == 0;
+	}
+
+	void mapSnapshot::close(){
+		if (this->data_ != nullptr){
+			munmap(this->data_, this->size_);
+			this->data_ = nullptr;
+		}
+		if (this->fd_ >= 0){
+			::close(this->fd_);
+			this->fd_ = -1;
+		}
+		this->size_ = 0;
+	}
+
+	bool mapSnapshot::isCompatible(const snapshotHeader& header) const{
+		if (not this->isOpen()) return false;
+		const snapshotHeader& curr = this->header();
+		return curr.layers == header.layers and curr.addressing == header.addressing and curr.voxelNum == header.voxelNum and curr.resolution == header.resolution and
+			   curr.mapSizeMin[0] == header.mapSizeMin[0] and curr.mapSizeMin[1] == header.mapSizeMin[1] and curr.mapSizeMin[2] == header.mapSizeMin[2] and
+			   curr.mapVoxelMax[0] == header.mapVoxelMax[0] and curr.mapVoxelMax[1] == header.mapVoxelMax[1] and curr.mapVoxelMax[2] == header.mapVoxelMax[2];
+	}
+
+	bool isCompactMapFile(const std::string& path){
+		std::ifstream file (path, std::ios::binary);
+		char magic[8];
+		return file.read(magic, sizeof(magic)) and memcmp(magic, COMPACT_MAP_MAGIC, sizeof(magic)) == 0;
+	}
+
+	void initCompactMapHeader(compactMapHeader& header){
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, COMPACT_MAP_MAGIC, sizeof(header.magic));
+		header.version = COMPACT_MAP_VERSION;
+		header.headerSize = sizeof(compactMapHeader);
+	}
+
+	bool writeCompactMap(const std::string& path, compactMapHeader& header, const std::vector<uint8_t>& states){
+		std::vector<uint8_t> runs;
+		header.runNum = 0;
+		size_t i = 0;
+		while (i < states.size()){
+			size_t j = i + 1;
+			while (j < states.size() and states[j] == states[i]) ++j;
+			uint64_t run = (uint64_t(j - i) << 2) | states[i];
+			while (run >= 0x80){
+				runs.push_back(uint8_t(run & 0x7f) | 0x80);
+				run >>= 7;
+			}
+			runs.push_back(uint8_t(run));
+			++header.runNum;
+			i = j;
+		}
+
+		std::ofstream file (path, std::ios::binary | std::ios::trunc);
+		if (not file.is_open()) return false;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(runs.data()), runs.size());
+		return bool(file);
+	}
+
+	bool readCompactMap(const std::string& path, compactMapHeader& header, std::vector<uint8_t>& states){
+		std::ifstream file (path, std::ios::binary);
+		if (not file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+		if (memcmp(header.magic, COMPACT_MAP_MAGIC, sizeof(header.magic)) != 0 or header.version != COMPACT_MAP_VERSION or
+			header.headerSize != sizeof(compactMapHeader) or header.dim[0] < 0 or header.dim[1] < 0 or header.dim[2] < 0){
+			return false;
+		}
+
+		std::vector<uint8_t> runs ((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const size_t voxelNum = size_t(header.dim[0]) * header.dim[1] * header.dim[2];
+		states.clear();
+		states.reserve(voxelNum);
+		size_t pos = 0;
+		for (uint64_t r=0; r<header.runNum; ++r){
+			uint64_t run = 0;
+			int shift = 0;
+			while (pos < runs.size()){
+				uint8_t byte = runs[pos++];
+				run |= uint64_t(byte & 0x7f) << shift;
+				shift += 7;
+				if (not (byte & 0x80)) break;
+			}
+			uint64_t length = run >> 2;
+			if (states.size() + length > voxelNum) return false;
+			states.insert(states.end(), length, uint8_t(run & 0x3));
+		}
+		return states.size() == voxelNum;
+	}
+}
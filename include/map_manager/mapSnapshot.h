@@ -0,0 +1,125 @@
+/*
+	FILE: mapSnapshot.h
+	--------------------------------------
+	binary map snapshot and compact map file header file
+*/
+#ifndef MAPMANAGER_MAPSNAPSHOT
+#define MAPMANAGER_MAPSNAPSHOT
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace mapManager{
+	// layers stored in the snapshot file
+	const uint32_t SNAPSHOT_LAYER_OCCUPANCY = 1u << 0; // log odds (double per voxel)
+	const uint32_t SNAPSHOT_LAYER_INFLATED = 1u << 1; // inflated occupancy (uint8 per voxel)
+	const uint32_t SNAPSHOT_LAYER_ESDF = 1u << 2; // signed distance (double per voxel)
+
+	const uint32_t SNAPSHOT_VERSION = 1;
+
+	// fixed size file header. Every layer is stored raw in the same voxel address order as the
+	// map arrays and starts at a page aligned offset, so the file can be mapped and used directly.
+	// A snapshot can only be loaded by a map built with the same addressing policy.
+	struct snapshotHeader{
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t layers;
+		uint32_t addressing; // voxel addressing policy of the layers (MAP_ADDRESSING_*, 0: linear)
+		double resolution;
+		double mapSizeMin[3];
+		int32_t mapVoxelMax[3];
+		int32_t padding;
+		uint64_t voxelNum; // voxels per layer
+		double currMapRangeMin[3];
+		double currMapRangeMax[3];
+		double pMinLog, pMaxLog, pOccLog;
+		uint64_t occupancyOffset;
+		uint64_t inflatedOffset;
+		uint64_t esdfOffset;
+	};
+
+	// voxel states of the compact map file
+	const uint8_t COMPACT_VOXEL_UNKNOWN = 0;
+	const uint8_t COMPACT_VOXEL_FREE = 1;
+	const uint8_t COMPACT_VOXEL_OCCUPIED = 2;
+
+	const uint32_t COMPACT_MAP_VERSION = 1;
+
+	// compact map file: header followed by run length encoded voxel states of a region
+	// in x-major (x, y, z) order. Each run is a varint of (length << 2 | state).
+	struct compactMapHeader{
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		double resolution;
+		double origin[3]; // position of the min corner of the region
+		int32_t dim[3]; // region size in voxel
+		int32_t padding;
+		uint64_t runNum;
+	};
+
+	bool isCompactMapFile(const std::string& path);
+	void initCompactMapHeader(compactMapHeader& header);
+	bool writeCompactMap(const std::string& path, compactMapHeader& header, const std::vector<uint8_t>& states);
+	bool readCompactMap(const std::string& path, compactMapHeader& header, std::vector<uint8_t>& states);
+
+	class mapSnapshot{
+	private:
+		int fd_ = -1;
+		unsigned char* data_ = nullptr;
+		size_t size_ = 0;
+
+	public:
+		mapSnapshot() = default;
+		mapSnapshot(const mapSnapshot&) = delete;
+		mapSnapshot& operator=(const mapSnapshot&) = delete;
+		~mapSnapshot();
+
+		static bool isSnapshotFile(const std::string& path);
+		static void initHeader(snapshotHeader& header, uint32_t layers, uint64_t voxelNum);
+
+		bool open(const std::string& path, bool writable=false); // map an existing snapshot
+		bool create(const std::string& path, const snapshotHeader& header); // create (or truncate) and map a snapshot
+		bool sync();
+		void close();
+		bool isOpen() const;
+		bool isCompatible(const snapshotHeader& header) const; // same geometry and layers
+
+		snapshotHeader& header();
+		const snapshotHeader& header() const;
+		double* occupancy();
+		uint8_t* inflated();
+		double* esdf();
+	};
+
+	inline bool mapSnapshot::isOpen() const{
+		return this->data_ != nullptr;
+	}
+
+	inline snapshotHeader& mapSnapshot::header(){
+		return *reinterpret_cast<snapshotHeader*>(this->data_);
+	}
+
+	inline const snapshotHeader& mapSnapshot::header() const{
+		return *reinterpret_cast<const snapshotHeader*>(this->data_);
+	}
+
+	inline double* mapSnapshot::occupancy(){
+		if (not (this->header().layers & SNAPSHOT_LAYER_OCCUPANCY)) return nullptr;
+		return reinterpret_cast<double*>(this->data_ + this->header().occupancyOffset);
+	}
+
+	inline uint8_t* mapSnapshot::inflated(){
+		if (not (this->header().layers & SNAPSHOT_LAYER_INFLATED)) return nullptr;
+		return this->data_ + this->header().inflatedOffset;
+	}
+
+	inline double* mapSnapshot::esdf(){
+		if (not (this->header().layers & SNAPSHOT_LAYER_ESDF)) return nullptr;
+		return reinterpret_cast<double*>(this->data_ + this->header().esdfOffset);
+	}
+}
+
+#endif
@@ -4,8 +4,40 @@
 	function definition of occupancy map
 */
 #include <map_manager/occupancyMap.h>
+#include <map_manager/pcdReader.h>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <pthread.h>
 
 namespace mapManager{
+	// run f(threadID) on threadNum threads (the calling thread takes ID 0)
+	template <typename F>
+	static void parallelFor(int threadNum, F f){
+		std::vector<std::thread> workers;
+		for (int t=1; t<threadNum; ++t){
+			workers.emplace_back(f, t);
+		}
+		f(0);
+		for (std::thread& worker : workers){
+			worker.join();
+		}
+	}
+
+	// out[i] = any(in[i-radius, i+radius]) along one line of a strided buffer
+	static void dilateLine(const uint8_t* in, uint8_t* out, int n, int stride, int radius){
+		int count = 0;
+		for (int i=0; i<std::min(radius+1, n); ++i){
+			count += in[i * stride];
+		}
+		for (int i=0; i<n; ++i){
+			out[i * stride] = (count > 0);
+			if (i + radius + 1 < n) count += in[(i + radius + 1) * stride];
+			if (i - radius >= 0) count -= in[(i - radius) * stride];
+		}
+	}
+
 	occMap::occMap(){
 		this->ns_ = "occupancy_map";
 		this->hint_ = "[OccMap]";
@@ -18,6 +50,15 @@ namespace mapManager{
 		this->initPrebuiltMap();
 		this->registerPub();
 		this->registerCallback();
+		this->startStageWorkers();
+	}
+
+	occMap::~occMap(){
+		this->stopStageWorkers();
+		// a map save in progress is written completely before the map goes away
+		if (this->mapSaveWorker_.joinable()){
+			this->mapSaveWorker_.join();
+		}
 	}
 
 	void occMap::initMap(const ros::NodeHandle& nh){
@@ -26,6 +67,7 @@ namespace mapManager{
 		this->initPrebuiltMap();
 		this->registerPub();
 		this->registerCallback();
+		this->startStageWorkers();
 	}
 
 	void occMap::initParam(){
@@ -154,6 +196,24 @@ namespace mapManager{
 			cout << this->hint_ << ": Depth skip pixel: " << this->skipPixel_ << endl;
 		}
 
+		// adaptive depth sampling
+		if (not this->nh_.getParam(this->ns_ + "/depth_adaptive_sampling", this->depthAdaptiveSampling_)){
+			this->depthAdaptiveSampling_ = false;
+			cout << this->hint_ << ": No depth adaptive sampling option. Use default: false." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Depth adaptive sampling: " << this->depthAdaptiveSampling_ << endl;
+		}
+
+		// ray budget of adaptive sampling
+		if (not this->nh_.getParam(this->ns_ + "/depth_ray_budget", this->depthRayBudget_)){
+			this->depthRayBudget_ = 20000;
+			cout << this->hint_ << ": No depth ray budget. Use default: 20000." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Depth ray budget: " << this->depthRayBudget_ << endl;
+		}
+
 		// ------------------------------------------------------------------------------------
 		// depth image columns
 		if (not this->nh_.getParam(this->ns_ + "/image_cols", this->imgCols_)){
@@ -173,6 +233,9 @@ namespace mapManager{
 			cout << this->hint_ << ": Depth image rows: " << this->imgRows_ << endl;
 		}
 		this->projPoints_.resize(this->imgCols_ * this->imgRows_ / (this->skipPixel_ * this->skipPixel_));
+		if (this->depthAdaptiveSampling_){
+			this->projPoints_.resize(std::max(int(this->projPoints_.size()), this->depthRayBudget_));
+		}
 		// ------------------------------------------------------------------------------------
 
 
@@ -200,6 +263,46 @@ namespace mapManager{
 			cout << this->hint_ << ": Raycast max length: " << this->raycastMaxLength_ << endl;
 		}
 
+		// integration mode
+		if (not this->nh_.getParam(this->ns_ + "/integration_mode", this->integrationMode_)){
+			this->integrationMode_ = 0;
+			cout << this->hint_ << ": No integration mode. Use default: raycasting (0)." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Integration mode: raycasting (0)/projective (1). Your option: " << this->integrationMode_ << endl;
+		}
+		if (this->integrationMode_ == 1 and this->sensorInputMode_ != 0){
+			this->integrationMode_ = 0;
+			cout << this->hint_ << ": Projective integration needs depth image input. Use raycasting (0)." << endl;
+		}
+
+		// integration budget
+		if (not this->nh_.getParam(this->ns_ + "/integration_budget", this->integrationBudget_)){
+			this->integrationBudget_ = 0;
+			cout << this->hint_ << ": No integration budget. Use default: unlimited (0)." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Integration budget (raycasting): " << this->integrationBudget_ << " us." << endl;
+		}
+
+		// ray priority
+		if (not this->nh_.getParam(this->ns_ + "/ray_priority", this->rayPriority_)){
+			this->rayPriority_ = 0;
+			cout << this->hint_ << ": No ray priority. Use default: near first (0)." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Ray priority near first (0)/unknown first (1): " << this->rayPriority_ << endl;
+		}
+
+		// batched raycasting
+		if (not this->nh_.getParam(this->ns_ + "/raycast_batch", this->raycastBatch_)){
+			this->raycastBatch_ = false;
+			cout << this->hint_ << ": No raycast batch. Use default: false." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Raycast batch: " << this->raycastBatch_ << endl;
+		}
+
 		// p hit
 		double pHit;
 		if (not this->nh_.getParam(this->ns_ + "/p_hit", pHit)){
@@ -225,7 +328,7 @@ namespace mapManager{
 		// p min
 		double pMin;
 		if (not this->nh_.getParam(this->ns_ + "/p_min", pMin)){
-			pHit = 0.12;
+			pMin = 0.12;
 			cout << this->hint_ << ": No p min. Use default: 0.12." << endl;
 		}
 		else{
@@ -265,6 +368,35 @@ namespace mapManager{
 			cout << this->hint_ << ": Map resolution: " << this->mapRes_ << endl;
 		}
 
+		// sensor model
+		if (not this->nh_.getParam(this->ns_ + "/sensor_model", this->sensorModel_)){
+			this->sensorModel_ = false;
+			cout << this->hint_ << ": No sensor model. Use default: false." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Sensor model: " << this->sensorModel_ << endl;
+		}
+
+		// sensor noise
+		this->sensorNoise_ = (this->sensorInputMode_ == 0) ? depthCameraModel::defaultNoise() : lidarModel::defaultNoise();
+		std::vector<double> sensorNoiseVec;
+		if (not this->nh_.getParam(this->ns_ + "/sensor_noise", sensorNoiseVec) or sensorNoiseVec.size() != 3){
+			cout << this->hint_ << ": No sensor noise. Use default: [" << this->sensorNoise_(0) << ", " << this->sensorNoise_(1) << ", " << this->sensorNoise_(2) << "]." << endl;
+		}
+		else{
+			this->sensorNoise_ = Eigen::Vector3d (sensorNoiseVec[0], sensorNoiseVec[1], sensorNoiseVec[2]);
+			cout << this->hint_ << ": Sensor noise: [" << this->sensorNoise_(0) << ", " << this->sensorNoise_(1) << ", " << this->sensorNoise_(2) << "]" << endl;
+		}
+		if (not this->sensorModel_){
+			this->sensorModelTable_.init<constantSensorModel>(this->pHitLog_, this->pMissLog_, this->sensorNoise_, this->mapRes_, this->raycastMaxLength_);
+		}
+		else if (this->sensorInputMode_ == 0){
+			this->sensorModelTable_.init<depthCameraModel>(this->pHitLog_, this->pMissLog_, this->sensorNoise_, this->mapRes_, this->raycastMaxLength_);
+		}
+		else{
+			this->sensorModelTable_.init<lidarModel>(this->pHitLog_, this->pMissLog_, this->sensorNoise_, this->mapRes_, this->raycastMaxLength_);
+		}
+
 		// ground height
 		if (not this->nh_.getParam(this->ns_ + "/ground_height", this->groundHeight_)){
 			this->groundHeight_ = 0.0;
@@ -296,14 +428,37 @@ namespace mapManager{
 			this->mapVoxelMin_(1) = 0; this->mapVoxelMax_(1) = ceil(mapSizeVec[1]/this->mapRes_);
 			this->mapVoxelMin_(2) = 0; this->mapVoxelMax_(2) = ceil(mapSizeVec[2]/this->mapRes_);
 
-			// reserve vector for variables
-			int reservedSize = this->mapVoxelMax_(0) * this->mapVoxelMax_(1) * this->mapVoxelMax_(2);
-			this->countHitMiss_.resize(reservedSize, 0);
-			this->countHit_.resize(reservedSize, 0);
+			// reserve vector for variables (the addressing policy may pad the map arrays)
+			this->geometry_.init(this->mapSizeMin_, this->mapRes_, this->mapVoxelMax_);
+			int reservedSize = this->geometry_.size();
+			this->voxelCount_.resize(reservedSize);
+			this->updateVoxelCache_.reserve(std::min(reservedSize, 1 << 20)); // grows once if a frame touches more voxels
 			this->occupancy_.resize(reservedSize, this->pMinLog_-this->UNKNOWN_FLAG_);
-			this->occupancyInflated_.resize(reservedSize, false);
+			this->occupancyInflated_.resize(reservedSize, 0);
 			this->flagTraverse_.resize(reservedSize, -1);
 			this->flagRayend_.resize(reservedSize, -1);
+			if (this->sensorInputMode_ == 1){
+				this->endpointSlot_.resize(reservedSize, 0);
+			}
+
+			// change tracking blocks (everything starts as changed)
+			this->blockNum_ = (this->mapVoxelMax_ + Eigen::Vector3i::Constant(DELTA_BLOCK_SIZE - 1)) / DELTA_BLOCK_SIZE;
+			this->blockVersion_.resize(this->blockNum_(0) * this->blockNum_(1) * this->blockNum_(2), 1);
+			for (int consumer=0; consumer<DIRTY_CONSUMER_NUM; ++consumer){
+				this->blockQueued_[consumer].resize(this->blockVersion_.size(), 1);
+				this->dirtyBlocks_[consumer].resize(this->blockVersion_.size());
+				std::iota(this->dirtyBlocks_[consumer].begin(), this->dirtyBlocks_[consumer].end(), 0);
+			}
+			this->blockClearVersion_.resize(this->blockVersion_.size(), 0);
+			this->clearedMask_.resize(this->blockVersion_.size() * DELTA_BLOCK_SIZE, 0);
+			this->occupiedMask_.resize(this->blockVersion_.size() * DELTA_BLOCK_SIZE, 0);
+			this->inflatedMask_.resize(this->blockVersion_.size() * DELTA_BLOCK_SIZE, 0);
+			this->exploredMask_.resize(this->blockVersion_.size() * DELTA_BLOCK_SIZE, 0);
+			for (int level=1; level<=PYRAMID_LEVELS; ++level){
+				// nothing can be skipped until the first pyramid update
+				this->pyramidDim_[level-1] = (this->blockNum_ * DELTA_BLOCK_SIZE + Eigen::Vector3i::Constant((1 << level) - 1)) / (1 << level);
+				this->mapPyramid_[level-1].resize(this->pyramidDim_[level-1](0) * this->pyramidDim_[level-1](1) * this->pyramidDim_[level-1](2), PYRAMID_OCCUPIED | PYRAMID_UNKNOWN);
+			}
 
 			cout << this->hint_ << ": Map size: " << "[" << mapSizeVec[0] << ", " << mapSizeVec[1] << ", " << mapSizeVec[2] << "]" << endl;
 		}
@@ -347,6 +502,15 @@ namespace mapManager{
 			cout << this->hint_ << ": the prebuilt map absolute dir is found: " << this->prebuiltMapDir_ << endl;
 		}
 
+		// default file for map snapshot service (.snap)
+		if (not this->nh_.getParam(this->ns_ + "/snapshot_file", this->snapshotFile_)){
+			this->snapshotFile_ = "./map_snapshot.snap";
+			cout << this->hint_ << ": No snapshot file. Use default: ./map_snapshot.snap" << endl;
+		}
+		else{
+			cout << this->hint_ << ": Snapshot file: " << this->snapshotFile_ << endl;
+		}
+
 		// local map size (visualization)
 		std::vector<double> localMapSizeVec;
 		if (not this->nh_.getParam(this->ns_ + "/local_map_size", localMapSizeVec)){
@@ -368,6 +532,25 @@ namespace mapManager{
 			cout << this->hint_ << ": Max visualization height: " << this->maxVisHeight_ << endl;
 		}
 
+		// height band of 2D occupancy grid
+		std::vector<double> grid2DHeightBandVec;
+		if (not this->nh_.getParam(this->ns_ + "/occupancy_grid_height_band", grid2DHeightBandVec) or grid2DHeightBandVec.size() != 2){
+			grid2DHeightBandVec = std::vector<double>{0.1, 1.0};
+			cout << this->hint_ << ": No 2D occupancy grid height band. Use default: [0.1, 1.0] m above ground." << endl;
+		}
+		else{
+			cout << this->hint_ << ": 2D occupancy grid height band: " << "[" << grid2DHeightBandVec[0] << ", " << grid2DHeightBandVec[1] << "] m above ground." << endl;
+		}
+		this->grid2DHeightBand_(0) = grid2DHeightBandVec[0]; this->grid2DHeightBand_(1) = grid2DHeightBandVec[1];
+		this->map2DMsg_.header.frame_id = "map";
+		this->map2DMsg_.info.resolution = this->mapRes_;
+		this->map2DMsg_.info.width = this->mapVoxelMax_(0);
+		this->map2DMsg_.info.height = this->mapVoxelMax_(1);
+		this->map2DMsg_.info.origin.position.x = this->mapSizeMin_(0);
+		this->map2DMsg_.info.origin.position.y = this->mapSizeMin_(1);
+		this->map2DMsg_.info.origin.position.z = this->groundHeight_ + this->grid2DHeightBand_(0);
+		this->map2DMsg_.data.assign(this->mapVoxelMax_(0) * this->mapVoxelMax_(1), -1);
+
 		// visualize global map
 		if (not this->nh_.getParam(this->ns_ + "/visualize_global_map", this->visGlobalMap_)){
 			this->visGlobalMap_ = false;
@@ -377,6 +560,56 @@ namespace mapManager{
 			cout << this->hint_ << ": Visualize map option. local (0)/global (1): " << this->visGlobalMap_ << endl;
 		}
 
+		// publish map delta
+		if (not this->nh_.getParam(this->ns_ + "/publish_map_delta", this->publishMapDelta_)){
+			this->publishMapDelta_ = false;
+			cout << this->hint_ << ": No publish map delta option. Use default: false." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Publish map delta: " << this->publishMapDelta_ << endl;
+		}
+
+		// map delta keyframe interval
+		if (not this->nh_.getParam(this->ns_ + "/map_delta_keyframe_interval", this->deltaKeyframeInterval_)){
+			this->deltaKeyframeInterval_ = 50;
+			cout << this->hint_ << ": No map delta keyframe interval. Use default: 50." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Map delta keyframe interval: " << this->deltaKeyframeInterval_ << endl;
+		}
+		this->deltaKeyframeInterval_ = std::max(1, this->deltaKeyframeInterval_);
+
+		// thread model
+		if (not this->nh_.getParam(this->ns_ + "/thread_model", this->threadModel_)){
+			this->threadModel_ = 0;
+			cout << this->hint_ << ": No thread model. Use default: single thread (0)." << endl;
+		}
+		else{
+			cout << this->hint_ << ": Thread model single (0)/per stage (1): " << this->threadModel_ << endl;
+		}
+
+		// cpu affinity of the stage threads
+		if (not this->nh_.getParam(this->ns_ + "/cpu_affinity", this->cpuAffinity_)){
+			if (this->threadModel_ == 1){
+				cout << this->hint_ << ": No cpu affinity. Use default: not pinned." << endl;
+			}
+		}
+		else{
+			cout << this->hint_ << ": CPU affinity (ingestion, integration, ESDF, visualization, query): ";
+			for (int core : this->cpuAffinity_){
+				cout << core << " ";
+			}
+			cout << endl;
+		}
+		this->cpuAffinity_.resize(STAGE_NUM, -1);
+
+		for (int i=0; i<STAGE_NUM; ++i){
+			this->stageNh_[i] = this->nh_;
+			if (this->threadModel_ == 1){
+				this->stageNh_[i].setCallbackQueue(&this->stageQueue_[i]);
+			}
+		}
+
 		// verbose
 		if (not this->nh_.getParam(this->ns_ + "/verbose", this->verbose_)){
 			this->verbose_ = true;
@@ -395,92 +628,284 @@ namespace mapManager{
 	}
 
 	void occMap::initPrebuiltMap(){
-		pcl::PointCloud<pcl::PointXYZ>::Ptr cloud (new pcl::PointCloud<pcl::PointXYZ>);
+		// binary snapshot can be mapped directly without rebuilding the map
+		if (mapSnapshot::isSnapshotFile(this->prebuiltMapDir_)){
+			this->loadMapSnapshot(this->prebuiltMapDir_);
+			this->updateMapPyramid();
+			return;
+		}
 
-		if (pcl::io::loadPCDFile<pcl::PointXYZ> (this->prebuiltMapDir_, *cloud) == -1) //* load the file
-		{
-			cout << this->hint_ << ": No prebuilt map found/not using the prebuilt map." << endl;
+		// compact map saved by the save_map service
+		if (isCompactMapFile(this->prebuiltMapDir_)){
+			this->loadCompactMap(this->prebuiltMapDir_);
+			this->updateMapPyramid();
+			return;
 		}
-		else {
-			cout << this->hint_ << ": Map loaded with " << cloud->width * cloud->height << " data points. " << endl;
-			int address;
-			Eigen::Vector3i pointIndex;
-			Eigen::Vector3d pointPos;
-			Eigen::Vector3i inflateIndex;
-			int inflateAddress;
-
-			// update occupancy info
-			int xInflateSize = ceil(this->robotSize_(0)/(2*this->mapRes_));
-			int yInflateSize = ceil(this->robotSize_(1)/(2*this->mapRes_));
-			int zInflateSize = ceil(this->robotSize_(2)/(2*this->mapRes_));
-
-			Eigen::Vector3d currMapRangeMin (0.0, 0.0, 0.0);
-			Eigen::Vector3d currMapRangeMax (0.0, 0.0, 0.0);
-
-			const int  maxIndex = this->mapVoxelMax_(0) * this->mapVoxelMax_(1) * this->mapVoxelMax_(2);
-			for (const auto& point: *cloud)
-			{
-				address = this->posToAddress(point.x, point.y, point.z);
-				pointPos(0) = point.x; pointPos(1) = point.y; pointPos(2) = point.z;
-				this->posToIndex(pointPos, pointIndex);
-
-				this->occupancy_[address] = this->pMaxLog_;
-				// update map range
-				if (pointPos(0) < currMapRangeMin(0)){
-					currMapRangeMin(0) = pointPos(0);
-				}
 
-				if (pointPos(0) > currMapRangeMax(0)){
-					currMapRangeMax(0) = pointPos(0);
+		// stream the cloud chunk by chunk (PCL is only used for compressed files)
+		const size_t chunkSize = 1 << 20;
+		pcdReader reader;
+		pcl::PointCloud<pcl::PointXYZ> cloud;
+		size_t cloudPointsRead = 0;
+		std::function<size_t(std::vector<Eigen::Vector3d>&)> readChunk;
+		if (reader.open(this->prebuiltMapDir_)){
+			readChunk = [&](std::vector<Eigen::Vector3d>& chunk){return reader.readChunk(chunk, chunkSize);};
+		}
+		else if (pcl::io::loadPCDFile<pcl::PointXYZ> (this->prebuiltMapDir_, cloud) != -1){
+			readChunk = [&](std::vector<Eigen::Vector3d>& chunk){
+				chunk.clear();
+				for (; cloudPointsRead<cloud.size() and chunk.size()<chunkSize; ++cloudPointsRead){
+					const pcl::PointXYZ& point = cloud.points[cloudPointsRead];
+					chunk.push_back(Eigen::Vector3d (point.x, point.y, point.z));
 				}
+				return chunk.size();
+			};
+		}
+		else{
+			cout << this->hint_ << ": No prebuilt map found/not using the prebuilt map." << endl;
+			return;
+		}
 
-				if (pointPos(1) < currMapRangeMin(1)){
-					currMapRangeMin(1) = pointPos(1);
+		// bin points by voxel in parallel, each thread dedups its own bin
+		const int threadNum = std::max(1, int(std::thread::hardware_concurrency()));
+		std::vector<std::vector<int>> threadAddresses (threadNum);
+		std::vector<Eigen::Vector3d> threadRangeMin (threadNum, Eigen::Vector3d (0.0, 0.0, 0.0));
+		std::vector<Eigen::Vector3d> threadRangeMax (threadNum, Eigen::Vector3d (0.0, 0.0, 0.0));
+		std::vector<size_t> threadOutOfRangeNum (threadNum, 0);
+		std::vector<Eigen::Vector3d> chunk;
+		size_t pointNum = 0, outOfRangeNum = 0;
+		while (readChunk(chunk) > 0){
+			pointNum += chunk.size();
+			parallelFor(threadNum, [&](int t){
+				std::vector<int>& addresses = threadAddresses[t];
+				addresses.clear();
+				Eigen::Vector3i pointIndex;
+				for (size_t i=t; i<chunk.size(); i+=threadNum){
+					this->posToIndex(chunk[i], pointIndex);
+					if (not this->isInMap(pointIndex)){
+						++threadOutOfRangeNum[t];
+						continue; // those points are not in the reserved map
+					}
+					addresses.push_back(this->indexToAddress(pointIndex));
+					threadRangeMin[t] = threadRangeMin[t].cwiseMin(chunk[i]);
+					threadRangeMax[t] = threadRangeMax[t].cwiseMax(chunk[i]);
 				}
+				std::sort(addresses.begin(), addresses.end());
+				addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+			});
 
-				if (pointPos(1) > currMapRangeMax(1)){
-					currMapRangeMax(1) = pointPos(1);
+			for (const std::vector<int>& addresses : threadAddresses){
+				for (int address : addresses){
+					this->occupancy_[address] = this->pMaxLog_;
 				}
+			}
+		}
 
-				if (pointPos(2) < currMapRangeMin(2)){
-					currMapRangeMin(2) = pointPos(2);
-				}
+		Eigen::Vector3d currMapRangeMin (0.0, 0.0, 0.0);
+		Eigen::Vector3d currMapRangeMax (0.0, 0.0, 0.0);
+		for (int t=0; t<threadNum; ++t){
+			currMapRangeMin = currMapRangeMin.cwiseMin(threadRangeMin[t]);
+			currMapRangeMax = currMapRangeMax.cwiseMax(threadRangeMax[t]);
+			outOfRangeNum += threadOutOfRangeNum[t];
+		}
+		this->currMapRangeMin_ = currMapRangeMin;
+		this->currMapRangeMax_ = currMapRangeMax;
+
+		// single dilation pass over the loaded region
+		Eigen::Vector3i loadedMin, loadedMax;
+		this->posToIndex(currMapRangeMin, loadedMin);
+		this->posToIndex(currMapRangeMax, loadedMax);
+		this->boundIndex(loadedMin);
+		this->boundIndex(loadedMax);
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		this->inflateRegion(loadedMin - inflateSize, loadedMax + inflateSize);
+		cout << this->hint_ << ": Map loaded with " << pointNum << " data points (" << outOfRangeNum << " out of map range). " << endl;
+
+		// the loaded range needs a full ESDF update
+		this->localBoundMin_ = loadedMin;
+		this->localBoundMax_ = loadedMax;
+		this->esdfNeedUpdate_ = true;
+		this->updateMapPyramid();
+	}
 
-				if (pointPos(2) > currMapRangeMax(2)){
-					currMapRangeMax(2) = pointPos(2);
-				}
+	bool occMap::saveMapSnapshot(const std::string& path){
+		snapshotHeader header;
+		mapSnapshot::initHeader(header, this->getSnapshotLayers(), this->occupancy_.size());
+		header.resolution = this->mapRes_;
+		header.addressing = mapAddressing::ID;
+		for (int i=0; i<3; ++i){
+			header.mapSizeMin[i] = this->mapSizeMin_(i);
+			header.mapVoxelMax[i] = this->mapVoxelMax_(i);
+			header.currMapRangeMin[i] = this->currMapRangeMin_(i);
+			header.currMapRangeMax[i] = this->currMapRangeMax_(i);
+		}
+		header.pMinLog = this->pMinLog_;
+		header.pMaxLog = this->pMaxLog_;
+		header.pOccLog = this->pOccLog_;
+
+		// only write the changed region if the file still holds our last saved state
+		mapSnapshot snapshot;
+		bool incremental = (path == this->lastSnapshotFile_) and snapshot.open(path, true) and snapshot.isCompatible(header);
+		int beginAddress = 0;
+		int endAddress = this->occupancy_.size();
+		if (incremental){
+			if (this->snapshotDirty_){
+				// every addressing policy is monotonic in each axis, so the box lies between its corner addresses
+				beginAddress = this->indexToAddress(this->snapshotDirtyMin_);
+				endAddress = this->indexToAddress(this->snapshotDirtyMax_) + 1;
+			}
+			else{
+				beginAddress = endAddress = 0;
+			}
+			snapshotHeader& fileHeader = snapshot.header();
+			for (int i=0; i<3; ++i){
+				fileHeader.currMapRangeMin[i] = header.currMapRangeMin[i];
+				fileHeader.currMapRangeMax[i] = header.currMapRangeMax[i];
+			}
+		}
+		else if (not snapshot.create(path, header)){
+			cout << this->hint_ << ": Cannot create snapshot file: " << path << endl;
+			return false;
+		}
+
+		this->writeSnapshotLayers(snapshot, beginAddress, endAddress);
+		if (not snapshot.sync()){
+			cout << this->hint_ << ": Failed to sync snapshot file: " << path << endl;
+			return false;
+		}
+
+		if (this->verbose_){
+			cout << this->hint_ << ": Snapshot saved to " << path << " (" << (incremental ? "incremental, " : "full, ") << endAddress - beginAddress << " voxels written)." << endl;
+		}
+		this->lastSnapshotFile_ = path;
+		this->snapshotDirty_ = false;
+		return true;
+	}
 
-				for (int ix=-xInflateSize; ix<=xInflateSize; ++ix){
-					for (int iy=-yInflateSize; iy<=yInflateSize; ++iy){
-						for (int iz=-zInflateSize; iz<=zInflateSize; ++iz){
-							inflateIndex(0) = pointIndex(0) + ix;
-							inflateIndex(1) = pointIndex(1) + iy;
-							inflateIndex(2) = pointIndex(2) + iz;
-							inflateAddress = this->indexToAddress(inflateIndex);
-							if ((inflateAddress < 0) or (inflateAddress > maxIndex)){
-								continue; // those points are not in the reserved map
-							} 
-							this->occupancyInflated_[inflateAddress] = true;
+	bool occMap::loadMapSnapshot(const std::string& path){
+		mapSnapshot snapshot;
+		if (not snapshot.open(path)){
+			cout << this->hint_ << ": Invalid snapshot file: " << path << endl;
+			return false;
+		}
+
+		const snapshotHeader& header = snapshot.header();
+		bool sameGeometry = (header.voxelNum == this->occupancy_.size()) and (header.resolution == this->mapRes_) and (header.addressing == mapAddressing::ID);
+		for (int i=0; i<3; ++i){
+			sameGeometry = sameGeometry and (header.mapSizeMin[i] == this->mapSizeMin_(i)) and (header.mapVoxelMax[i] == this->mapVoxelMax_(i));
+		}
+		if (not sameGeometry or not (header.layers & SNAPSHOT_LAYER_OCCUPANCY)){
+			cout << this->hint_ << ": Snapshot map size/resolution does not match current map. Skip loading." << endl;
+			return false;
+		}
+
+		this->readSnapshotLayers(snapshot);
+		for (int i=0; i<3; ++i){
+			this->currMapRangeMin_(i) = header.currMapRangeMin[i];
+			this->currMapRangeMax_(i) = header.currMapRangeMax[i];
+		}
+		this->lastSnapshotFile_ = path;
+		this->snapshotDirty_ = false;
+		cout << this->hint_ << ": Snapshot loaded from " << path << endl;
+		return true;
+	}
+
+	bool occMap::loadCompactMap(const std::string& path){
+		compactMapHeader header;
+		std::vector<uint8_t> states;
+		if (not readCompactMap(path, header, states)){
+			cout << this->hint_ << ": Invalid compact map file: " << path << endl;
+			return false;
+		}
+		if (std::abs(header.resolution - this->mapRes_) > 1e-6){
+			cout << this->hint_ << ": Compact map resolution does not match current map. Skip loading." << endl;
+			return false;
+		}
+
+		// region offset in the current map
+		Eigen::Vector3i offset;
+		for (int i=0; i<3; ++i){
+			offset(i) = int(std::round((header.origin[i] - this->mapSizeMin_(i))/this->mapRes_));
+		}
+
+		// the region is clipped to the map once and its z lines are written as runs of contiguous addresses
+		Eigen::Vector3i dim (header.dim[0], header.dim[1], header.dim[2]);
+		Eigen::Vector3i regionMin = offset.cwiseMax(this->mapVoxelMin_);
+		Eigen::Vector3i regionMax = (offset + dim - Eigen::Vector3i (1, 1, 1)).cwiseMin(this->mapVoxelMax_ - Eigen::Vector3i (1, 1, 1));
+		Eigen::Vector3i loadedMin = this->mapVoxelMax_;
+		Eigen::Vector3i loadedMax = this->mapVoxelMin_;
+		for (int x=regionMin(0); x<=regionMax(0); ++x){
+			for (int y=regionMin(1); y<=regionMax(1); ++y){
+				const uint8_t* line = states.data() + (size_t(x - offset(0)) * dim(1) + (y - offset(1))) * dim(2) + (regionMin(2) - offset(2));
+				int z = regionMin(2);
+				int knownMin = regionMax(2) + 1, knownMax = regionMin(2) - 1;
+				this->forEachZRun(x, y, regionMin(2), regionMax(2), [&](int address, int length){
+					for (int i=0; i<length; ++i, ++z){
+						if (line[i] == COMPACT_VOXEL_UNKNOWN){
+							continue;
 						}
+						this->occupancy_[address + i] = (line[i] == COMPACT_VOXEL_OCCUPIED) ? this->pMaxLog_ : this->pMinLog_;
+						knownMin = std::min(knownMin, z);
+						knownMax = z;
 					}
+					line += length;
+				});
+				if (knownMin <= knownMax){
+					loadedMin = loadedMin.cwiseMin(Eigen::Vector3i (x, y, knownMin));
+					loadedMax = loadedMax.cwiseMax(Eigen::Vector3i (x, y, knownMax));
 				}
 			}
-			this->currMapRangeMin_ = currMapRangeMin;
-			this->currMapRangeMax_ = currMapRangeMax;
+		}
+		if ((loadedMin.array() > loadedMax.array()).any()){
+			cout << this->hint_ << ": Compact map has no known voxel in current map range." << endl;
+			return false;
+		}
+
+		Eigen::Vector3d loadedMinPos, loadedMaxPos;
+		this->indexToPos(loadedMin, loadedMinPos);
+		this->indexToPos(loadedMax, loadedMaxPos);
+		this->currMapRangeMin_ = this->currMapRangeMin_.cwiseMin(loadedMinPos);
+		this->currMapRangeMax_ = this->currMapRangeMax_.cwiseMax(loadedMaxPos);
+
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		this->inflateRegion(loadedMin - inflateSize, loadedMax + inflateSize);
+
+		// the loaded range needs a full ESDF update
+		this->localBoundMin_ = loadedMin;
+		this->localBoundMax_ = loadedMax;
+		this->esdfNeedUpdate_ = true;
+		cout << this->hint_ << ": Compact map loaded from " << path << endl;
+		return true;
+	}
+
+	uint32_t occMap::getSnapshotLayers(){
+		return SNAPSHOT_LAYER_OCCUPANCY | SNAPSHOT_LAYER_INFLATED;
+	}
+
+	void occMap::writeSnapshotLayers(mapSnapshot& snapshot, int beginAddress, int endAddress){
+		if (endAddress <= beginAddress) return;
+		memcpy(snapshot.occupancy() + beginAddress, this->occupancy_.data() + beginAddress, (endAddress - beginAddress) * sizeof(double));
+		memcpy(snapshot.inflated() + beginAddress, this->occupancyInflated_.data() + beginAddress, endAddress - beginAddress);
+	}
+
+	void occMap::readSnapshotLayers(mapSnapshot& snapshot){
+		memcpy(this->occupancy_.data(), snapshot.occupancy(), this->occupancy_.size() * sizeof(double));
+		if (snapshot.inflated() != nullptr){
+			memcpy(this->occupancyInflated_.data(), snapshot.inflated(), this->occupancyInflated_.size());
 		}
 	}
 
 	void occMap::registerCallback(){
 		if (this->sensorInputMode_ == 0){
 			// depth pose callback
-			this->depthSub_.reset(new message_filters::Subscriber<sensor_msgs::Image>(this->nh_, this->depthTopicName_, 50));
+			this->depthSub_.reset(new message_filters::Subscriber<sensor_msgs::Image>(this->stageNh_[STAGE_INGESTION], this->depthTopicName_, 50));
 			if (this->localizationMode_ == 0){
-				this->poseSub_.reset(new message_filters::Subscriber<geometry_msgs::PoseStamped>(this->nh_, this->poseTopicName_, 25));
+				this->poseSub_.reset(new message_filters::Subscriber<geometry_msgs::PoseStamped>(this->stageNh_[STAGE_INGESTION], this->poseTopicName_, 25));
 				this->depthPoseSync_.reset(new message_filters::Synchronizer<depthPoseSync>(depthPoseSync(100), *this->depthSub_, *this->poseSub_));
 				this->depthPoseSync_->registerCallback(boost::bind(&occMap::depthPoseCB, this, _1, _2));
 			}
 			else if (this->localizationMode_ == 1){
-				this->odomSub_.reset(new message_filters::Subscriber<nav_msgs::Odometry>(this->nh_, this->odomTopicName_, 25));
+				this->odomSub_.reset(new message_filters::Subscriber<nav_msgs::Odometry>(this->stageNh_[STAGE_INGESTION], this->odomTopicName_, 25));
 				this->depthOdomSync_.reset(new message_filters::Synchronizer<depthOdomSync>(depthOdomSync(100), *this->depthSub_, *this->odomSub_));
 				this->depthOdomSync_->registerCallback(boost::bind(&occMap::depthOdomCB, this, _1, _2));
 			}
@@ -491,14 +916,14 @@ namespace mapManager{
 		}
 		else if (this->sensorInputMode_ == 1){
 			// pointcloud callback
-			this->pointcloudSub_.reset(new message_filters::Subscriber<sensor_msgs::PointCloud2>(this->nh_, this->pointcloudTopicName_, 50));
+			this->pointcloudSub_.reset(new message_filters::Subscriber<sensor_msgs::PointCloud2>(this->stageNh_[STAGE_INGESTION], this->pointcloudTopicName_, 50));
 			if (this->localizationMode_ == 0){
-				this->poseSub_.reset(new message_filters::Subscriber<geometry_msgs::PoseStamped>(this->nh_, this->poseTopicName_, 25));
+				this->poseSub_.reset(new message_filters::Subscriber<geometry_msgs::PoseStamped>(this->stageNh_[STAGE_INGESTION], this->poseTopicName_, 25));
 				this->pointcloudPoseSync_.reset(new message_filters::Synchronizer<pointcloudPoseSync>(pointcloudPoseSync(100), *this->pointcloudSub_, *this->poseSub_));
 				this->pointcloudPoseSync_->registerCallback(boost::bind(&occMap::pointcloudPoseCB, this, _1, _2));
 			}
 			else if (this->localizationMode_ == 1){
-				this->odomSub_.reset(new message_filters::Subscriber<nav_msgs::Odometry>(this->nh_, this->odomTopicName_, 25));
+				this->odomSub_.reset(new message_filters::Subscriber<nav_msgs::Odometry>(this->stageNh_[STAGE_INGESTION], this->odomTopicName_, 25));
 				this->pointcloudOdomSync_.reset(new message_filters::Synchronizer<pointcloudOdomSync>(pointcloudOdomSync(100), *this->pointcloudSub_, *this->odomSub_));
 				this->pointcloudOdomSync_->registerCallback(boost::bind(&occMap::pointcloudOdomCB, this, _1, _2));
 			}
@@ -513,19 +938,24 @@ namespace mapManager{
 		}
 
 		// occupancy update callback
-		this->occTimer_ = this->nh_.createTimer(ros::Duration(0.05), &occMap::updateOccupancyCB, this);
+		this->occTimer_ = this->stageNh_[STAGE_INTEGRATION].createTimer(ros::Duration(0.05), &occMap::updateOccupancyCB, this);
 
 		// map inflation callback
-		this->inflateTimer_ = this->nh_.createTimer(ros::Duration(0.05), &occMap::inflateMapCB, this);
+		this->inflateTimer_ = this->stageNh_[STAGE_INTEGRATION].createTimer(ros::Duration(0.05), &occMap::inflateMapCB, this);
 
 		// visualization callback
-		this->visTimer_ = this->nh_.createTimer(ros::Duration(0.1), &occMap::visCB, this);
+		this->visTimer_ = this->stageNh_[STAGE_VISUALIZATION].createTimer(ros::Duration(0.1), &occMap::visCB, this);
 		this->visWorker_ = std::thread(&occMap::startVisualization, this);
 		this->visWorker_.detach();
 		// this->projPointsVisTimer_ = this->nh_.createTimer(ros::Duration(0.1), &occMap::projPointsVisCB, this);
 		// this->mapVisTimer_ = this->nh_.createTimer(ros::Duration(0.15), &occMap::mapVisCB, this);
 		// this->inflatedMapVisTimer_ = this->nh_.createTimer(ros::Duration(0.15), &occMap::inflatedMapVisCB, this);
-		// this->map2DVisTimer_ = this->nh_.createTimer(ros::Duration(0.15), &occMap::map2DVisCB, this);
+		this->map2DVisTimer_ = this->stageNh_[STAGE_VISUALIZATION].createTimer(ros::Duration(0.05), &occMap::map2DVisCB, this);
+
+		// incremental map stream
+		if (this->publishMapDelta_){
+			this->mapDeltaTimer_ = this->stageNh_[STAGE_VISUALIZATION].createTimer(ros::Duration(0.1), &occMap::mapDeltaCB, this);
+		}
 	}
 
 	void occMap::registerPub(){
@@ -534,11 +964,49 @@ namespace mapManager{
 		this->inflatedMapVisPub_ = this->nh_.advertise<sensor_msgs::PointCloud2>(this->ns_ + "/inflated_voxel_map", 10);
 		this->map2DPub_ = this->nh_.advertise<nav_msgs::OccupancyGrid>(this->ns_ + "/2D_occupancy_map", 10);
 		this->mapExploredPub_ = this->nh_.advertise<sensor_msgs::PointCloud2>(this->ns_+"/explored_voxel_map",10);
+		this->mapDeltaPub_ = this->nh_.advertise<map_manager::MapDelta>(this->ns_ + "/map_delta", 10);
 		// publish service
-		this->collisionCheckServer_ = this->nh_.advertiseService(this->ns_ + "/check_pos_collision", &occMap::checkCollision, this);
+		this->collisionCheckServer_ = this->stageNh_[STAGE_QUERY].advertiseService(this->ns_ + "/check_pos_collision", &occMap::checkCollision, this);
+		// map saving copies the map between updates, so it runs on the integration stage
+		this->snapshotServer_ = this->stageNh_[STAGE_INTEGRATION].advertiseService(this->ns_ + "/save_map_snapshot", &occMap::saveSnapshotSrv, this);
+		this->saveMapServer_ = this->stageNh_[STAGE_INTEGRATION].advertiseService(this->ns_ + "/save_map", &occMap::saveMapSrv, this);
+		this->saveMapStatusServer_ = this->stageNh_[STAGE_QUERY].advertiseService(this->ns_ + "/save_map_status", &occMap::saveMapStatusSrv, this);
+	}
+
+	void occMap::startStageWorkers(){
+		if (this->threadModel_ != 1 or not this->stageWorkers_.empty()){
+			return;
+		}
+		for (int i=0; i<STAGE_NUM; ++i){
+			this->stageWorkers_.emplace_back(&occMap::stageWorker, this, i);
+			int core = this->cpuAffinity_[i];
+			if (core >= 0){
+				cpu_set_t cpuSet;
+				CPU_ZERO(&cpuSet);
+				CPU_SET(core, &cpuSet);
+				if (pthread_setaffinity_np(this->stageWorkers_.back().native_handle(), sizeof(cpu_set_t), &cpuSet) != 0){
+					cout << this->hint_ << ": Cannot pin stage " << i << " to cpu " << core << "." << endl;
+				}
+			}
+		}
+	}
+
+	void occMap::stopStageWorkers(){
+		this->stageStop_ = true;
+		for (std::thread& worker : this->stageWorkers_){
+			worker.join();
+		}
+		this->stageWorkers_.clear();
+	}
+
+	void occMap::stageWorker(int stage){
+		while (ros::ok() and not this->stageStop_){
+			this->stageQueue_[stage].callAvailable(ros::WallDuration(0.01));
+		}
 	}
 
 	bool occMap::checkCollision(map_manager::CheckPosCollision::Request& req, map_manager::CheckPosCollision::Response& res){
+		std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
 		if (req.inflated){
 			res.occupied = this->isInflatedOccupied(Eigen::Vector3d (req.x, req.y, req.z));
 		}
@@ -549,105 +1017,214 @@ namespace mapManager{
 		return true;
 	}
 
+	bool occMap::saveSnapshotSrv(map_manager::SaveMapSnapshot::Request& req, map_manager::SaveMapSnapshot::Response& res){
+		std::string path = req.file_name.empty() ? this->snapshotFile_ : req.file_name;
+		res.success = this->saveMapSnapshot(path);
+		res.message = res.success ? "Map snapshot saved to " + path : "Failed to save map snapshot to " + path;
+		return true;
+	}
+
+	bool occMap::saveMapSrv(map_manager::SaveMap::Request& req, map_manager::SaveMap::Response& res){
+		{
+			std::lock_guard<std::mutex> lock (this->mapSaveStatus_->mutex);
+			if (this->mapSaveStatus_->inProgress){
+				res.queued = false;
+				res.message = "A map save is already in progress.";
+				return true;
+			}
+		}
+		if (this->mapSaveWorker_.joinable()){
+			this->mapSaveWorker_.join(); // previous save is finished
+		}
+
+		std::string path = req.file_name.empty() ? "./static_map.map" : req.file_name;
+		Eigen::Vector3i minIdx = this->mapVoxelMin_;
+		Eigen::Vector3i maxIdx = this->mapVoxelMax_ - Eigen::Vector3i (1, 1, 1);
+		if (req.region_min.size() == 3 and req.region_max.size() == 3){
+			this->posToIndex(Eigen::Vector3d (req.region_min[0], req.region_min[1], req.region_min[2]), minIdx);
+			this->posToIndex(Eigen::Vector3d (req.region_max[0], req.region_max[1], req.region_max[2]), maxIdx);
+			this->boundIndex(minIdx);
+			this->boundIndex(maxIdx);
+		}
+		if ((minIdx.array() > maxIdx.array()).any()){
+			res.queued = false;
+			res.message = "Invalid save region.";
+			return true;
+		}
+
+		// consistent copy of the region, taken between map updates
+		const Eigen::Vector3i dim = maxIdx - minIdx + Eigen::Vector3i (1, 1, 1);
+		std::vector<double> region (size_t(dim(0)) * dim(1) * dim(2));
+		double* regionPtr = region.data();
+		for (int x=minIdx(0); x<=maxIdx(0); ++x){
+			for (int y=minIdx(1); y<=maxIdx(1); ++y){
+				this->forEachZRun(x, y, minIdx(2), maxIdx(2), [&](int address, int length){
+					memcpy(regionPtr, &this->occupancy_[address], length * sizeof(double));
+					regionPtr += length;
+				});
+			}
+		}
+
+		compactMapHeader header;
+		initCompactMapHeader(header);
+		header.resolution = this->mapRes_;
+		for (int i=0; i<3; ++i){
+			header.origin[i] = this->mapSizeMin_(i) + minIdx(i) * this->mapRes_;
+			header.dim[i] = dim(i);
+		}
+
+		// encode and write in background so that mapping is not stalled (the worker only owns copies)
+		{
+			std::lock_guard<std::mutex> lock (this->mapSaveStatus_->mutex);
+			this->mapSaveStatus_->inProgress = true;
+			this->mapSaveStatus_->message = "Saving map to " + path + ".";
+		}
+		std::shared_ptr<mapSaveStatus> status = this->mapSaveStatus_;
+		const std::string hint = this->hint_;
+		const double pMinLog = this->pMinLog_;
+		const double pOccLog = this->pOccLog_;
+		this->mapSaveWorker_ = std::thread ([status, hint, path, header, pMinLog, pOccLog, region = std::move(region)]() mutable{
+			std::vector<uint8_t> states (region.size());
+			size_t occupiedNum = 0;
+			for (size_t i=0; i<region.size(); ++i){
+				if (region[i] < pMinLog){
+					states[i] = COMPACT_VOXEL_UNKNOWN;
+				}
+				else if (region[i] >= pOccLog){
+					states[i] = COMPACT_VOXEL_OCCUPIED;
+					++occupiedNum;
+				}
+				else{
+					states[i] = COMPACT_VOXEL_FREE;
+				}
+			}
+			std::vector<double> ().swap(region);
+
+			bool success = writeCompactMap(path, header, states);
+			std::string message;
+			if (success){
+				message = "Saved map with " + std::to_string(occupiedNum) + " occupied voxels (" + std::to_string(header.runNum) + " runs) to " + path + ".";
+			}
+			else{
+				message = "Failed to save map to " + path + ".";
+			}
+			cout << hint << ": " << message << endl;
+			std::lock_guard<std::mutex> lock (status->mutex);
+			status->success = success;
+			status->message = message;
+			status->inProgress = false;
+		});
+
+		res.queued = true;
+		res.message = "Saving map to " + path + " in background.";
+		return true;
+	}
+
+	bool occMap::saveMapStatusSrv(map_manager::SaveMapStatus::Request& req, map_manager::SaveMapStatus::Response& res){
+		std::lock_guard<std::mutex> lock (this->mapSaveStatus_->mutex);
+		res.in_progress = this->mapSaveStatus_->inProgress;
+		res.success = this->mapSaveStatus_->success;
+		res.message = this->mapSaveStatus_->message;
+		return true;
+	}
+
 	void occMap::depthPoseCB(const sensor_msgs::ImageConstPtr& img, const geometry_msgs::PoseStampedConstPtr& pose){
 		// store current depth image
+		sensorFrame& frame = this->frameBuffer_.writeBuffer();
 		cv_bridge::CvImagePtr imgPtr = cv_bridge::toCvCopy(img, img->encoding);
 		if (img->encoding == sensor_msgs::image_encodings::TYPE_32FC1){
 			(imgPtr->image).convertTo(imgPtr->image, CV_16UC1, this->depthScale_);
 		}
-		imgPtr->image.copyTo(this->depthImage_);
+		frame.depthImage = imgPtr->image; // imgPtr already holds a copy
 
 		// store current position and orientation (camera)
 		Eigen::Matrix4d camPoseMatrix;
 		this->getCameraPose(pose, camPoseMatrix);
 
-		this->position_(0) = camPoseMatrix(0, 3);
-		this->position_(1) = camPoseMatrix(1, 3);
-		this->position_(2) = camPoseMatrix(2, 3);
-		this->orientation_ = camPoseMatrix.block<3, 3>(0, 0);
-
-		if (this->isInMap(this->position_)){
-			this->occNeedUpdate_ = true;
-		}
-		else{
-			this->occNeedUpdate_ = false;
-		}
+		frame.position(0) = camPoseMatrix(0, 3);
+		frame.position(1) = camPoseMatrix(1, 3);
+		frame.position(2) = camPoseMatrix(2, 3);
+		frame.orientation = camPoseMatrix.block<3, 3>(0, 0);
+		this->frameBuffer_.publish();
 	}
 
 	void occMap::depthOdomCB(const sensor_msgs::ImageConstPtr& img, const nav_msgs::OdometryConstPtr& odom){
 		// store current depth image
+		sensorFrame& frame = this->frameBuffer_.writeBuffer();
 		cv_bridge::CvImagePtr imgPtr = cv_bridge::toCvCopy(img, img->encoding);
 		if (img->encoding == sensor_msgs::image_encodings::TYPE_32FC1){
 			(imgPtr->image).convertTo(imgPtr->image, CV_16UC1, this->depthScale_);
 		}
-		imgPtr->image.copyTo(this->depthImage_);
+		frame.depthImage = imgPtr->image; // imgPtr already holds a copy
 
 		// store current position and orientation (camera)
 		Eigen::Matrix4d camPoseMatrix;
 		this->getCameraPose(odom, camPoseMatrix);
 
-		this->position_(0) = camPoseMatrix(0, 3);
-		this->position_(1) = camPoseMatrix(1, 3);
-		this->position_(2) = camPoseMatrix(2, 3);
-		this->orientation_ = camPoseMatrix.block<3, 3>(0, 0);
-
-		if (this->isInMap(this->position_)){
-			this->occNeedUpdate_ = true;
-		}
-		else{
-			this->occNeedUpdate_ = false;
-		}
+		frame.position(0) = camPoseMatrix(0, 3);
+		frame.position(1) = camPoseMatrix(1, 3);
+		frame.position(2) = camPoseMatrix(2, 3);
+		frame.orientation = camPoseMatrix.block<3, 3>(0, 0);
+		this->frameBuffer_.publish();
 	}
 
 	void occMap::pointcloudPoseCB(const sensor_msgs::PointCloud2ConstPtr& pointcloud, const geometry_msgs::PoseStampedConstPtr& pose){
 		// directly get the point cloud
 		pcl::PCLPointCloud2 pclPC2;
 		pcl_conversions::toPCL(*pointcloud, pclPC2); // convert ros pointcloud2 to pcl pointcloud2
-		pcl::fromPCLPointCloud2(pclPC2, this->pointcloud_);
+		sensorFrame& frame = this->frameBuffer_.writeBuffer();
+		pcl::fromPCLPointCloud2(pclPC2, frame.pointcloud);
 
 		// store current position and orientation (camera)
 		Eigen::Matrix4d camPoseMatrix;
 		this->getCameraPose(pose, camPoseMatrix);
 
-		this->position_(0) = camPoseMatrix(0, 3);
-		this->position_(1) = camPoseMatrix(1, 3);
-		this->position_(2) = camPoseMatrix(2, 3);
-		this->orientation_ = camPoseMatrix.block<3, 3>(0, 0);
-
-		if (this->isInMap(this->position_)){
-			this->occNeedUpdate_ = true;
-		}
-		else{
-			this->occNeedUpdate_ = false;
-		}
+		frame.position(0) = camPoseMatrix(0, 3);
+		frame.position(1) = camPoseMatrix(1, 3);
+		frame.position(2) = camPoseMatrix(2, 3);
+		frame.orientation = camPoseMatrix.block<3, 3>(0, 0);
+		this->frameBuffer_.publish();
 	}
 
 	void occMap::pointcloudOdomCB(const sensor_msgs::PointCloud2ConstPtr& pointcloud, const nav_msgs::OdometryConstPtr& odom){
 		// directly get the point cloud
 		pcl::PCLPointCloud2 pclPC2;
 		pcl_conversions::toPCL(*pointcloud, pclPC2); // convert ros pointcloud2 to pcl pointcloud2
-		pcl::fromPCLPointCloud2(pclPC2, this->pointcloud_);
+		sensorFrame& frame = this->frameBuffer_.writeBuffer();
+		pcl::fromPCLPointCloud2(pclPC2, frame.pointcloud);
 
 
 		// store current position and orientation (camera)
 		Eigen::Matrix4d camPoseMatrix;
 		this->getCameraPose(odom, camPoseMatrix);
 
-		this->position_(0) = camPoseMatrix(0, 3);
-		this->position_(1) = camPoseMatrix(1, 3);
-		this->position_(2) = camPoseMatrix(2, 3);
-		this->orientation_ = camPoseMatrix.block<3, 3>(0, 0);
-
-		if (this->isInMap(this->position_)){
-			this->occNeedUpdate_ = true;
-		}
-		else{
-			this->occNeedUpdate_ = false;
-		}
+		frame.position(0) = camPoseMatrix(0, 3);
+		frame.position(1) = camPoseMatrix(1, 3);
+		frame.position(2) = camPoseMatrix(2, 3);
+		frame.orientation = camPoseMatrix.block<3, 3>(0, 0);
+		this->frameBuffer_.publish();
 	}
 
 	void occMap::updateOccupancyCB(const ros::TimerEvent& ){
-		if (not this->occNeedUpdate_){
+		if (not this->frameBuffer_.consume()){
+			// no new frame: continue the rays left over by the integration budget
+			if (this->pendingRayPos_ < this->pendingRays_.size() and this->isInMap(this->position_)){
+				this->integratePendingRays();
+				this->mapNeedInflate_ = true;
+			}
+			return;
+		}
+
+		// take over the newest frame (swapping keeps the buffers allocated for the next frames)
+		sensorFrame& frame = this->frameBuffer_.readBuffer();
+		std::swap(this->depthImage_, frame.depthImage);
+		this->pointcloud_.swap(frame.pointcloud);
+		{
+			std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+			this->position_ = frame.position;
+			this->orientation_ = frame.orientation;
+		}
+		if (not this->isInMap(this->position_)){
 			return;
 		}
 		// cout << "update occupancy map" << endl;
@@ -664,7 +1241,12 @@ namespace mapManager{
 		}
 
 		// raycasting and update occupancy
-		this->raycastUpdate();
+		if (this->integrationMode_ == 1){
+			this->projectiveUpdate();
+		}
+		else{
+			this->raycastUpdate();
+		}
 
 
 		// clear local map
@@ -676,9 +1258,12 @@ namespace mapManager{
 		// this->inflateLocalMap();
 		endTime = ros::Time::now();
 		if (this->verbose_){
-			cout << this->hint_ << ": Occupancy update time: " << (endTime - startTime).toSec() << " s." << endl;
+			cout << this->hint_ << ": Occupancy update time: " << (endTime - startTime).toSec() << " s. Dropped frames: " << this->frameBuffer_.getDroppedNum() << "/" << this->frameBuffer_.getPublishedNum() << "." << endl;
+			if (this->integrationBudget_ > 0){
+				integrationStats stats = this->getIntegrationStats();
+				cout << this->hint_ << ": Pending rays: " << stats.pendingRayNum << ". Overloaded cycles: " << stats.overloadNum << "/" << stats.cycleNum << ". Dropped rays: " << stats.droppedRayNum << "." << endl;
+			}
 		}
-		this->occNeedUpdate_ = false;
 		this->mapNeedInflate_ = true;
 	}
 
@@ -693,6 +1278,11 @@ namespace mapManager{
 
 
 	void occMap::projectDepthImage(){
+		this->projPointsPrefiltered_ = false;
+		if (this->depthAdaptiveSampling_){
+			this->projectDepthImageAdaptive();
+			return;
+		}
 		this->projPointsNum_ = 0;
 
 		int cols = this->depthImage_.cols;
@@ -755,294 +1345,997 @@ namespace mapManager{
 		} 
 	}
 
-	void occMap::getPointcloud(){
-		this->projPointsNum_ = this->pointcloud_.size();
-		this->projPoints_.resize(this->projPointsNum_);
-		Eigen::Vector3d currPointCam, currPointMap;
-		for (int i=0; i<this->projPointsNum_; ++i){
-			currPointCam(0) = this->pointcloud_.points[i].x;
-			currPointCam(1) = this->pointcloud_.points[i].y;
-			currPointCam(2) = this->pointcloud_.points[i].z;
-			currPointMap = this->orientation_ * currPointCam + this->position_; // transform to map coordinate
-			if ((currPointMap-this->position_).norm()>=0.5){
-				this->projPoints_[i] = currPointMap;
+	void occMap::buildDepthPyramid(){
+		// level 0 is the depth image inside the filter margin. Invalid (too close) pixels are -1,
+		// no return or too far pixels are slightly beyond the raycast length as in projectDepthImage.
+		const int cols = this->depthImage_.cols - 2 * this->depthFilterMargin_;
+		const int rows = this->depthImage_.rows - 2 * this->depthFilterMargin_;
+		const float farDepth = this->raycastMaxLength_ + 0.1;
+		const double inv_factor = 1.0 / this->depthScale_;
+		this->depthPyramidDim_.assign(1, Eigen::Vector2i (cols, rows));
+		while (this->depthPyramidDim_.back().minCoeff() > 1 and int(this->depthPyramidDim_.size()) < 8){
+			const Eigen::Vector2i& dim = this->depthPyramidDim_.back();
+			this->depthPyramidDim_.push_back(Eigen::Vector2i ((dim(0) + 1)/2, (dim(1) + 1)/2));
+		}
+		const int levelNum = this->depthPyramidDim_.size();
+		this->depthMinPyramid_.resize(levelNum);
+		this->depthMaxPyramid_.resize(levelNum);
+
+		this->depthMinPyramid_[0].resize(cols * rows);
+		for (int v=0; v<rows; ++v){
+			const uint16_t* rowPtr = this->depthImage_.ptr<uint16_t>(v + this->depthFilterMargin_) + this->depthFilterMargin_;
+			for (int u=0; u<cols; ++u){
+				float depth = rowPtr[u] * inv_factor;
+				if (rowPtr[u] == 0 or depth > this->depthMaxValue_){
+					depth = farDepth;
+				}
+				else if (depth < this->depthMinValue_){
+					depth = -1.0;
+				}
+				this->depthMinPyramid_[0][v * cols + u] = depth;
+			}
+		}
+		this->depthMaxPyramid_[0] = this->depthMinPyramid_[0];
+
+		// 2x2 min (nearest surface) and max (decides the footprint) over valid depths
+		for (int level=1; level<levelNum; ++level){
+			const Eigen::Vector2i& prevDim = this->depthPyramidDim_[level-1];
+			const Eigen::Vector2i& dim = this->depthPyramidDim_[level];
+			std::vector<float>& minLevel = this->depthMinPyramid_[level];
+			std::vector<float>& maxLevel = this->depthMaxPyramid_[level];
+			minLevel.resize(dim(0) * dim(1));
+			maxLevel.resize(dim(0) * dim(1));
+			for (int v=0; v<dim(1); ++v){
+				for (int u=0; u<dim(0); ++u){
+					float minDepth = std::numeric_limits<float>::max(), maxDepth = -1.0;
+					for (int c=0; c<4; ++c){
+						int childU = 2*u + (c & 1), childV = 2*v + (c >> 1);
+						if (childU >= prevDim(0) or childV >= prevDim(1)){
+							continue;
+						}
+						float childMin = this->depthMinPyramid_[level-1][childV * prevDim(0) + childU];
+						if (childMin >= 0){
+							minDepth = std::min(minDepth, childMin);
+							maxDepth = std::max(maxDepth, this->depthMaxPyramid_[level-1][childV * prevDim(0) + childU]);
+						}
+					}
+					minLevel[v * dim(0) + u] = (maxDepth >= 0) ? minDepth : -1.0;
+					maxLevel[v * dim(0) + u] = maxDepth;
+				}
 			}
 		}
 	}
 
-	void occMap::raycastUpdate(){
-		if (this->projPointsNum_ == 0){
+	void occMap::projectDepthImageAdaptive(){
+		// sample the coarsest pyramid cell whose footprint at its farthest depth is within the target size (one voxel),
+		// so near surfaces get few rays and the far field keeps its coverage. The sample uses the nearest depth in the cell.
+		this->projPointsNum_ = 0;
+		if (this->depthImage_.cols <= 2 * this->depthFilterMargin_ or this->depthImage_.rows <= 2 * this->depthFilterMargin_){
 			return;
 		}
-		this->raycastNum_ += 1;
-
-		// record local bound of update
-		double xmin, xmax, ymin, ymax, zmin, zmax;
-		xmin = xmax = this->position_(0);
-		ymin = ymax = this->position_(1);
-		zmin = zmax = this->position_(2);
-
-		// iterate through each projected points, perform raycasting and update occupancy
-		Eigen::Vector3d currPoint;
-		bool pointAdjusted;
-		int rayendVoxelID, raycastVoxelID;
-		double length;
-		for (int i=0; i<this->projPointsNum_; ++i){
-			currPoint = this->projPoints_[i];
-			if (std::isnan(currPoint(0)) or std::isnan(currPoint(1)) or std::isnan(currPoint(2))){
-				continue; // nan points can happen when we are using pointcloud as input
-			}
-
-			pointAdjusted = false;
-			// check whether the point is in reserved map range
-			if (not this->isInMap(currPoint)){
-				currPoint = this->adjustPointInMap(currPoint);
-				pointAdjusted = true;
-			}
+		this->buildDepthPyramid();
+		const int topLevel = this->depthPyramidDim_.size() - 1;
+		const int budget = std::min(this->depthRayBudget_, int(this->projPoints_.size()));
 
-			// check whether the point exceeds the maximum raycasting length
-			length = (currPoint - this->position_).norm();
-			if (length > this->raycastMaxLength_){
-				currPoint = this->adjustPointRayLength(currPoint);
-				pointAdjusted = true;
+		std::vector<Eigen::Vector3i> cellStack; // (level, u, v)
+		Eigen::Vector3d currPointCam, currPointMap;
+		double targetSize = this->mapRes_;
+		bool overBudget = true;
+		for (int iter=0; iter<8 and overBudget; ++iter, targetSize*=2){
+			this->projPointsNum_ = 0;
+			overBudget = false;
+			const Eigen::Vector2i& topDim = this->depthPyramidDim_[topLevel];
+			for (int v=0; v<topDim(1); ++v){
+				for (int u=0; u<topDim(0); ++u){
+					cellStack.push_back(Eigen::Vector3i (topLevel, u, v));
+				}
 			}
 
+			while (not cellStack.empty() and not overBudget){
+				Eigen::Vector3i cell = cellStack.back();
+				cellStack.pop_back();
+				int level = cell(0);
+				const Eigen::Vector2i& dim = this->depthPyramidDim_[level];
+				int cellAddress = cell(2) * dim(0) + cell(1);
+				float maxDepth = this->depthMaxPyramid_[level][cellAddress];
+				if (maxDepth < 0){
+					continue; // no valid depth in this cell
+				}
 
-			// update local bound
-			if (currPoint(0) < xmin){xmin = currPoint(0);}
-			if (currPoint(1) < ymin){ymin = currPoint(1);}
-			if (currPoint(2) < zmin){zmin = currPoint(2);}
-			if (currPoint(0) > xmax){xmax = currPoint(0);}
-			if (currPoint(1) > ymax){ymax = currPoint(1);}
-			if (currPoint(2) > zmax){zmax = currPoint(2);}
+				double footprint = (1 << level) * maxDepth / std::min(this->fx_, this->fy_);
+				if (level > 0 and footprint > targetSize){
+					const Eigen::Vector2i& childDim = this->depthPyramidDim_[level-1];
+					for (int c=0; c<4; ++c){
+						int childU = 2*cell(1) + (c & 1), childV = 2*cell(2) + (c >> 1);
+						if (childU < childDim(0) and childV < childDim(1)){
+							cellStack.push_back(Eigen::Vector3i (level-1, childU, childV));
+						}
+					}
+					continue;
+				}
 
-			// update occupancy itself update information
-			rayendVoxelID = this->updateOccupancyInfo(currPoint, not pointAdjusted); // point adjusted is free, not is occupied
+				// pixel at the cell center
+				double depth = this->depthMinPyramid_[level][cellAddress];
+				double pixelU = std::min((cell(1) + 0.5) * (1 << level) - 0.5, this->depthPyramidDim_[0](0) - 1.0) + this->depthFilterMargin_;
+				double pixelV = std::min((cell(2) + 0.5) * (1 << level) - 0.5, this->depthPyramidDim_[0](1) - 1.0) + this->depthFilterMargin_;
+				currPointCam(0) = (pixelU - this->cx_) * depth / this->fx_;
+				currPointCam(1) = (pixelV - this->cy_) * depth / this->fy_;
+				currPointCam(2) = depth;
+				currPointMap = this->orientation_ * currPointCam + this->position_; // transform to map coordinate
 
-			// check whether the voxel has already been updated, so no raycasting needed
-			// rayendVoxelID = this->posToAddress(currPoint);
-			if (this->flagRayend_[rayendVoxelID] == this->raycastNum_){
-				continue; // skip
-			}
-			else{
-				this->flagRayend_[rayendVoxelID] = this->raycastNum_;
+				if (this->useFreeRegions_){ // this region will not be updated and directly set to free
+					if (this->isInHistFreeRegions(currPointMap)){
+						continue;
+					}
+				}
+
+				if (this->projPointsNum_ >= budget){
+					overBudget = true; // retry with a coarser target
+					break;
+				}
+				this->projPoints_[this->projPointsNum_] = currPointMap;
+				this->projPointsNum_ = this->projPointsNum_ + 1;
 			}
+			cellStack.clear();
+		}
 
+		if (this->verbose_){
+			cout << this->hint_ << ": Adaptive depth sampling: " << this->projPointsNum_ << " rays (target size " << targetSize/2 << " m)." << endl;
+		}
+	}
 
+	void occMap::getPointcloud(){
+		// transform, adjust and merge points by endpoint voxel in one pass, so each endpoint voxel
+		// is raycasted once with its hit (measured) and miss (adjusted) counts
+		int pointNum = this->pointcloud_.size();
+		if (int(this->projPoints_.size()) < pointNum){
+			this->projPoints_.resize(pointNum);
+			this->projPointsHit_.resize(pointNum);
+			this->projPointsMiss_.resize(pointNum);
+			this->endpointAddress_.resize(pointNum);
+		}
+		this->projPointsNum_ = 0;
+		this->projPointsPrefiltered_ = true;
 
-			// raycasting for update occupancy
-			this->raycaster_.setInput(currPoint/this->mapRes_, this->position_/this->mapRes_);
-			Eigen::Vector3d rayPoint, actualPoint;
-			while (this->raycaster_.step(rayPoint)){
-				actualPoint = rayPoint;
-				actualPoint(0) += 0.5;
-				actualPoint(1) += 0.5;
-				actualPoint(2) += 0.5;
-				actualPoint *= this->mapRes_;
-				raycastVoxelID = this->updateOccupancyInfo(actualPoint, false);
+		Eigen::Vector3d currPointCam, currPointMap;
+		Eigen::Vector3i endpointIdx;
+		for (int i=0; i<pointNum; ++i){
+			currPointCam(0) = this->pointcloud_.points[i].x;
+			currPointCam(1) = this->pointcloud_.points[i].y;
+			currPointCam(2) = this->pointcloud_.points[i].z;
+			if (std::isnan(currPointCam(0)) or std::isnan(currPointCam(1)) or std::isnan(currPointCam(2))){
+				continue;
+			}
+			currPointMap = this->orientation_ * currPointCam + this->position_; // transform to map coordinate
+			if ((currPointMap-this->position_).norm() < 0.5){
+				continue;
+			}
 
-				// raycastVoxelID = this->posToAddress(actualPoint);
-				if (this->flagTraverse_[raycastVoxelID] == this->raycastNum_){
-					break;
-				}
-				else{
-					this->flagTraverse_[raycastVoxelID] = this->raycastNum_;
-				}
+			bool pointAdjusted = false;
+			if (not this->isInMap(currPointMap)){
+				currPointMap = this->adjustPointInMap(currPointMap);
+				pointAdjusted = true;
+			}
+			if ((currPointMap - this->position_).norm() > this->raycastMaxLength_){
+				currPointMap = this->adjustPointRayLength(currPointMap);
+				pointAdjusted = true;
+			}
 
+			// sparse set lookup: the slot is valid only if it points back to this address (no clearing between frames)
+			this->posToIndex(currPointMap, endpointIdx);
+			int address = this->indexToAddress(endpointIdx);
+			int slot = this->endpointSlot_[address];
+			if (slot >= this->projPointsNum_ or this->endpointAddress_[slot] != address){
+				slot = this->projPointsNum_++;
+				this->endpointSlot_[address] = slot;
+				this->endpointAddress_[slot] = address;
+				this->projPoints_[slot] = currPointMap; // first point represents the voxel
+				this->projPointsHit_[slot] = 0;
+				this->projPointsMiss_[slot] = 0;
+			}
+			if (pointAdjusted){
+				++this->projPointsMiss_[slot];
+			}
+			else{
+				++this->projPointsHit_[slot];
 			}
 		}
+	}
 
-		// store local bound and inflate local bound (inflate is for ESDF update)
-		this->posToIndex(Eigen::Vector3d (xmin, ymin, zmin), this->localBoundMin_);
-		this->posToIndex(Eigen::Vector3d (xmax, ymax, zmax), this->localBoundMax_);
-		this->localBoundMin_ -= int(ceil(this->localBoundInflate_/this->mapRes_)) * Eigen::Vector3i(1, 1, 0); // inflate in x y direction
-		this->localBoundMax_ += int(ceil(this->localBoundInflate_/this->mapRes_)) * Eigen::Vector3i(1, 1, 0); 
-		this->boundIndex(this->localBoundMin_); // since inflated, need to bound if not in reserved range
-		this->boundIndex(this->localBoundMax_);
+	void occMap::raycastUpdate(){
+		if (this->integrationBudget_ > 0){
+			this->budgetedRaycastUpdate();
+			return;
+		}
+		if (this->projPointsNum_ == 0){
+			return;
+		}
+		this->raycastNum_ += 1;
+		this->computeUpdateClip();
 
+		// record local bound of update
+		double xmin, xmax, ymin, ymax, zmin, zmax;
+		xmin = xmax = this->position_(0);
+		ymin = ymax = this->position_(1);
+		zmin = zmax = this->position_(2);
 
-		// update occupancy in the cache
-		double logUpdateValue;
-		int cacheAddress, hit, miss;
-		while (not this->updateVoxelCache_.empty()){
-			Eigen::Vector3i cacheIdx = this->updateVoxelCache_.front();
-			this->updateVoxelCache_.pop();
-			cacheAddress = this->indexToAddress(cacheIdx);
+		// iterate through each projected points, perform raycasting and update occupancy
+		Eigen::Vector3d currPoint;
+		int hitNum, missNum;
+		for (int i=0; i<this->projPointsNum_; ++i){
+			if (not this->prepareRayPoint(i, currPoint, hitNum, missNum)){
+				continue;
+			}
 
-			hit = this->countHit_[cacheAddress];
-			miss = this->countHitMiss_[cacheAddress] - hit;
+			// update local bound
+			if (currPoint(0) < xmin){xmin = currPoint(0);}
+			if (currPoint(1) < ymin){ymin = currPoint(1);}
+			if (currPoint(2) < zmin){zmin = currPoint(2);}
+			if (currPoint(0) > xmax){xmax = currPoint(0);}
+			if (currPoint(1) > ymax){ymax = currPoint(1);}
+			if (currPoint(2) > zmax){zmax = currPoint(2);}
+
+			this->integrateRay(currPoint, hitNum, missNum, this->position_, this->raycastNum_);
+		}
+		this->stepRayBatch(true);
+
+		this->storeLocalBound(Eigen::Vector3d (xmin, ymin, zmin), Eigen::Vector3d (xmax, ymax, zmax));
+		this->flushUpdateCache();
+	}
 
-			if (hit >= miss and hit != 0){
-				logUpdateValue = this->pHitLog_;
+	void occMap::budgetedRaycastUpdate(){
+		this->raycastNum_ += 1;
+
+		// new rays in priority order (counting sort by length, unknown end voxels first if selected)
+		const int lengthKeyNum = int(this->raycastMaxLength_/this->mapRes_) + 2;
+		const int keyNum = (this->rayPriority_ == 1) ? 2 * lengthKeyNum : lengthKeyNum;
+		this->frameRays_.clear();
+		this->rayKey_.clear();
+		this->rayBucket_.assign(keyNum + 1, 0);
+		pendingRay ray;
+		ray.origin = this->position_;
+		ray.frameID = this->raycastNum_;
+		for (int i=0; i<this->projPointsNum_; ++i){
+			if (not this->prepareRayPoint(i, ray.point, ray.hitNum, ray.missNum)){
+				continue;
 			}
-			else{
-				logUpdateValue = this->pMissLog_;
+			int key = std::min(int((ray.point - ray.origin).norm()/this->mapRes_), lengthKeyNum - 1);
+			if (this->rayPriority_ == 1 and not this->isUnknown(ray.point)){
+				key += lengthKeyNum;
 			}
-			this->countHit_[cacheAddress] = 0; // clear hit
-			this->countHitMiss_[cacheAddress] = 0; // clear hit and miss
+			this->frameRays_.push_back(ray);
+			this->rayKey_.push_back(key);
+			++this->rayBucket_[key + 1];
+		}
+		for (int k=0; k<keyNum; ++k){
+			this->rayBucket_[k + 1] += this->rayBucket_[k];
+		}
+		this->pendingRaysNext_.resize(this->frameRays_.size());
+		for (size_t i=0; i<this->frameRays_.size(); ++i){
+			this->pendingRaysNext_[this->rayBucket_[this->rayKey_[i]]++] = this->frameRays_[i];
+		}
 
-			// check whether point is in the local update range
-			if (not this->isInLocalUpdateRange(cacheIdx)){
-				continue; // do not update if not in the range
+		// waiting rays of the previous frame go after the new ones, older rays are dropped
+		int droppedNum = 0;
+		for (size_t i=this->pendingRayPos_; i<this->pendingRays_.size(); ++i){
+			if (this->pendingRays_[i].frameID == this->raycastNum_ - 1){
+				this->pendingRaysNext_.push_back(this->pendingRays_[i]);
 			}
-
-			if (this->useFreeRegions_){ // current used in simulation, this region will not be updated and directly set to free
-				Eigen::Vector3d pos;
-				this->indexToPos(cacheIdx, pos);
-				if (this->isInHistFreeRegions(pos)){
-					this->occupancy_[cacheAddress] = this->pMinLog_;
-					continue;
-				}
+			else{
+				++droppedNum;
 			}
+		}
+		std::swap(this->pendingRays_, this->pendingRaysNext_);
+		this->pendingRayPos_ = 0;
+		{
+			std::lock_guard<std::mutex> lock (this->integrationStatsMutex_);
+			this->integrationStats_.droppedRayNum += droppedNum;
+		}
 
-			// update occupancy info
-			if ((logUpdateValue >= 0) and (this->occupancy_[cacheAddress] >= this->pMaxLog_)){
-				continue; // not increase p if max clamped
+		this->integratePendingRays();
+	}
+
+	void occMap::integratePendingRays(){
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		const std::chrono::microseconds budget (this->integrationBudget_);
+		this->computeUpdateClip();
+
+		// record local bound of update
+		Eigen::Vector3d boundMin = this->position_;
+		Eigen::Vector3d boundMax = this->position_;
+		const size_t startPos = this->pendingRayPos_;
+		bool overloaded = false;
+		while (this->pendingRayPos_ < this->pendingRays_.size()){
+			// check the clock every 64 rays
+			size_t doneNum = this->pendingRayPos_ - startPos;
+			if ((doneNum & 63) == 0 and doneNum > 0 and std::chrono::steady_clock::now() - startTime > budget){
+				overloaded = true;
+				break;
 			}
-			else if ((logUpdateValue <= 0) and (this->occupancy_[cacheAddress] == this->pMinLog_)){
-				continue; // not decrease p if min clamped
+			const pendingRay& ray = this->pendingRays_[this->pendingRayPos_++];
+			boundMin = boundMin.cwiseMin(ray.point).cwiseMin(ray.origin);
+			boundMax = boundMax.cwiseMax(ray.point).cwiseMax(ray.origin);
+			this->integrateRay(ray.point, ray.hitNum, ray.missNum, ray.origin, ray.frameID);
+		}
+		this->stepRayBatch(true);
+
+		this->storeLocalBound(boundMin, boundMax);
+		this->flushUpdateCache();
+
+		double cycleTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+		int pendingNum = this->pendingRays_.size() - this->pendingRayPos_;
+		std::lock_guard<std::mutex> lock (this->integrationStatsMutex_);
+		this->integrationStats_.cycleNum += 1;
+		this->integrationStats_.overloadNum += overloaded;
+		this->integrationStats_.rayNum += this->pendingRayPos_ - startPos;
+		this->integrationStats_.carriedRayNum += pendingNum;
+		this->integrationStats_.pendingRayNum = pendingNum;
+		this->integrationStats_.lastCycleTime = cycleTime;
+		this->integrationStats_.maxCycleTime = std::max(this->integrationStats_.maxCycleTime, cycleTime);
+	}
+
+	bool occMap::prepareRayPoint(int i, Eigen::Vector3d& point, int& hitNum, int& missNum){
+		point = this->projPoints_[i];
+		if (this->projPointsPrefiltered_){
+			// already adjusted and merged by endpoint voxel
+			hitNum = this->projPointsHit_[i];
+			missNum = this->projPointsMiss_[i];
+			return true;
+		}
+		if (std::isnan(point(0)) or std::isnan(point(1)) or std::isnan(point(2))){
+			return false; // nan points can happen when we are using pointcloud as input
+		}
+
+		bool pointAdjusted = false;
+		// check whether the point is in reserved map range
+		if (not this->isInMap(point)){
+			point = this->adjustPointInMap(point);
+			pointAdjusted = true;
+		}
+
+		// check whether the point exceeds the maximum raycasting length
+		double length = (point - this->position_).norm();
+		if (length > this->raycastMaxLength_){
+			point = this->adjustPointRayLength(point);
+			pointAdjusted = true;
+		}
+		hitNum = pointAdjusted ? 0 : 1; // point adjusted is free, not is occupied
+		missNum = 1 - hitNum;
+		return true;
+	}
+
+	void occMap::integrateRay(const Eigen::Vector3d& point, int hitNum, int missNum, const Eigen::Vector3d& origin, int frameID){
+		// update occupancy itself update information (only inside the local update range)
+		int rayendVoxelID;
+		Eigen::Vector3i endIdx;
+		this->posToIndex(point, endIdx);
+		if (this->isInUpdateClip(endIdx)){
+			rayendVoxelID = this->updateOccupancyInfo(point, hitNum, missNum);
+		}
+		else{
+			rayendVoxelID = this->indexToAddress(endIdx);
+		}
+
+		// check whether the voxel has already been updated, so no raycasting needed
+		if (this->flagRayend_[rayendVoxelID] == frameID){
+			return; // skip
+		}
+		else{
+			this->flagRayend_[rayendVoxelID] = frameID;
+		}
+
+		// raycasting for update occupancy (integer walk over map indices from the end voxel towards the sensor)
+		// the segment is clipped to the local update range first, so the walk never leaves it
+		Eigen::Vector3d rayStart = this->geometry_.posToVoxel(point);
+		Eigen::Vector3d rayEnd = this->geometry_.posToVoxel(origin);
+		bool endClipped;
+		if (not clipVoxelRay(rayStart, rayEnd, this->updateClip_.rangeMin, this->updateClip_.rangeMax, endClipped)){
+			return;
+		}
+		VoxelRay ray;
+		initVoxelRay(rayStart, rayEnd, ray);
+		ray.stepNum += endClipped; // the sensor voxel is not visited, but the voxel where the ray leaves the range is
+		if (ray.stepNum == 0){
+			return;
+		}
+		if (this->raycastBatch_){
+			int lane = this->rayBatch_.add(ray);
+			this->rayBatchFrameID_[lane] = frameID;
+			if (this->rayBatch_.full()){
+				this->stepRayBatch(false); // until a lane is free for the next ray
 			}
-			else if ((logUpdateValue <= 0) and (this->occupancy_[cacheAddress] < this->pMinLog_)){
-				this->occupancy_[cacheAddress] = this->pMinLog_; // if unknown set it free (prior), 
-				continue;
+			return;
+		}
+		auto visit = [&](int x, int y, int z){return this->traverseVoxel(Eigen::Vector3i (x, y, z), frameID);};
+		traverseVoxelRay(ray, visit);
+	}
+
+	void occMap::stepRayBatch(bool drain){
+		auto visit = [&](int lane, int x, int y, int z){return this->traverseVoxel(Eigen::Vector3i (x, y, z), this->rayBatchFrameID_[lane]);};
+		this->rayBatch_.traverse(visit, drain);
+	}
+
+	void occMap::projectiveUpdate(){
+		// projective integration: every voxel of the camera frustum is projected into the depth image and updated once
+		int cols = this->depthImage_.cols;
+		int rows = this->depthImage_.rows;
+		if (cols == 0 or rows == 0){
+			return;
+		}
+		this->raycastNum_ += 1;
+		this->computeUpdateClip();
+
+		const double inv_factor = 1.0 / this->depthScale_;
+		const double surfaceBand = 0.5 * sqrt(3.0) * this->mapRes_; // a voxel within this depth difference holds the surface
+		const double maxLength = this->raycastMaxLength_;
+
+		// bounding box of the frustum (camera center and image corners at the max length), clipped to the local update range
+		Eigen::Vector3d frustumMin = this->position_;
+		Eigen::Vector3d frustumMax = this->position_;
+		const double cornerU[2] = {double(this->depthFilterMargin_), double(cols - 1 - this->depthFilterMargin_)};
+		const double cornerV[2] = {double(this->depthFilterMargin_), double(rows - 1 - this->depthFilterMargin_)};
+		for (int i=0; i<2; ++i){
+			for (int j=0; j<2; ++j){
+				Eigen::Vector3d cornerCam ((cornerU[i] - this->cx_)/this->fx_ * maxLength, (cornerV[j] - this->cy_)/this->fy_ * maxLength, maxLength);
+				Eigen::Vector3d cornerMap = this->orientation_ * cornerCam + this->position_;
+				frustumMin = frustumMin.cwiseMin(cornerMap);
+				frustumMax = frustumMax.cwiseMax(cornerMap);
 			}
+		}
+		Eigen::Vector3i frustumMinIdx, frustumMaxIdx;
+		this->posToIndex(frustumMin, frustumMinIdx);
+		this->posToIndex(frustumMax, frustumMaxIdx);
+		frustumMinIdx = frustumMinIdx.cwiseMax(this->updateClip_.rangeMin);
+		frustumMaxIdx = frustumMaxIdx.cwiseMin(this->updateClip_.rangeMax);
+		if ((frustumMinIdx.array() > frustumMaxIdx.array()).any()){
+			return;
+		}
 
-			this->occupancy_[cacheAddress] = std::min(std::max(this->occupancy_[cacheAddress]+logUpdateValue, this->pMinLog_), this->pMaxLog_);
+		// voxel centers in camera frame are linear in the voxel index
+		Eigen::Matrix3d mapToCam = this->orientation_.transpose();
+		Eigen::Vector3d minPos;
+		this->indexToPos(frustumMinIdx, minPos);
+		Eigen::Vector3d camMin = mapToCam * (minPos - this->position_);
+		Eigen::Vector3d camStep[3];
+		for (int i=0; i<3; ++i){
+			camStep[i] = mapToCam.col(i) * this->mapRes_;
+		}
 
-			// update the entire map range (if it is not unknown)
-			if (not this->isUnknown(cacheIdx)){
-				Eigen::Vector3d cachePos;
-				this->indexToPos(cacheIdx, cachePos);
-				if (cachePos(0) > this->currMapRangeMax_(0)){
-					this->currMapRangeMax_(0) = cachePos(0);
-				}
-				else if (cachePos(0) < this->currMapRangeMin_(0)){
-					this->currMapRangeMin_(0) = cachePos(0);
-				}
+		Eigen::Vector3i idx;
+		for (idx(0)=frustumMinIdx(0); idx(0)<=frustumMaxIdx(0); ++idx(0)){
+			for (idx(1)=frustumMinIdx(1); idx(1)<=frustumMaxIdx(1); ++idx(1)){
+				Eigen::Vector3d pointCam = camMin + (idx(0) - frustumMinIdx(0)) * camStep[0] + (idx(1) - frustumMinIdx(1)) * camStep[1];
+				for (idx(2)=frustumMinIdx(2); idx(2)<=frustumMaxIdx(2); ++idx(2), pointCam+=camStep[2]){
+					if (pointCam(2) <= 0 or pointCam.squaredNorm() > maxLength * maxLength){
+						continue;
+					}
+					int u = int(round(pointCam(0)/pointCam(2) * this->fx_ + this->cx_));
+					int v = int(round(pointCam(1)/pointCam(2) * this->fy_ + this->cy_));
+					if (u < this->depthFilterMargin_ or u >= cols - this->depthFilterMargin_ or v < this->depthFilterMargin_ or v >= rows - this->depthFilterMargin_){
+						continue;
+					}
 
-				if (cachePos(1) > this->currMapRangeMax_(1)){
-					this->currMapRangeMax_(1) = cachePos(1);
-				}
-				else if (cachePos(1) < this->currMapRangeMin_(1)){
-					this->currMapRangeMin_(1) = cachePos(1);
-				}
+					// same depth filtering as projectDepthImage (no return or too far means free up to the max length)
+					uint16_t rawDepth = this->depthImage_.ptr<uint16_t>(v)[u];
+					double depth = rawDepth * inv_factor;
+					bool isSurface = true;
+					if (rawDepth == 0 or depth > this->depthMaxValue_){
+						depth = maxLength + 0.1;
+						isSurface = false;
+					}
+					else if (depth < this->depthMinValue_){
+						continue;
+					}
 
-				if (cachePos(2) > this->currMapRangeMax_(2)){
-					this->currMapRangeMax_(2) = cachePos(2);
-				}
-				else if (cachePos(2) < this->currMapRangeMin_(2)){
-					this->currMapRangeMin_(2) = cachePos(2);
+					if (pointCam(2) < depth - surfaceBand){
+						this->updateOccupancyInfo(this->indexToAddress(idx), false);
+					}
+					else if (isSurface and pointCam(2) <= depth + surfaceBand){
+						this->updateOccupancyInfo(this->indexToAddress(idx), true);
+					}
+					// voxels behind the surface are not observed
 				}
 			}
 		}
 
+		Eigen::Vector3d boundMin, boundMax;
+		this->indexToPos(frustumMinIdx, boundMin);
+		this->indexToPos(frustumMaxIdx, boundMax);
+		this->storeLocalBound(boundMin, boundMax);
+		this->flushUpdateCache();
+	}
+
+	void occMap::computeUpdateClip(){
+		// local update range in voxel index
+		this->posToIndex(this->position_ - this->localUpdateRange_, this->updateClip_.rangeMin);
+		this->posToIndex(this->position_ + this->localUpdateRange_, this->updateClip_.rangeMax);
+		this->boundIndex(this->updateClip_.rangeMin);
+		this->boundIndex(this->updateClip_.rangeMax);
+	}
+
+	void occMap::storeLocalBound(const Eigen::Vector3d& boundMin, const Eigen::Vector3d& boundMax){
+		// store local bound and inflate local bound (inflate is for ESDF update)
+		std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		this->posToIndex(boundMin, this->localBoundMin_);
+		this->posToIndex(boundMax, this->localBoundMax_);
+		this->localBoundMin_ -= int(ceil(this->localBoundInflate_/this->mapRes_)) * Eigen::Vector3i(1, 1, 0); // inflate in x y direction
+		this->localBoundMax_ += int(ceil(this->localBoundInflate_/this->mapRes_)) * Eigen::Vector3i(1, 1, 0); 
+		this->boundIndex(this->localBoundMin_); // since inflated, need to bound if not in reserved range
+		this->boundIndex(this->localBoundMax_);
+
+		// inflation spreads updates by the robot size
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		this->markSnapshotDirty(this->localBoundMin_ - inflateSize, this->localBoundMax_ + inflateSize);
+	}
+
+	void occMap::flushUpdateCache(){
+		// the sensor model is resolved once per frame, the update loop is specialized on it
+		std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		if (not this->sensorModel_){
+			this->applyUpdateCache<constantSensorModel>();
+		}
+		else if (this->sensorInputMode_ == 0){
+			this->applyUpdateCache<depthCameraModel>();
+		}
+		else{
+			this->applyUpdateCache<lidarModel>();
+		}
+	}
+
+	template <typename SensorModel>
+	void occMap::applyUpdateCache(){
+		// all cached voxels are inside the update clip of this frame (computeUpdateClip)
+		// pass 1: reduce the counts to hit (address) or miss (~address) and clear them
+		int updateNum = this->updateVoxelCache_.size();
+		for (int i=0; i<updateNum; ++i){
+			int cacheAddress = this->updateVoxelCache_[i];
+			voxelCount count = this->voxelCount_[cacheAddress];
+			this->voxelCount_[cacheAddress] = voxelCount ();
+			bool isHit = (count.hit != 0) & (2 * count.hit >= count.hitMiss); // hit >= miss
+			this->updateVoxelCache_[i] = isHit ? cacheAddress : ~cacheAddress;
+		}
+
+		// pass 2: update occupancy (log odds of the sensor model by range and off-axis angle from the sensor) without branches:
+		// the clamp to [pMin, pMax] also keeps clamped voxels and sets missed unknown voxels free (prior).
+		// Changed voxels are compacted to the front of the cache, as ~address if they do not extend the map range
+		// (unknown set free, free regions)
+		const Eigen::Vector3d sensorAxis = this->orientation_.col(2);
+		const double pMinLog = this->pMinLog_;
+		const double pMaxLog = this->pMaxLog_;
+		const bool checkFreeRegions = this->useFreeRegions_; // current used in simulation, this region will not be updated and directly set to free
+		Eigen::Vector3i cacheIdx;
+		Eigen::Vector3d cacheDiff;
+		int changedNum = 0;
+		for (int i=0; i<updateNum; ++i){
+			int cacheAddress = this->updateVoxelCache_[i];
+			bool isHit = cacheAddress >= 0;
+			cacheAddress ^= cacheAddress >> 31; // ~address of a miss
+			int modelKey = 0;
+			if (SensorModel::GEOMETRIC or checkFreeRegions){
+				this->addressToIndex(cacheAddress, cacheIdx);
+			}
+			if (SensorModel::GEOMETRIC){
+				this->indexToPos(cacheIdx, cacheDiff);
+				modelKey = this->sensorModelTable_.key(cacheDiff - this->position_, sensorAxis);
+			}
+			double logUpdateValue = this->sensorModelTable_.logOdds(modelKey, isHit);
+			bool inFreeRegion = checkFreeRegions and this->isInHistFreeRegions(cacheIdx);
+
+			double& occupancy = this->occupancy_[cacheAddress];
+			double updatedOccupancy = std::min(std::max(occupancy + logUpdateValue, pMinLog), pMaxLog);
+			updatedOccupancy = inFreeRegion ? pMinLog : updatedOccupancy;
+			bool extendsRange = (not inFreeRegion) & (isHit | (occupancy >= pMinLog));
+			this->updateVoxelCache_[changedNum] = extendsRange ? cacheAddress : ~cacheAddress;
+			changedNum += (updatedOccupancy != occupancy);
+			occupancy = updatedOccupancy;
+		}
+
+		// pass 3: mark the changed voxels and update the entire map range (if it is not unknown)
+		Eigen::Vector3d cachePos;
+		for (int i=0; i<changedNum; ++i){
+			int cacheAddress = this->updateVoxelCache_[i];
+			bool extendsRange = cacheAddress >= 0;
+			cacheAddress ^= cacheAddress >> 31;
+			this->addressToIndex(cacheAddress, cacheIdx);
+			this->markBlockDirty(cacheIdx);
+			if (extendsRange){
+				this->indexToPos(cacheIdx, cachePos);
+				this->currMapRangeMax_ = this->currMapRangeMax_.cwiseMax(cachePos);
+				this->currMapRangeMin_ = this->currMapRangeMin_.cwiseMin(cachePos);
+			}
+		}
+		this->updateVoxelCache_.clear();
 	}
 
 	void occMap::cleanLocalMap(){
+		// reset the shell of 5 voxels around the local map to unknown as disjoint slabs (x slabs, then y and z slabs inside the remaining box)
+		std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
 		Eigen::Vector3i posIndex;
 		this->posToIndex(this->position_, posIndex);
 		Eigen::Vector3i innerMinBBX = posIndex - this->localMapVoxel_;
 		Eigen::Vector3i innerMaxBBX = posIndex + this->localMapVoxel_;
 		Eigen::Vector3i outerMinBBX = innerMinBBX - Eigen::Vector3i(5, 5, 5);
 		Eigen::Vector3i outerMaxBBX = innerMaxBBX + Eigen::Vector3i(5, 5, 5);
-		this->boundIndex(innerMinBBX);
-		this->boundIndex(innerMaxBBX);
 		this->boundIndex(outerMinBBX);
 		this->boundIndex(outerMaxBBX);
 
-		// clear x axis
-		for (int y=outerMinBBX(1); y<=outerMaxBBX(1); ++y){
-			for (int z=outerMinBBX(2); z<=outerMaxBBX(2); ++z){
-				for (int x=outerMinBBX(0); x<=innerMinBBX(0); ++x){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;
+		// the local map is not bounded, so a side where it reaches out of the map has no slab
+		Eigen::Vector3i restMin = outerMinBBX;
+		Eigen::Vector3i restMax = outerMaxBBX;
+		for (int i=0; i<3; ++i){
+			Eigen::Vector3i slabMax = restMax;
+			slabMax(i) = std::min(innerMinBBX(i) - 1, outerMaxBBX(i));
+			this->clearRegion(restMin, slabMax);
+
+			Eigen::Vector3i slabMin = restMin;
+			slabMin(i) = std::max(innerMaxBBX(i) + 1, outerMinBBX(i));
+			this->clearRegion(slabMin, restMax);
+
+			restMin(i) = std::max(innerMinBBX(i), outerMinBBX(i));
+			restMax(i) = std::min(innerMaxBBX(i), outerMaxBBX(i));
+		}
+		this->advanceMapVersion(); // later changes of the cleared blocks carry a newer version
+		this->updateMapPyramid(); // free space skipping must not use the cleared voxels
+	}
+
+	void occMap::clearRegion(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		// reset a box to unknown block by block (occupancy and inflation in z runs, other layers by clearRegionLayers)
+		// voxels of a block not changed since they were cleared are still unknown, a block is skipped if the whole part is
+		if ((minIdx.array() > maxIdx.array()).any()){
+			return;
+		}
+
+		// other layers can be written without a change of the block version (ESDF on its own stage), they get the whole box
+		this->clearRegionLayers(minIdx, maxIdx);
+
+		const double unknownValue = this->pMinLog_ - this->UNKNOWN_FLAG_;
+		Eigen::Vector3i blockMin, blockMax, clearMin, clearMax;
+		for (int i=0; i<3; ++i){
+			blockMin(i) = minIdx(i) >> DELTA_BLOCK_SHIFT;
+			blockMax(i) = maxIdx(i) >> DELTA_BLOCK_SHIFT;
+		}
+		for (int bx=blockMin(0); bx<=blockMax(0); ++bx){
+			for (int by=blockMin(1); by<=blockMax(1); ++by){
+				for (int bz=blockMin(2); bz<=blockMax(2); ++bz){
+					Eigen::Vector3i blockStart (bx << DELTA_BLOCK_SHIFT, by << DELTA_BLOCK_SHIFT, bz << DELTA_BLOCK_SHIFT);
+					clearMin = minIdx.cwiseMax(blockStart);
+					clearMax = maxIdx.cwiseMin(blockStart + Eigen::Vector3i::Constant(DELTA_BLOCK_SIZE - 1));
+					int block = (bx * this->blockNum_(1) + by) * this->blockNum_(2) + bz;
+					Eigen::Vector3i localMin = clearMin - blockStart;
+					Eigen::Vector3i localMax = clearMax - blockStart;
+					uint64_t columnBits = ((uint64_t(1) << (localMax(2) - localMin(2) + 1)) - 1) << localMin(2);
+					uint64_t partWord = 0; // bits of the part in each word of its x range
+					for (int dy=localMin(1); dy<=localMax(1); ++dy){
+						partWord |= columnBits << (dy << DELTA_BLOCK_SHIFT);
+					}
+					uint64_t* clearedWords = &this->clearedMask_[block * DELTA_BLOCK_SIZE];
+					bool blockClean = this->blockClearVersion_[block] == this->blockVersion_[block];
+					bool partCleared = blockClean;
+					for (int dx=localMin(0); partCleared and dx<=localMax(0); ++dx){
+						partCleared = (partWord & ~clearedWords[dx]) == 0;
+					}
+					if (partCleared){
+						continue;
+					}
+
+					for (int x=clearMin(0); x<=clearMax(0); ++x){
+						for (int y=clearMin(1); y<=clearMax(1); ++y){
+							this->forEachZRun(x, y, clearMin(2), clearMax(2), [&](int address, int length){
+								std::fill(this->occupancy_.begin() + address, this->occupancy_.begin() + address + length, unknownValue);
+								std::fill(this->occupancyInflated_.begin() + address, this->occupancyInflated_.begin() + address + length, false);
+							});
+						}
+					}
+					this->markRegionDirty(clearMin, clearMax);
+					for (int dx=0; dx<DELTA_BLOCK_SIZE; ++dx){
+						uint64_t word = (dx >= localMin(0) and dx <= localMax(0)) ? partWord : 0;
+						clearedWords[dx] = blockClean ? (clearedWords[dx] | word) : word; // a changed block only keeps this part
+					}
+					this->blockClearVersion_[block] = this->blockVersion_[block];
 				}
+			}
+		}
+	}
+
+	void occMap::clearRegionLayers(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		// no other voxel layers in the occupancy map
+	}
+
+	void occMap::freeRegions(const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions){
+		// all regions are cleared together: occupancy in z runs, then inflation is cleared around the regions and
+		// obstacles left outside the regions re-inflate the shell they can still reach (nothing deeper can be inflated)
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		std::vector<std::pair<Eigen::Vector3i, Eigen::Vector3i>> boxes;
+		boxes.reserve(freeRegions.size());
+		for (const std::pair<Eigen::Vector3d, Eigen::Vector3d>& freeRegion : freeRegions){
+			Eigen::Vector3i idx1, idx2;
+			this->posToIndex(freeRegion.first, idx1);
+			this->posToIndex(freeRegion.second, idx2);
+			this->boundIndex(idx1);
+			this->boundIndex(idx2);
+			if ((idx1.array() <= idx2.array()).all()){
+				boxes.push_back(std::make_pair(idx1, idx2));
+			}
+		}
 
-				for (int x=innerMaxBBX(0); x<=outerMaxBBX(0); ++x){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;					
+		// occupancy
+		for (const std::pair<Eigen::Vector3i, Eigen::Vector3i>& box : boxes){
+			for (int x=box.first(0); x<=box.second(0); ++x){
+				for (int y=box.first(1); y<=box.second(1); ++y){
+					this->forEachZRun(x, y, box.first(2), box.second(2), [&](int address, int length){
+						std::fill(this->occupancy_.begin() + address, this->occupancy_.begin() + address + length, this->pMinLog_);
+					});
 				}
 			}
 		}
 
-		// clear y axis
-		for (int x=outerMinBBX(0); x<=outerMaxBBX(0); ++x){
-			for (int z=outerMinBBX(2); z<=outerMaxBBX(2); ++z){
-				for (int y=outerMinBBX(1); y<=innerMinBBX(1); ++y){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;
+		// clear inflation in the regions dilated by the robot size
+		for (const std::pair<Eigen::Vector3i, Eigen::Vector3i>& box : boxes){
+			Eigen::Vector3i dilatedMin = box.first - inflateSize;
+			Eigen::Vector3i dilatedMax = box.second + inflateSize;
+			this->boundIndex(dilatedMin);
+			this->boundIndex(dilatedMax);
+			this->markRegionDirty(dilatedMin, dilatedMax);
+			for (int x=dilatedMin(0); x<=dilatedMax(0); ++x){
+				for (int y=dilatedMin(1); y<=dilatedMax(1); ++y){
+					this->forEachZRun(x, y, dilatedMin(2), dilatedMax(2), [&](int address, int length){
+						std::fill(this->occupancyInflated_.begin() + address, this->occupancyInflated_.begin() + address + length, false);
+					});
 				}
+			}
+		}
 
-				for (int y=innerMaxBBX(1); y<=outerMaxBBX(1); ++y){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;
+		// re-inflate the cleared ranges from the occupied voxels around each region (all of them are outside the regions)
+		for (const std::pair<Eigen::Vector3i, Eigen::Vector3i>& box : boxes){
+			Eigen::Vector3i dilatedMin = box.first - inflateSize;
+			Eigen::Vector3i dilatedMax = box.second + inflateSize;
+			Eigen::Vector3i sourceMin = dilatedMin - inflateSize;
+			Eigen::Vector3i sourceMax = dilatedMax + inflateSize;
+			this->boundIndex(dilatedMin);
+			this->boundIndex(dilatedMax);
+			this->boundIndex(sourceMin);
+			this->boundIndex(sourceMax);
+			for (int x=sourceMin(0); x<=sourceMax(0); ++x){
+				for (int y=sourceMin(1); y<=sourceMax(1); ++y){
+					bool columnInBox = (x >= box.first(0)) and (x <= box.second(0)) and (y >= box.first(1)) and (y <= box.second(1));
+					for (int z=sourceMin(2); z<=sourceMax(2); ++z){
+						if (columnInBox and z == box.first(2)){
+							z = box.second(2); // just cleared
+							continue;
+						}
+						if (this->occupancy_[this->indexToAddress(x, y, z)] < this->pOccLog_){
+							continue;
+						}
+						int zmin = std::max(z - inflateSize(2), dilatedMin(2));
+						int zmax = std::min(z + inflateSize(2), dilatedMax(2));
+						for (int ix=std::max(x - inflateSize(0), dilatedMin(0)); ix<=std::min(x + inflateSize(0), dilatedMax(0)); ++ix){
+							for (int iy=std::max(y - inflateSize(1), dilatedMin(1)); iy<=std::min(y + inflateSize(1), dilatedMax(1)); ++iy){
+								this->forEachZRun(ix, iy, zmin, zmax, [&](int address, int length){
+									std::fill(this->occupancyInflated_.begin() + address, this->occupancyInflated_.begin() + address + length, true);
+								});
+							}
+						}
+					}
 				}
 			}
 		}
+	}
 
-		// clear z axis
-		for (int x=outerMinBBX(0); x<=outerMaxBBX(0); ++x){
-			for (int y=outerMinBBX(1); y<=outerMaxBBX(1); ++y){
-				for (int z=outerMinBBX(2); z<=innerMinBBX(2); ++z){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;
+	void occMap::inflateRegion(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		// separable dilation: occupied voxels around the region are dilated by the robot size along z, y, x
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		Eigen::Vector3i regionMin = minIdx;
+		Eigen::Vector3i regionMax = maxIdx;
+		Eigen::Vector3i sourceMin = minIdx - inflateSize;
+		Eigen::Vector3i sourceMax = maxIdx + inflateSize;
+		this->boundIndex(regionMin);
+		this->boundIndex(regionMax);
+		this->boundIndex(sourceMin);
+		this->boundIndex(sourceMax);
+
+		const Eigen::Vector3i dim = sourceMax - sourceMin + Eigen::Vector3i (1, 1, 1);
+		const int strideX = dim(1) * dim(2);
+		const int strideY = dim(2);
+		std::vector<uint8_t> bufferA (strideX * dim(0)), bufferB (strideX * dim(0));
+		const int threadNum = std::max(1, int(std::thread::hardware_concurrency()));
+
+		// occupied seeds and z pass
+		parallelFor(threadNum, [&](int t){
+			for (int x=t; x<dim(0); x+=threadNum){
+				for (int y=0; y<dim(1); ++y){
+					uint8_t* line = bufferA.data() + x * strideX + y * strideY;
+					for (int z=0; z<dim(2); ++z){
+						line[z] = this->isOccupied(Eigen::Vector3i (x+sourceMin(0), y+sourceMin(1), z+sourceMin(2)));
+					}
+					dilateLine(line, bufferB.data() + x * strideX + y * strideY, dim(2), 1, inflateSize(2));
 				}
+			}
+		});
+
+		// y pass
+		parallelFor(threadNum, [&](int t){
+			for (int x=t; x<dim(0); x+=threadNum){
+				for (int z=0; z<dim(2); ++z){
+					dilateLine(bufferB.data() + x * strideX + z, bufferA.data() + x * strideX + z, dim(1), strideY, inflateSize(1));
+				}
+			}
+		});
 
-				for (int z=innerMaxBBX(2); z<=outerMaxBBX(2); ++z){
-					this->occupancy_[this->indexToAddress(Eigen::Vector3i (x, y, z))] = this->pMinLog_ - this->UNKNOWN_FLAG_;
+		// x pass
+		parallelFor(threadNum, [&](int t){
+			for (int y=t; y<dim(1); y+=threadNum){
+				for (int z=0; z<dim(2); ++z){
+					dilateLine(bufferA.data() + y * strideY + z, bufferB.data() + y * strideY + z, dim(0), strideX, inflateSize(0));
 				}
 			}
+		});
+
+		// write back (voxels inflated before stay inflated)
+		for (int x=regionMin(0); x<=regionMax(0); ++x){
+			for (int y=regionMin(1); y<=regionMax(1); ++y){
+				const uint8_t* line = bufferB.data() + (x - sourceMin(0)) * strideX + (y - sourceMin(1)) * strideY + (regionMin(2) - sourceMin(2));
+				this->forEachZRun(x, y, regionMin(2), regionMax(2), [&](int address, int length){
+					for (int i=0; i<length; ++i){
+						this->occupancyInflated_[address + i] |= line[i];
+					}
+					line += length;
+				});
+			}
 		}
 	}
 
 	void occMap::inflateLocalMap(){
-		int xmin = this->localBoundMin_(0);
-		int xmax = this->localBoundMax_(0);
-		int ymin = this->localBoundMin_(1);
-		int ymax = this->localBoundMax_(1);
-		int zmin = this->localBoundMin_(2);
-		int zmax = this->localBoundMax_(2);
-		Eigen::Vector3i clearIndex;
-		// clear previous data in current data range
-		for (int x=xmin; x<=xmax; ++x){
-			for (int y=ymin; y<=ymax; ++y){
-				for (int z=zmin; z<=zmax; ++z){
-					clearIndex(0) = x; clearIndex(1) = y; clearIndex(2) = z;
-					this->occupancyInflated_[this->indexToAddress(clearIndex)] = false;
-				}
+		// the inflation of the local bound and of the shell it reaches is rebuilt in a scratch box (occupancy is only written by
+		// this stage) and replaces the old inflation together with its pyramid cells under the map lock, so readers never see a
+		// cleared or partly inflated bound, or inflated voxels in a cell the pyramid still marks as free
+		Eigen::Vector3i inflateSize (ceil(this->robotSize_(0)/(2*this->mapRes_)), ceil(this->robotSize_(1)/(2*this->mapRes_)), ceil(this->robotSize_(2)/(2*this->mapRes_)));
+		Eigen::Vector3i regionMin = this->localBoundMin_ - inflateSize;
+		Eigen::Vector3i regionMax = this->localBoundMax_ + inflateSize;
+		Eigen::Vector3i sourceMin = regionMin - inflateSize;
+		Eigen::Vector3i sourceMax = regionMax + inflateSize;
+		this->boundIndex(regionMin);
+		this->boundIndex(regionMax);
+		this->boundIndex(sourceMin);
+		this->boundIndex(sourceMax);
+
+		// stamp the occupied voxels which reach the box with the robot size (z lines of the box are contiguous)
+		const Eigen::Vector3i dim = regionMax - regionMin + Eigen::Vector3i (1, 1, 1);
+		this->inflateScratch_.assign(dim(0) * dim(1) * dim(2), 0);
+		for (int x=sourceMin(0); x<=sourceMax(0); ++x){
+			for (int y=sourceMin(1); y<=sourceMax(1); ++y){
+				int z = sourceMin(2);
+				this->forEachZRun(x, y, sourceMin(2), sourceMax(2), [&](int address, int length){
+					for (int i=0; i<length; ++i, ++z){
+						if (this->occupancy_[address + i] < this->pOccLog_){
+							continue;
+						}
+						int zmin = std::max(z - inflateSize(2), regionMin(2)) - regionMin(2);
+						int zmax = std::min(z + inflateSize(2), regionMax(2)) - regionMin(2);
+						for (int ix=std::max(x - inflateSize(0), regionMin(0)); ix<=std::min(x + inflateSize(0), regionMax(0)); ++ix){
+							for (int iy=std::max(y - inflateSize(1), regionMin(1)); iy<=std::min(y + inflateSize(1), regionMax(1)); ++iy){
+								uint8_t* line = this->inflateScratch_.data() + ((ix - regionMin(0)) * dim(1) + iy - regionMin(1)) * dim(2);
+								memset(line + zmin, 1, zmax - zmin + 1);
+							}
+						}
+					}
+				});
 			}
 		}
 
-		int xInflateSize = ceil(this->robotSize_(0)/(2*this->mapRes_));
-		int yInflateSize = ceil(this->robotSize_(1)/(2*this->mapRes_));
-		int zInflateSize = ceil(this->robotSize_(2)/(2*this->mapRes_));
-
-		// inflate based on current occupancy
-		Eigen::Vector3i pointIndex, inflateIndex;
-		int inflateAddress;
-		const int  maxIndex = this->mapVoxelMax_(0) * this->mapVoxelMax_(1) * this->mapVoxelMax_(2);
-		for (int x=xmin; x<=xmax; ++x){
-			for (int y=ymin; y<=ymax; ++y){
-				for (int z=zmin; z<=zmax; ++z){
-					pointIndex(0) = x; pointIndex(1) = y; pointIndex(2) = z;
-					if (this->isOccupied(pointIndex)){
-						for (int ix=-xInflateSize; ix<=xInflateSize; ++ix){
-							for (int iy=-yInflateSize; iy<=yInflateSize; ++iy){
-								for (int iz=-zInflateSize; iz<=zInflateSize; ++iz){
-									inflateIndex(0) = pointIndex(0) + ix;
-									inflateIndex(1) = pointIndex(1) + iy;
-									inflateIndex(2) = pointIndex(2) + iz;
-									inflateAddress = this->indexToAddress(inflateIndex);
-									if ((inflateAddress < 0) or (inflateAddress > maxIndex)){
-										continue; // those points are not in the reserved map
-									} 
-									this->occupancyInflated_[inflateAddress] = true;
-								}
-							}
+		// only changed voxels are written and mark their blocks, so the pyramid and the change tracking only revisit those
+		std::unique_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		const uint8_t* inflated = this->inflateScratch_.data();
+		Eigen::Vector3i changedMin = regionMax;
+		Eigen::Vector3i changedMax = regionMin;
+		for (int x=regionMin(0); x<=regionMax(0); ++x){
+			for (int y=regionMin(1); y<=regionMax(1); ++y){
+				int z = regionMin(2);
+				this->forEachZRun(x, y, regionMin(2), regionMax(2), [&](int address, int length){
+					for (int i=0; i<length; ++i, ++z){
+						if (this->occupancyInflated_[address + i] == inflated[i]){
+							continue;
 						}
+						this->occupancyInflated_[address + i] = inflated[i];
+						Eigen::Vector3i idx (x, y, z);
+						this->markBlockDirty(idx);
+						changedMin = changedMin.cwiseMin(idx);
+						changedMax = changedMax.cwiseMax(idx);
 					}
-				}
+					inflated += length;
+				});
 			}
 		}
+		if ((changedMin.array() <= changedMax.array()).all()){
+			this->markSnapshotDirty(changedMin, changedMax);
+		}
+		this->updateMapPyramid();
 	}
 
 
 
+	void occMap::updateMapPyramid(){
+		// rebuild the pyramid cells of blocks changed since the last update (8x cell = block)
+		uint8_t levelFlags[DELTA_BLOCK_SHIFT][DELTA_BLOCK_VOXELS/8];
+		Eigen::Vector3i blockMin;
+		std::vector<int> dirtyBlocks;
+		this->takeDirtyBlocks(DIRTY_PYRAMID, dirtyBlocks);
+		for (int block : dirtyBlocks){
+			this->blockToIndex(block, blockMin);
+
+			// max pool voxel flags into the first level (local cells of the block in x-major order), voxels out of the map
+			// count as occupied and unknown
+			memset(levelFlags, 0, sizeof(levelFlags));
+			const int firstSize = DELTA_BLOCK_SIZE >> 1;
+			Eigen::Vector3i localMax = (this->mapVoxelMax_ - Eigen::Vector3i::Ones() - blockMin).cwiseMin(DELTA_BLOCK_SIZE - 1);
+			for (int cx=0; cx<firstSize; ++cx){
+				for (int cy=0; cy<firstSize; ++cy){
+					for (int cz=0; cz<firstSize; ++cz){
+						if (2*cx+1 > localMax(0) or 2*cy+1 > localMax(1) or 2*cz+1 > localMax(2)){
+							levelFlags[0][(cx * firstSize + cy) * firstSize + cz] = PYRAMID_OCCUPIED | PYRAMID_UNKNOWN;
+						}
+					}
+				}
+			}
+			for (int dx=0; dx<=localMax(0); ++dx){
+				for (int dy=0; dy<=localMax(1); ++dy){
+					uint8_t* cells = levelFlags[0] + ((dx >> 1) * firstSize + (dy >> 1)) * firstSize;
+					int dz = 0;
+					this->forEachZRun(blockMin(0) + dx, blockMin(1) + dy, blockMin(2), blockMin(2) + localMax(2), [&](int address, int length){
+						for (int i=address; i<address+length; ++i, ++dz){
+							cells[dz >> 1] |= (this->occupancyInflated_[i] ? PYRAMID_OCCUPIED : 0) | ((this->occupancy_[i] < this->pMinLog_) ? PYRAMID_UNKNOWN : 0);
+						}
+					});
+				}
+			}
+
+			// coarser levels of the block pool 2x2x2 cells of the level below
+			for (int level=2; level<=DELTA_BLOCK_SHIFT; ++level){
+				int cellSize = DELTA_BLOCK_SIZE >> level; // cells of this level per block side
+				int childSize = cellSize * 2;
+				for (int cx=0; cx<childSize; ++cx){
+					for (int cy=0; cy<childSize; ++cy){
+						for (int cz=0; cz<childSize; ++cz){
+							levelFlags[level-1][((cx >> 1) * cellSize + (cy >> 1)) * cellSize + (cz >> 1)] |= levelFlags[level-2][(cx * childSize + cy) * childSize + cz];
+						}
+					}
+				}
+			}
+
+			for (int level=1; level<=DELTA_BLOCK_SHIFT; ++level){
+				int cellSize = DELTA_BLOCK_SIZE >> level;
+				const Eigen::Vector3i& dim = this->pyramidDim_[level-1];
+				Eigen::Vector3i cellMin (blockMin(0) >> level, blockMin(1) >> level, blockMin(2) >> level);
+				for (int cx=0; cx<cellSize; ++cx){
+					for (int cy=0; cy<cellSize; ++cy){
+						for (int cz=0; cz<cellSize; ++cz){
+							this->mapPyramid_[level-1][((cellMin(0) + cx) * dim(1) + cellMin(1) + cy) * dim(2) + cellMin(2) + cz] = levelFlags[level-1][(cx * cellSize + cy) * cellSize + cz];
+						}
+					}
+				}
+			}
+		}
+
+		// levels coarser than a block pool the 2x2x2 children of the parents of changed blocks
+		for (int level=DELTA_BLOCK_SHIFT+1; level<=PYRAMID_LEVELS; ++level){
+			const Eigen::Vector3i& childDim = this->pyramidDim_[level-2];
+			const Eigen::Vector3i& dim = this->pyramidDim_[level-1];
+			for (int block : dirtyBlocks){
+				this->blockToIndex(block, blockMin);
+				Eigen::Vector3i cell (blockMin(0) >> level, blockMin(1) >> level, blockMin(2) >> level);
+				uint8_t flags = 0;
+				for (int c=0; c<8; ++c){
+					Eigen::Vector3i child (2*cell(0) + (c >> 2), 2*cell(1) + ((c >> 1) & 1), 2*cell(2) + (c & 1));
+					if (child(0) >= childDim(0) or child(1) >= childDim(1) or child(2) >= childDim(2)){
+						flags |= PYRAMID_OCCUPIED | PYRAMID_UNKNOWN;
+						continue;
+					}
+					flags |= this->mapPyramid_[level-2][(child(0) * childDim(1) + child(1)) * childDim(2) + child(2)];
+				}
+				this->mapPyramid_[level-1][(cell(0) * dim(1) + cell(1)) * dim(2) + cell(2)] = flags;
+			}
+		}
+	}
+
 	void occMap::visCB(const ros::TimerEvent& ){
 		// this->publishProjPoints();
 		// this->publishMap();
@@ -1064,6 +2357,10 @@ namespace mapManager{
 	void occMap::map2DVisCB(const ros::TimerEvent& ){
 		this->publish2DOccupancyGrid();
 	}
+
+	void occMap::mapDeltaCB(const ros::TimerEvent& ){
+		this->publishMapDelta();
+	}
 	
 	void occMap::startVisualization(){
 		ros::Rate r (10);
@@ -1083,30 +2380,14 @@ namespace mapManager{
 			this->publishProjPoints();
 			this->publishMap();
 			// this->publishInflatedMap();
-			this->publish2DOccupancyGrid();
 			r.sleep();	
 		}
 	}
 
 	void occMap::getMapVisData(pcl::PointCloud<pcl::PointXYZ>& mapCloud, pcl::PointCloud<pcl::PointXYZ>& inflatedMapCloud, pcl::PointCloud<pcl::PointXYZ>& exploredMapCloud, pcl::PointCloud<pcl::PointXYZ>& depthCloud){
 		pcl::PointXYZ pt;
-		Eigen::Vector3d minRange, maxRange;
-		if (this->visGlobalMap_){
-			// minRange = this->mapSizeMin_;
-			// maxRange = this->mapSizeMax_;
-			minRange = this->currMapRangeMin_;
-			maxRange = this->currMapRangeMax_;
-		}
-		else{
-			minRange = this->position_ - localMapSize_;
-			maxRange = this->position_ + localMapSize_;
-			minRange(2) = this->groundHeight_;
-		}
 		Eigen::Vector3i minRangeIdx, maxRangeIdx;
-		this->posToIndex(minRange, minRangeIdx);
-		this->posToIndex(maxRange, maxRangeIdx);
-		this->boundIndex(minRangeIdx);
-		this->boundIndex(maxRangeIdx);
+		this->getVisRange(minRangeIdx, maxRangeIdx);
 
 		for (int i=0; i<this->projPointsNum_; ++i){
 			pt.x = this->projPoints_[i](0);
@@ -1120,45 +2401,28 @@ namespace mapManager{
 		depthCloud.is_dense = true;
 		depthCloud.header.frame_id = "map";
 
-		for (int x=minRangeIdx(0); x<=maxRangeIdx(0); ++x){
-			for (int y=minRangeIdx(1); y<=maxRangeIdx(1); ++y){
-				for (int z=minRangeIdx(2); z<=maxRangeIdx(2); ++z){
-					Eigen::Vector3i pointIdx (x, y, z);
-
-					if (this->isOccupied(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						if (point(2) <= this->maxVisHeight_){
-							pt.x = point(0);
-							pt.y = point(1);
-							pt.z = point(2);
-							mapCloud.push_back(pt);
-						}
-					}
-					
-					if (this->isInflatedOccupied(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						if (point(2) <= this->maxVisHeight_){
-							pt.x = point(0);
-							pt.y = point(1);
-							pt.z = point(2);
-							inflatedMapCloud.push_back(pt);
-						}
-					}
+		std::lock_guard<std::mutex> visMaskLock (this->visMaskMutex_);
+		this->updateVisMask();
+		Eigen::Vector3d point;
+		this->forEachMaskedVoxel(this->occupiedMask_, minRangeIdx, maxRangeIdx, [&](const Eigen::Vector3i& pointIdx){
+			this->indexToPos(pointIdx, point);
+			if (point(2) <= this->maxVisHeight_){
+				mapCloud.push_back(pcl::PointXYZ (point(0), point(1), point(2)));
+			}
+		});
 
-					// publish explored voxel map
-					if(!this->isUnknown(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						pt.x = point(0);
-						pt.y = point(1);
-						pt.z = point(2);
-						exploredMapCloud.push_back(pt);
-					}
-				}
+		this->forEachMaskedVoxel(this->inflatedMask_, minRangeIdx, maxRangeIdx, [&](const Eigen::Vector3i& pointIdx){
+			this->indexToPos(pointIdx, point);
+			if (point(2) <= this->maxVisHeight_){
+				inflatedMapCloud.push_back(pcl::PointXYZ (point(0), point(1), point(2)));
 			}
-		}
+		});
+
+		// explored voxel map
+		this->forEachMaskedVoxel(this->exploredMask_, minRangeIdx, maxRangeIdx, [&](const Eigen::Vector3i& pointIdx){
+			this->indexToPos(pointIdx, point);
+			exploredMapCloud.push_back(pcl::PointXYZ (point(0), point(1), point(2)));
+		});
 
 		mapCloud.width = mapCloud.points.size();
 		mapCloud.height = 1;
@@ -1176,32 +2440,8 @@ namespace mapManager{
 		exploredMapCloud.header.frame_id = "map";
 	}
 
-	void occMap::publishProjPoints(){
-		pcl::PointXYZ pt;
-		pcl::PointCloud<pcl::PointXYZ> cloud;
-
-		for (int i=0; i<this->projPointsNum_; ++i){
-			pt.x = this->projPoints_[i](0);
-			pt.y = this->projPoints_[i](1);
-			pt.z = this->projPoints_[i](2);
-			cloud.push_back(pt);
-		}
-
-		cloud.width = cloud.points.size();
-		cloud.height = 1;
-		cloud.is_dense = true;
-		cloud.header.frame_id = "map";
-
-		sensor_msgs::PointCloud2 cloudMsg;
-		pcl::toROSMsg(cloud, cloudMsg);
-		this->depthCloudPub_.publish(cloudMsg);
-	}
-
-	void occMap::publishMap(){
-		pcl::PointXYZ pt;
-		pcl::PointCloud<pcl::PointXYZ> cloud;
-		pcl::PointCloud<pcl::PointXYZ> exploredCloud;
-
+	void occMap::getVisRange(Eigen::Vector3i& minRangeIdx, Eigen::Vector3i& maxRangeIdx){
+		std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
 		Eigen::Vector3d minRange, maxRange;
 		if (this->visGlobalMap_){
 			// minRange = this->mapSizeMin_;
@@ -1214,153 +2454,296 @@ namespace mapManager{
 			maxRange = this->position_ + localMapSize_;
 			minRange(2) = this->groundHeight_;
 		}
-		Eigen::Vector3i minRangeIdx, maxRangeIdx;
 		this->posToIndex(minRange, minRangeIdx);
 		this->posToIndex(maxRange, maxRangeIdx);
 		this->boundIndex(minRangeIdx);
 		this->boundIndex(maxRangeIdx);
+	}
 
-		for (int x=minRangeIdx(0); x<=maxRangeIdx(0); ++x){
-			for (int y=minRangeIdx(1); y<=maxRangeIdx(1); ++y){
-				for (int z=minRangeIdx(2); z<=maxRangeIdx(2); ++z){
-					Eigen::Vector3i pointIdx (x, y, z);
-
-					// if (this->occupancy_[this->indexToAddress(pointIdx)] > this->pMinLog_){
-					if (this->isOccupied(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						if (point(2) <= this->maxVisHeight_){
-							pt.x = point(0);
-							pt.y = point(1);
-							pt.z = point(2);
-							cloud.push_back(pt);
-						}
+	void occMap::updateVisMask(){
+		// rebuild the bitmasks of blocks changed since the last update
+		std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		std::vector<int> dirtyBlocks;
+		this->takeDirtyBlocks(DIRTY_VIS_MASK, dirtyBlocks);
+
+		Eigen::Vector3i blockMin, idx;
+		for (int block : dirtyBlocks){
+			this->blockToIndex(block, blockMin);
+			for (int dx=0; dx<DELTA_BLOCK_SIZE; ++dx){
+				uint64_t occupiedWord = 0, inflatedWord = 0, exploredWord = 0;
+				idx(0) = blockMin(0) + dx;
+				for (int bit=0; bit<DELTA_BLOCK_VOXELS/DELTA_BLOCK_SIZE; ++bit){
+					idx(1) = blockMin(1) + (bit >> DELTA_BLOCK_SHIFT);
+					idx(2) = blockMin(2) + (bit & (DELTA_BLOCK_SIZE - 1));
+					if (not this->isInMap(idx)){
+						continue;
 					}
+					int address = this->indexToAddress(idx);
+					occupiedWord |= uint64_t(this->occupancy_[address] >= this->pOccLog_) << bit;
+					inflatedWord |= uint64_t(this->occupancyInflated_[address]) << bit;
+					exploredWord |= uint64_t(this->occupancy_[address] >= this->pMinLog_) << bit;
+				}
+				this->occupiedMask_[block * DELTA_BLOCK_SIZE + dx] = occupiedWord;
+				this->inflatedMask_[block * DELTA_BLOCK_SIZE + dx] = inflatedWord;
+				this->exploredMask_[block * DELTA_BLOCK_SIZE + dx] = exploredWord;
+			}
+		}
+	}
 
-					// publish explored voxel map
-					if(!this->isUnknown(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						pt.x = point(0);
-						pt.y = point(1);
-						pt.z = point(2);
-						exploredCloud.push_back(pt);
+	void occMap::maskToCloud(const std::vector<uint64_t>& mask, const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx, double maxHeight, sensor_msgs::PointCloud2& cloudMsg){
+		if (cloudMsg.fields.empty()){
+			const char* names[3] = {"x", "y", "z"};
+			for (int i=0; i<3; ++i){
+				sensor_msgs::PointField field;
+				field.name = names[i];
+				field.offset = i * sizeof(float);
+				field.datatype = sensor_msgs::PointField::FLOAT32;
+				field.count = 1;
+				cloudMsg.fields.push_back(field);
+			}
+			cloudMsg.header.frame_id = "map";
+			cloudMsg.height = 1;
+			cloudMsg.is_bigendian = false;
+			cloudMsg.is_dense = true;
+			cloudMsg.point_step = 3 * sizeof(float);
+		}
+
+		// upper bound of the point number (capacity of the buffer is kept between publishes)
+		size_t maxPointNum = 0;
+		for (int bx=(minIdx(0) >> DELTA_BLOCK_SHIFT); bx<=(maxIdx(0) >> DELTA_BLOCK_SHIFT); ++bx){
+			for (int by=(minIdx(1) >> DELTA_BLOCK_SHIFT); by<=(maxIdx(1) >> DELTA_BLOCK_SHIFT); ++by){
+				for (int bz=(minIdx(2) >> DELTA_BLOCK_SHIFT); bz<=(maxIdx(2) >> DELTA_BLOCK_SHIFT); ++bz){
+					const uint64_t* words = &mask[((bx * this->blockNum_(1) + by) * this->blockNum_(2) + bz) * DELTA_BLOCK_SIZE];
+					for (int dx=0; dx<DELTA_BLOCK_SIZE; ++dx){
+						maxPointNum += __builtin_popcountll(words[dx]);
 					}
 				}
 			}
 		}
+		cloudMsg.data.resize(maxPointNum * cloudMsg.point_step);
+
+		float* out = reinterpret_cast<float*>(cloudMsg.data.data());
+		size_t pointNum = 0;
+		Eigen::Vector3d point;
+		this->forEachMaskedVoxel(mask, minIdx, maxIdx, [&](const Eigen::Vector3i& pointIdx){
+			this->indexToPos(pointIdx, point);
+			if (point(2) <= maxHeight){
+				out[3*pointNum] = point(0);
+				out[3*pointNum+1] = point(1);
+				out[3*pointNum+2] = point(2);
+				++pointNum;
+			}
+		});
+		cloudMsg.data.resize(pointNum * cloudMsg.point_step);
+		cloudMsg.width = pointNum;
+		cloudMsg.row_step = cloudMsg.data.size();
+	}
+
+	void occMap::publishProjPoints(){
+		pcl::PointXYZ pt;
+		pcl::PointCloud<pcl::PointXYZ> cloud;
+
+		for (int i=0; i<this->projPointsNum_; ++i){
+			pt.x = this->projPoints_[i](0);
+			pt.y = this->projPoints_[i](1);
+			pt.z = this->projPoints_[i](2);
+			cloud.push_back(pt);
+		}
 
 		cloud.width = cloud.points.size();
 		cloud.height = 1;
 		cloud.is_dense = true;
 		cloud.header.frame_id = "map";
 
-		exploredCloud.width = exploredCloud.points.size();
-		exploredCloud.height = 1;
-		exploredCloud.is_dense = true;
-		exploredCloud.header.frame_id = "map";
-
 		sensor_msgs::PointCloud2 cloudMsg;
-		sensor_msgs::PointCloud2 exploredCloudMsg;
 		pcl::toROSMsg(cloud, cloudMsg);
-		pcl::toROSMsg(exploredCloud, exploredCloudMsg);
-		this->mapVisPub_.publish(cloudMsg);
-		this->mapExploredPub_.publish(exploredCloudMsg);
+		this->depthCloudPub_.publish(cloudMsg);
+	}
+
+	void occMap::publishMap(){
+		Eigen::Vector3i minRangeIdx, maxRangeIdx;
+		this->getVisRange(minRangeIdx, maxRangeIdx);
+
+		std::lock_guard<std::mutex> visMaskLock (this->visMaskMutex_);
+		this->updateVisMask();
+		this->maskToCloud(this->occupiedMask_, minRangeIdx, maxRangeIdx, this->maxVisHeight_, this->mapCloudMsg_);
+		this->maskToCloud(this->exploredMask_, minRangeIdx, maxRangeIdx, std::numeric_limits<double>::infinity(), this->exploredMapCloudMsg_); // publish explored voxel map
+		this->mapVisPub_.publish(this->mapCloudMsg_);
+		this->mapExploredPub_.publish(this->exploredMapCloudMsg_);
 	}
 
 	void occMap::publishInflatedMap(){
-		pcl::PointXYZ pt;
-		pcl::PointCloud<pcl::PointXYZ> cloud;
+		Eigen::Vector3i minRangeIdx, maxRangeIdx;
+		this->getVisRange(minRangeIdx, maxRangeIdx);
 
-		Eigen::Vector3d minRange, maxRange;
-		if (this->visGlobalMap_){
-			// minRange = this->mapSizeMin_;
-			// maxRange = this->mapSizeMax_;
-			minRange = this->currMapRangeMin_;
-			maxRange = this->currMapRangeMax_;
+		std::lock_guard<std::mutex> visMaskLock (this->visMaskMutex_);
+		this->updateVisMask();
+		this->maskToCloud(this->inflatedMask_, minRangeIdx, maxRangeIdx, this->maxVisHeight_, this->inflatedMapCloudMsg_);
+		this->inflatedMapVisPub_.publish(this->inflatedMapCloudMsg_);	
+	}
+
+	void occMap::update2DOccupancyGrid(){
+		// z range of the height band and the bits of it inside each block column
+		int zMin = std::max(0, int(floor(this->grid2DHeightBand_(0)/this->mapRes_)));
+		int zMax = std::min(this->mapVoxelMax_(2) - 1, int(floor(this->grid2DHeightBand_(1)/this->mapRes_)));
+		if (zMin > zMax){
+			return;
 		}
-		else{
-			minRange = this->position_ - localMapSize_;
-			maxRange = this->position_ + localMapSize_;
-			minRange(2) = this->groundHeight_;
+		int bzMin = zMin >> DELTA_BLOCK_SHIFT;
+		int bzMax = zMax >> DELTA_BLOCK_SHIFT;
+		std::vector<uint64_t> bandMask (bzMax - bzMin + 1);
+		for (int bz=bzMin; bz<=bzMax; ++bz){
+			uint64_t zBits = 0;
+			for (int dz=0; dz<DELTA_BLOCK_SIZE; ++dz){
+				int z = (bz << DELTA_BLOCK_SHIFT) + dz;
+				if (z >= zMin and z <= zMax){
+					zBits |= 1ull << dz;
+				}
+			}
+			bandMask[bz - bzMin] = zBits * 0x0101010101010101ull; // same z bits for every y of the word
+		}
+
+		// only block columns with a block in the band changed since the last update are reduced
+		std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		std::vector<int> dirtyBlocks;
+		this->takeDirtyBlocks(DIRTY_MAP_2D, dirtyBlocks);
+		std::vector<int> dirtyColumns;
+		for (int block : dirtyBlocks){
+			int bz = block % this->blockNum_(2);
+			if (bz >= bzMin and bz <= bzMax){
+				dirtyColumns.push_back(block / this->blockNum_(2));
+			}
 		}
-		Eigen::Vector3i minRangeIdx, maxRangeIdx;
-		this->posToIndex(minRange, minRangeIdx);
-		this->posToIndex(maxRange, maxRangeIdx);
-		this->boundIndex(minRangeIdx);
-		this->boundIndex(maxRangeIdx);
-
-		for (int x=minRangeIdx(0); x<=maxRangeIdx(0); ++x){
-			for (int y=minRangeIdx(1); y<=maxRangeIdx(1); ++y){
-				for (int z=minRangeIdx(2); z<=maxRangeIdx(2); ++z){
-					Eigen::Vector3i pointIdx (x, y, z);
-					// if (this->occupancy_[this->indexToAddress(pointIdx)] > this->pMinLog_){
-					if (this->isInflatedOccupied(pointIdx)){
-						Eigen::Vector3d point;
-						this->indexToPos(pointIdx, point);
-						if (point(2) <= this->maxVisHeight_){
-							pt.x = point(0);
-							pt.y = point(1);
-							pt.z = point(2);
-							cloud.push_back(pt);
-						}
+		std::sort(dirtyColumns.begin(), dirtyColumns.end());
+		dirtyColumns.erase(std::unique(dirtyColumns.begin(), dirtyColumns.end()), dirtyColumns.end());
+
+		const int width = this->map2DMsg_.info.width;
+		for (int column : dirtyColumns){
+			int bx = column / this->blockNum_(1);
+			int by = column % this->blockNum_(1);
+			int columnBlock = column * this->blockNum_(2);
+			for (int dx=0; dx<DELTA_BLOCK_SIZE; ++dx){
+				int x = (bx << DELTA_BLOCK_SHIFT) + dx;
+				if (x >= this->mapVoxelMax_(0)){
+					break;
+				}
+				// OR the packed z columns of all y in this x slice at once
+				uint64_t occupiedWord = 0, exploredWord = 0;
+				for (int bz=bzMin; bz<=bzMax; ++bz){
+					int wordIdx = (columnBlock + bz) * DELTA_BLOCK_SIZE + dx;
+					occupiedWord |= this->occupiedMask_[wordIdx] & bandMask[bz - bzMin];
+					exploredWord |= this->exploredMask_[wordIdx] & bandMask[bz - bzMin];
+				}
+				for (int dy=0; dy<DELTA_BLOCK_SIZE; ++dy){
+					int y = (by << DELTA_BLOCK_SHIFT) + dy;
+					if (y >= this->mapVoxelMax_(1)){
+						break;
+					}
+					// max pooling over the band: occupied > free > unknown
+					int8_t& cell = this->map2DMsg_.data[x + y * width];
+					if ((occupiedWord >> (dy * DELTA_BLOCK_SIZE)) & 0xFF){
+						cell = 100;
+					}
+					else if ((exploredWord >> (dy * DELTA_BLOCK_SIZE)) & 0xFF){
+						cell = 0;
+					}
+					else{
+						cell = -1;
 					}
 				}
 			}
 		}
-
-		cloud.width = cloud.points.size();
-		cloud.height = 1;
-		cloud.is_dense = true;
-		cloud.header.frame_id = "map";
-
-		sensor_msgs::PointCloud2 cloudMsg;
-		pcl::toROSMsg(cloud, cloudMsg);
-		this->inflatedMapVisPub_.publish(cloudMsg);	
 	}
 
 	void occMap::publish2DOccupancyGrid(){
-		Eigen::Vector3d minRange, maxRange;
-		minRange = this->mapSizeMin_;
-		maxRange = this->mapSizeMax_;
-		minRange(2) = this->groundHeight_;
-		Eigen::Vector3i minRangeIdx, maxRangeIdx;
-		this->posToIndex(minRange, minRangeIdx);
-		this->posToIndex(maxRange, maxRangeIdx);
-		this->boundIndex(minRangeIdx);
-		this->boundIndex(maxRangeIdx);
-
-		nav_msgs::OccupancyGrid mapMsg;
-		for (int i=0; i<maxRangeIdx(0); ++i){
-			for (int j=0; j<maxRangeIdx(1); ++j){
-				mapMsg.data.push_back(0);
-			}
+		{
+			std::lock_guard<std::mutex> visMaskLock (this->visMaskMutex_);
+			this->updateVisMask();
+			this->update2DOccupancyGrid();
 		}
+		this->map2DMsg_.header.stamp = ros::Time::now();
+		this->map2DPub_.publish(this->map2DMsg_);
+	}
 
-		double z = 0.5;
-		int zIdx = int(z/this->mapRes_);
-		for (int x=minRangeIdx(0); x<=maxRangeIdx(0); ++x){
-			for (int y=minRangeIdx(1); y<=maxRangeIdx(1); ++y){
-				Eigen::Vector3i pointIdx (x, y, zIdx);
-				int map2DIdx = x  +  y * maxRangeIdx(0);
-				if (this->isUnknown(pointIdx)){
-					mapMsg.data[map2DIdx] = -1;
+	void occMap::publishMapDelta(){
+		// the last payload of each block is kept: a delta only encodes the blocks changed since the last message
+		// and a keyframe copies the kept payloads of all known blocks
+		if (this->deltaBlockPayload_.empty()){
+			this->deltaBlockPayload_.resize(this->blockVersion_.size()); // receivers start with an unknown map
+		}
+
+		map_manager::MapDelta deltaMsg;
+		deltaMsg.keyframe = (this->deltaSeq_ % this->deltaKeyframeInterval_ == 0);
+
+		uint8_t blockStates[DELTA_BLOCK_VOXELS];
+		std::vector<uint8_t> blockPayload;
+		std::vector<int> dirtyBlocks;
+		Eigen::Vector3i blockMin, idx;
+		std::shared_lock<std::shared_timed_mutex> mapLock (this->mapMutex_);
+		this->takeDirtyBlocks(DIRTY_MAP_DELTA, dirtyBlocks);
+		std::sort(dirtyBlocks.begin(), dirtyBlocks.end()); // blocks of a message are in ascending order
+		for (int block : dirtyBlocks){
+			this->blockToIndex(block, blockMin);
+			int i = 0;
+			for (idx(0)=blockMin(0); idx(0)<blockMin(0)+DELTA_BLOCK_SIZE; ++idx(0)){
+				for (idx(1)=blockMin(1); idx(1)<blockMin(1)+DELTA_BLOCK_SIZE; ++idx(1)){
+					for (idx(2)=blockMin(2); idx(2)<blockMin(2)+DELTA_BLOCK_SIZE; ++idx(2), ++i){
+						blockStates[i] = this->getVoxelState(idx);
+					}
 				}
-				else if (this->isOccupied(pointIdx)){
-					mapMsg.data[map2DIdx] = 100;
+			}
+			blockPayload.clear();
+			encodeDeltaBlock(blockStates, blockPayload);
+			if (blockPayload.size() == 1 and blockPayload[0] == DELTA_VOXEL_UNKNOWN){
+				blockPayload.clear(); // unknown blocks keep no payload
+			}
+
+			// blocks which were touched but did not change are not sent
+			std::vector<uint8_t>& lastPayload = this->deltaBlockPayload_[block];
+			if (blockPayload == lastPayload){
+				continue;
+			}
+			lastPayload.swap(blockPayload);
+			if (not deltaMsg.keyframe){
+				deltaMsg.block_ids.push_back(block);
+				if (lastPayload.empty()){
+					deltaMsg.payload.push_back(DELTA_VOXEL_UNKNOWN);
 				}
 				else{
-					mapMsg.data[map2DIdx] = 0;
+					deltaMsg.payload.insert(deltaMsg.payload.end(), lastPayload.begin(), lastPayload.end());
 				}
 			}
 		}
-		mapMsg.header.frame_id = "map";
-		mapMsg.header.stamp = ros::Time::now();
-		mapMsg.info.resolution = this->mapRes_;
-		mapMsg.info.width = maxRangeIdx(0);
-		mapMsg.info.height = maxRangeIdx(1);
-		mapMsg.info.origin.position.x = minRange(0);
-		mapMsg.info.origin.position.y = minRange(1);
-		this->map2DPub_.publish(mapMsg);		
+
+		mapLock.unlock();
+
+		// keyframes carry every known block
+		if (deltaMsg.keyframe){
+			for (int block=0; block<int(this->deltaBlockPayload_.size()); ++block){
+				const std::vector<uint8_t>& payload = this->deltaBlockPayload_[block];
+				if (not payload.empty()){
+					deltaMsg.block_ids.push_back(block);
+					deltaMsg.payload.insert(deltaMsg.payload.end(), payload.begin(), payload.end());
+				}
+			}
+		}
+
+		if (not deltaMsg.keyframe and deltaMsg.block_ids.empty()){
+			return; // nothing changed, keep the sequence continuous
+		}
+
+		deltaMsg.header.frame_id = "map";
+		deltaMsg.header.stamp = ros::Time::now();
+		deltaMsg.sequence = this->deltaSeq_++;
+		deltaMsg.resolution = this->mapRes_;
+		for (int i=0; i<3; ++i){
+			deltaMsg.origin[i] = this->mapSizeMin_(i);
+			deltaMsg.map_voxel[i] = this->mapVoxelMax_(i);
+		}
+		this->mapDeltaPub_.publish(deltaMsg);
+
+		if (this->verbose_){
+			cout << this->hint_ << ": Map delta " << deltaMsg.sequence << (deltaMsg.keyframe ? " (keyframe)" : "") << ": " << deltaMsg.block_ids.size() << " blocks, " << deltaMsg.payload.size() << " bytes." << endl;
+		}
 	}
 }
@@ -6,9 +6,11 @@
 #ifndef MAPMANAGER_OCCUPANCYMAP
 #define MAPMANAGER_OCCUPANCYMAP
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <Eigen/Eigen>
 #include <Eigen/StdVector>
 #include <queue>
+#include <cstring>
 #include <cv_bridge/cv_bridge.h>
 #include <sensor_msgs/Image.h>
 #include <geometry_msgs/PoseStamped.h>
@@ -23,10 +25,92 @@
 #include <message_filters/sync_policies/approximate_time.h>
 #include <map_manager/raycast.h>
 #include <map_manager/CheckPosCollision.h>
+#include <map_manager/SaveMapSnapshot.h>
+#include <map_manager/SaveMap.h>
+#include <map_manager/SaveMapStatus.h>
+#include <map_manager/mapSnapshot.h>
+#include <map_manager/MapDelta.h>
+#include <map_manager/mapDelta.h>
+#include <map_manager/tripleBuffer.h>
+#include <map_manager/mapGeometry.h>
+#include <map_manager/sensorModel.h>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 
 using std::cout; using std::endl;
 namespace mapManager{
+	// map pyramid: 2x, 4x, 8x (block) and 16x levels, each cell flags what its voxels contain
+	const int PYRAMID_LEVELS = 4;
+	const uint8_t PYRAMID_OCCUPIED = 1; // inflated occupied or outside the map
+	const uint8_t PYRAMID_UNKNOWN = 2; // unknown or outside the map
+
+	// pipeline stages of the thread model (thread model 1 gives each stage its own callback queue and thread)
+	const int STAGE_INGESTION = 0; // sensor callbacks
+	const int STAGE_INTEGRATION = 1; // occupancy update, inflation, map clearing and map saving
+	const int STAGE_ESDF = 2; // ESDF update and publish
+	const int STAGE_VISUALIZATION = 3; // visualization and map stream
+	const int STAGE_QUERY = 4; // collision check service and dynamic obstacle prediction
+	const int STAGE_NUM = 5;
+
+	// consumers of the changed blocks, each one drains its own list of blocks changed since its last update
+	const int DIRTY_PYRAMID = 0; // map pyramid
+	const int DIRTY_VIS_MASK = 1; // visualization bitmasks
+	const int DIRTY_MAP_2D = 2; // 2D occupancy grid
+	const int DIRTY_MAP_DELTA = 3; // map stream
+	const int DIRTY_CONSUMER_NUM = 4;
+
+	// rays stepped together by batched raycasting
+	const int RAY_BATCH_SIZE = 8;
+
+	// per-frame measurement count of a voxel (both counters in one 32-bit word)
+	struct voxelCount{
+		uint16_t hitMiss = 0; // number of hit and miss
+		uint16_t hit = 0;
+	};
+
+	// sensor data and camera pose of one frame (handed from the sensor callbacks to the update timer)
+	struct sensorFrame{
+		cv::Mat depthImage;
+		pcl::PointCloud<pcl::PointXYZ> pointcloud;
+		Eigen::Vector3d position;
+		Eigen::Matrix3d orientation;
+	};
+
+	// integer clipping of one integration frame (computed once per frame)
+	struct updateClip{
+		Eigen::Vector3i rangeMin, rangeMax; // local update range inside the map (voxel index, inclusive)
+	};
+
+	// a ray waiting for budgeted integration (rays left over by the budget are carried to the next cycle)
+	struct pendingRay{
+		Eigen::Vector3d point; // end point (already adjusted into the map and raycast length)
+		Eigen::Vector3d origin; // sensor position of its frame
+		int hitNum, missNum;
+		int frameID; // raycastNum_ of its frame
+	};
+
+	// overload statistics of budgeted integration
+	struct integrationStats{
+		uint64_t cycleNum = 0; // update cycles that integrated rays
+		uint64_t overloadNum = 0; // cycles that ran out of budget
+		uint64_t rayNum = 0; // integrated rays
+		uint64_t carriedRayNum = 0; // rays left for a later cycle (summed over cycles)
+		uint64_t droppedRayNum = 0; // rays dropped without integration (waited for more than one frame)
+		int pendingRayNum = 0; // rays waiting now
+		double lastCycleTime = 0.0; // us
+		double maxCycleTime = 0.0; // us
+	};
+
+	// state of the background map save (shared with the save worker, which holds no reference to the map)
+	struct mapSaveStatus{
+		std::mutex mutex;
+		bool inProgress = false;
+		bool success = false; // result of the last finished save
+		std::string message;
+	};
+
 	class occMap{
 	private:
 
@@ -55,12 +139,22 @@ namespace mapManager{
 		ros::Timer mapVisTimer_;
 		ros::Timer inflatedMapVisTimer_;
 		ros::Timer map2DVisTimer_;
+		ros::Timer mapDeltaTimer_;
 		ros::Publisher depthCloudPub_;
 		ros::Publisher mapVisPub_;
 		ros::Publisher inflatedMapVisPub_;
 		ros::Publisher map2DPub_;
 		ros::Publisher mapExploredPub_;
+		ros::Publisher mapDeltaPub_;
 		ros::ServiceServer collisionCheckServer_;
+		ros::ServiceServer snapshotServer_;
+		ros::ServiceServer saveMapServer_;
+		ros::ServiceServer saveMapStatusServer_;
+		ros::NodeHandle stageNh_[STAGE_NUM]; // callbacks of each stage are registered on its node handle
+		ros::CallbackQueue stageQueue_[STAGE_NUM];
+		std::vector<std::thread> stageWorkers_;
+		std::atomic<bool> stageStop_ {false};
+		std::shared_timed_mutex mapMutex_; // map layers, local bound and pose: written exclusively by the integration stage, read shared by the other stages
 
 		int sensorInputMode_;
 		int localizationMode_;
@@ -79,12 +173,21 @@ namespace mapManager{
 		double depthScale_; // value / depthScale
 		double depthMinValue_, depthMaxValue_;
 		int depthFilterMargin_, skipPixel_; // depth filter margin
+		bool depthAdaptiveSampling_; // sample the depth pyramid by range instead of skipping pixels
+		int depthRayBudget_; // max rays per frame of adaptive sampling
 		int imgCols_, imgRows_;
 		Eigen::Matrix4d body2Cam_; // from body frame to camera frame
 
 		// RAYCASTING
 		double raycastMaxLength_;
+		int integrationMode_; // 0: raycasting 1: projective (depth image only)
+		int integrationBudget_; // us of raycasting per update cycle (0: unlimited)
+		int rayPriority_; // order of budgeted raycasting. 0: near first 1: unknown end voxel first
+		bool raycastBatch_; // step rays in batches of RAY_BATCH_SIZE
 		double pHitLog_, pMissLog_, pMinLog_, pMaxLog_, pOccLog_; 
+		bool sensorModel_; // range and angle dependent log odds (depth camera or lidar model by the sensor input mode)
+		Eigen::Vector3d sensorNoise_; // noise sigma = a + b * range + c * range^2 (meter)
+		sensorModelTable sensorModelTable_;
 
 		// MAP
 		double UNKNOWN_FLAG_ = 0.01;
@@ -92,17 +195,28 @@ namespace mapManager{
 		double groundHeight_; // ground height in z axis
 		Eigen::Vector3d mapSize_, mapSizeMin_, mapSizeMax_; // reserved min/max map size
 		Eigen::Vector3i mapVoxelMin_, mapVoxelMax_; // reserved min/max map size in voxel
+		mapGeometry<mapAddressing> geometry_; // index math and voxel address of the map arrays (compile time policy)
 		Eigen::Vector3d localUpdateRange_; // self defined local update range
 		double localBoundInflate_; // inflate local map for some distance
 		bool cleanLocalMap_; 
 		std::string prebuiltMapDir_;
+		std::string snapshotFile_; // default file for map snapshot service
 
 		// VISUALZATION
 		double maxVisHeight_;
+		Eigen::Vector2d grid2DHeightBand_; // height band above ground collapsed into the 2D occupancy grid
 		Eigen::Vector3d localMapSize_;
 		Eigen::Vector3i localMapVoxel_; // voxel representation of local map size
 		bool visGlobalMap_;
 		bool verbose_;
+
+		// MAP STREAM
+		bool publishMapDelta_;
+		int deltaKeyframeInterval_; // number of delta messages between keyframes
+
+		// THREAD MODEL
+		int threadModel_; // 0: all callbacks on the global queue (ros::spin) 1: one queue and thread per pipeline stage
+		std::vector<int> cpuAffinity_; // cpu core of each stage thread (-1: not pinned)
 		// -----------------------------------------------------------------
 
 
@@ -110,6 +224,7 @@ namespace mapManager{
 		// data
 		// -----------------------------------------------------------------
 		// SENSOR DATA
+		tripleBuffer<sensorFrame> frameBuffer_; // written by the sensor callbacks, read by the update timer
 		cv::Mat depthImage_;
 		pcl::PointCloud<pcl::PointXYZ> pointcloud_;
 		Eigen::Vector3d position_; // current position
@@ -119,28 +234,77 @@ namespace mapManager{
 
 		// MAP DATA
 		int projPointsNum_ = 0;
+		std::vector<std::vector<float>> depthMinPyramid_, depthMaxPyramid_; // depth pyramids (2x2 min/max per level)
+		std::vector<Eigen::Vector2i> depthPyramidDim_;
 		std::vector<Eigen::Vector3d> projPoints_; // projected points from depth image
-		std::vector<int> countHitMiss_;
-		std::vector<int> countHit_;
-		std::queue<Eigen::Vector3i> updateVoxelCache_;
+		bool projPointsPrefiltered_ = false; // points are adjusted and merged by endpoint voxel (point cloud input)
+		std::vector<int> projPointsHit_, projPointsMiss_; // number of measured/adjusted points of each merged endpoint
+		std::vector<int> endpointSlot_; // slot of each voxel in the merged endpoints (valid if endpointAddress_ points back)
+		std::vector<int> endpointAddress_;
+		std::vector<voxelCount> voxelCount_;
+		std::vector<int> updateVoxelCache_; // addresses of voxels touched in this frame
+		updateClip updateClip_;
 		std::vector<double> occupancy_; // occupancy log data
-		std::vector<bool> occupancyInflated_; // inflated occupancy data
+		std::vector<uint8_t> occupancyInflated_; // inflated occupancy data (one byte per voxel, copied in bulk by snapshots)
+		std::vector<uint8_t> inflateScratch_; // inflation of the local bound (x-major), built before it is written to the map
 		int raycastNum_ = 0; 
 		std::vector<int> flagTraverse_, flagRayend_;
+		std::vector<pendingRay> pendingRays_, pendingRaysNext_; // budgeted raycasting queue in priority order
+		size_t pendingRayPos_ = 0; // next ray to integrate
+		std::vector<pendingRay> frameRays_; // new rays before sorting
+		std::vector<int> rayKey_, rayBucket_; // counting sort of new rays by priority
+		integrationStats integrationStats_;
+		std::mutex integrationStatsMutex_;
 		std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> freeRegions_;
 		std::deque<std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>> histFreeRegions_;
 		Eigen::Vector3d currMapRangeMin_ = Eigen::Vector3d (0, 0, 0); 
 		Eigen::Vector3d currMapRangeMax_ = Eigen::Vector3d (0, 0, 0);
 		bool useFreeRegions_ = false;
+		std::vector<uint32_t> freeRegionStamp_; // voxels of historical free regions are stamped with freeRegionVersion_
+		uint32_t freeRegionVersion_ = 0;
+
+		// SNAPSHOT
+		std::string lastSnapshotFile_; // file that holds the last saved/loaded state
+		bool snapshotDirty_ = false;
+		Eigen::Vector3i snapshotDirtyMin_, snapshotDirtyMax_; // changed region since last snapshot
+		std::shared_ptr<mapSaveStatus> mapSaveStatus_ = std::make_shared<mapSaveStatus>();
+		std::thread mapSaveWorker_; // joined before the next save and on destruction
+
+		// CHANGE TRACKING (8x8x8 blocks)
+		Eigen::Vector3i blockNum_; // number of blocks in each axis
+		std::vector<uint32_t> blockVersion_; // map version of the last change in each block
+		std::atomic<uint32_t> mapVersion_ {1};
+		std::vector<int> dirtyBlocks_[DIRTY_CONSUMER_NUM]; // blocks changed since the last update of each consumer (queued under the exclusive map lock)
+		std::vector<uint8_t> blockQueued_[DIRTY_CONSUMER_NUM]; // block is in the list of the consumer
+		std::vector<uint32_t> blockClearVersion_; // block version when voxels of the block were last reset to unknown (0: never)
+		std::vector<uint64_t> clearedMask_; // voxels reset to unknown at that version (same layout as occupiedMask_)
+
+		// MAP STREAM
+		uint32_t deltaSeq_ = 0;
+		std::vector<std::vector<uint8_t>> deltaBlockPayload_; // last encoded payload of each block (empty: unknown block)
+
+		// VISUALIZATION INDEX (one 64 bit word of (y, z) bits per x slice of a block)
+		std::vector<uint64_t> occupiedMask_;
+		std::vector<uint64_t> inflatedMask_;
+		std::vector<uint64_t> exploredMask_;
+		std::mutex visMaskMutex_;
+		sensor_msgs::PointCloud2 mapCloudMsg_, inflatedMapCloudMsg_, exploredMapCloudMsg_; // buffers reused between publishes
+
+		// MAP PYRAMID (max pooled flags, a cell is fully free if no flag is set)
+		std::vector<uint8_t> mapPyramid_[PYRAMID_LEVELS];
+		Eigen::Vector3i pyramidDim_[PYRAMID_LEVELS];
+
+		// 2D OCCUPANCY GRID
+		nav_msgs::OccupancyGrid map2DMsg_;
 		
 
 		// STATUS
-		bool occNeedUpdate_ = false;
-		bool mapNeedInflate_ = false;
-		bool esdfNeedUpdate_ = false; // only used in ESDFMap
+		std::atomic<bool> mapNeedInflate_ {false};
+		std::atomic<bool> esdfNeedUpdate_ {false}; // only used in ESDFMap
 
 		// Raycaster
-		RayCaster raycaster_;
+		VoxelRayBatch<RAY_BATCH_SIZE> rayBatch_; // rays waiting for batched stepping
+		int rayBatchFrameID_[RAY_BATCH_SIZE]; // frame of the ray in each lane
 
 		// ------------------------------------------------------------------
 
@@ -149,15 +313,31 @@ namespace mapManager{
 
 		occMap(); // empty constructor
 		occMap(const ros::NodeHandle& nh);
-		virtual ~occMap() = default;
+		virtual ~occMap();
 		void initMap(const ros::NodeHandle& nh);
 		void initParam();
 		void initPrebuiltMap();
 		void registerCallback();
 		void registerPub();
 
+		// thread model
+		void startStageWorkers();
+		void stopStageWorkers();
+		void stageWorker(int stage);
+
 		// service
 		bool checkCollision(map_manager::CheckPosCollision::Request& req, map_manager::CheckPosCollision::Response& res);		
+		bool saveSnapshotSrv(map_manager::SaveMapSnapshot::Request& req, map_manager::SaveMapSnapshot::Response& res);
+		bool saveMapSrv(map_manager::SaveMap::Request& req, map_manager::SaveMap::Response& res);
+		bool saveMapStatusSrv(map_manager::SaveMapStatus::Request& req, map_manager::SaveMapStatus::Response& res);
+
+		// snapshot
+		bool saveMapSnapshot(const std::string& path);
+		bool loadMapSnapshot(const std::string& path);
+		bool loadCompactMap(const std::string& path);
+		virtual uint32_t getSnapshotLayers();
+		virtual void writeSnapshotLayers(mapSnapshot& snapshot, int beginAddress, int endAddress);
+		virtual void readSnapshotLayers(mapSnapshot& snapshot);
 
 		// callback
 		void depthPoseCB(const sensor_msgs::ImageConstPtr& img, const geometry_msgs::PoseStampedConstPtr& pose);
@@ -169,12 +349,30 @@ namespace mapManager{
 
 		// core function
 		void projectDepthImage();
+		void buildDepthPyramid();
+		void projectDepthImageAdaptive();
 		void getPointcloud();
 		void raycastUpdate();
+		void budgetedRaycastUpdate();
+		void integratePendingRays();
+		bool prepareRayPoint(int i, Eigen::Vector3d& point, int& hitNum, int& missNum);
+		void integrateRay(const Eigen::Vector3d& point, int hitNum, int missNum, const Eigen::Vector3d& origin, int frameID);
+		void stepRayBatch(bool drain);
+		bool traverseVoxel(const Eigen::Vector3i& idx, int frameID);
+		void projectiveUpdate();
+		void computeUpdateClip();
+		void storeLocalBound(const Eigen::Vector3d& boundMin, const Eigen::Vector3d& boundMax);
+		void flushUpdateCache();
+		template <typename SensorModel> void applyUpdateCache();
 		void cleanLocalMap();
+		void clearRegion(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
+		virtual void clearRegionLayers(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
 		void inflateLocalMap();
+		void updateMapPyramid();
+		void inflateRegion(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
 
 		// user functions
+		std::shared_lock<std::shared_timed_mutex> lockMapRead(); // map queries under the lock see no integration or inflation in between
 		bool isOccupied(const Eigen::Vector3d& pos);
 		bool isOccupied(const Eigen::Vector3i& idx); // does not count for unknown
 		bool isInflatedOccupied(const Eigen::Vector3d& pos);
@@ -195,7 +393,9 @@ namespace mapManager{
 		double getRes();
 		void getMapRange(Eigen::Vector3d& mapSizeMin, Eigen::Vector3d& mapSizeMax);
 		void getCurrMapRange(Eigen::Vector3d& currRangeMin, Eigen::Vector3d& currRangeMax);
+		integrationStats getIntegrationStats();
 		bool castRay(const Eigen::Vector3d& start, const Eigen::Vector3d& direction, Eigen::Vector3d& end, double maxLength=5.0, bool ignoreUnknown=true);
+		int castRays(const Eigen::Vector3d& start, const std::vector<Eigen::Vector3d>& directions, std::vector<Eigen::Vector3d>& ends, std::vector<bool>& hits, double maxLength=5.0, bool ignoreUnknown=true);
 
 
 		// Visualziation
@@ -204,12 +404,19 @@ namespace mapManager{
 		void mapVisCB(const ros::TimerEvent& );
 		void inflatedMapVisCB(const ros::TimerEvent& );
 		void map2DVisCB(const ros::TimerEvent& );
+		void mapDeltaCB(const ros::TimerEvent& );
 		void startVisualization();
 		void getMapVisData(pcl::PointCloud<pcl::PointXYZ>& mapCloud, pcl::PointCloud<pcl::PointXYZ>& inflatedMapCloud, pcl::PointCloud<pcl::PointXYZ>& exploredMapCloud, pcl::PointCloud<pcl::PointXYZ>& depthCloud);
 		void publishProjPoints();
 		void publishMap();
 		void publishInflatedMap();
 		void publish2DOccupancyGrid();
+		void publishMapDelta();
+		void getVisRange(Eigen::Vector3i& minRangeIdx, Eigen::Vector3i& maxRangeIdx);
+		void updateVisMask();
+		void update2DOccupancyGrid();
+		void maskToCloud(const std::vector<uint64_t>& mask, const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx, double maxHeight, sensor_msgs::PointCloud2& cloudMsg);
+		template <typename F> void forEachMaskedVoxel(const std::vector<uint64_t>& mask, const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx, F f);
 
 		// helper functions
 		double logit(double x);
@@ -221,6 +428,8 @@ namespace mapManager{
 		int posToAddress(double x, double y, double z);
 		int indexToAddress(const Eigen::Vector3i& idx);
 		int indexToAddress(int x, int y, int z);
+		void addressToIndex(int address, Eigen::Vector3i& idx);
+		template <typename F> void forEachZRun(int x, int y, int zmin, int zmax, F f);
 		void boundIndex(Eigen::Vector3i& idx);
 		bool isInLocalUpdateRange(const Eigen::Vector3d& pos);
 		bool isInLocalUpdateRange(const Eigen::Vector3i& idx);
@@ -228,14 +437,33 @@ namespace mapManager{
 		bool isInFreeRegions(const Eigen::Vector3d& pos, const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions);
 		bool isInFreeRegions(const Eigen::Vector3d& pos);
 		bool isInHistFreeRegions(const Eigen::Vector3d& pos);
+		bool isInHistFreeRegions(const Eigen::Vector3i& idx);
+		bool isInUpdateClip(const Eigen::Vector3i& idx);
 		Eigen::Vector3d adjustPointInMap(const Eigen::Vector3d& point);
 		Eigen::Vector3d adjustPointRayLength(const Eigen::Vector3d& point);
 		int updateOccupancyInfo(const Eigen::Vector3d& point, bool isOccupied);
+		void updateOccupancyInfo(int address, bool isOccupied);
+		int updateOccupancyInfo(const Eigen::Vector3d& point, int hitNum, int missNum);
 		void getCameraPose(const geometry_msgs::PoseStampedConstPtr& pose, Eigen::Matrix4d& camPoseMatrix);
 		void getCameraPose(const nav_msgs::OdometryConstPtr& odom, Eigen::Matrix4d& camPoseMatrix);
+		void markSnapshotDirty(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
+		int indexToBlock(const Eigen::Vector3i& idx);
+		void blockToIndex(int block, Eigen::Vector3i& blockMinIdx);
+		void markBlockDirty(const Eigen::Vector3i& idx);
+		void markRegionDirty(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx);
+		void queueDirtyBlock(int block);
+		void takeDirtyBlocks(int consumer, std::vector<int>& blocks);
+		uint32_t advanceMapVersion();
+		uint8_t getVoxelState(const Eigen::Vector3i& idx);
+		int getFreeCellLevel(const Eigen::Vector3i& idx, uint8_t blockingFlags);
+		int skipFreeSpace(const Eigen::Vector3i& idx, const Eigen::Vector3d& origin, const Eigen::Vector3d& increment, int step, uint8_t blockingFlags);
 	};
 	// inline function
 	// user function
+	inline std::shared_lock<std::shared_timed_mutex> occMap::lockMapRead(){
+		return std::shared_lock<std::shared_timed_mutex> (this->mapMutex_);
+	}
+
 	inline bool occMap::isOccupied(const Eigen::Vector3d& pos){
 		Eigen::Vector3i idx;
 		this->posToIndex(pos, idx);
@@ -261,7 +489,7 @@ namespace mapManager{
 			return true;
 		}
 		int address = this->indexToAddress(idx);
-		return this->occupancyInflated_[address] == true;
+		return this->occupancyInflated_[address] != 0;
 	}
 
 	inline bool occMap::isInflatedOccupiedLine(const Eigen::Vector3d& pos1, const Eigen::Vector3d& pos2){		
@@ -274,14 +502,24 @@ namespace mapManager{
 		Eigen::Vector3d diffUnit = diff/dist;
 		int stepNum = int(dist/this->mapRes_);
 		Eigen::Vector3d pCheck;
+		Eigen::Vector3i idxCheck;
 		Eigen::Vector3d unitIncrement = diffUnit * this->mapRes_;
 		bool isOccupied = false;
-		for (int i=1; i<stepNum; ++i){
+		for (int i=1; i<stepNum;){
 			pCheck = pos1 + i * unitIncrement;
+			this->posToIndex(pCheck, idxCheck);
+			if (this->isInMap(idxCheck)){
+				int nextStep = this->skipFreeSpace(idxCheck, pos1, unitIncrement, i, PYRAMID_OCCUPIED);
+				if (nextStep > i){
+					i = nextStep; // no sample inside a free pyramid cell can be occupied
+					continue;
+				}
+			}
 			isOccupied = this->isInflatedOccupied(pCheck);
 			if (isOccupied){
 				return true;
 			}
+			++i;
 		}
 		return false;
 	}
@@ -362,50 +600,33 @@ namespace mapManager{
 		int xInflateSize = ceil(this->robotSize_(0)/(2*this->mapRes_));
 		int yInflateSize = ceil(this->robotSize_(1)/(2*this->mapRes_));
 		int zInflateSize = ceil(this->robotSize_(2)/(2*this->mapRes_));
+		this->markRegionDirty(idx - Eigen::Vector3i (xInflateSize, yInflateSize, zInflateSize), idx + Eigen::Vector3i (xInflateSize, yInflateSize, zInflateSize));
 		Eigen::Vector3i inflateIndex;
-		int inflateAddress;
-		const int maxIndex = this->mapVoxelMax_(0) * this->mapVoxelMax_(1) * this->mapVoxelMax_(2);
 		for (int ix=-xInflateSize; ix<=xInflateSize; ++ix){
 			for (int iy=-yInflateSize; iy<=yInflateSize; ++iy){
 				for (int iz=-zInflateSize; iz<=zInflateSize; ++iz){
 					inflateIndex(0) = idx(0) + ix;
 					inflateIndex(1) = idx(1) + iy;
 					inflateIndex(2) = idx(2) + iz;
-					inflateAddress = this->indexToAddress(inflateIndex);
-					if ((inflateAddress < 0) or (inflateAddress > maxIndex)){
+					if (not this->isInMap(inflateIndex)){
 						continue; // those points are not in the reserved map
 					} 
-					this->occupancyInflated_[inflateAddress] = false;
+					this->occupancyInflated_[this->indexToAddress(inflateIndex)] = false;
 				}
 			}
 		}
 	}
 
 	inline void occMap::freeRegion(const Eigen::Vector3d& pos1, const Eigen::Vector3d& pos2){
-		Eigen::Vector3i idx1, idx2;
-		this->posToIndex(pos1, idx1);
-		this->posToIndex(pos2, idx2);
-		this->boundIndex(idx1);
-		this->boundIndex(idx2);
-		for (int xID=idx1(0); xID<=idx2(0); ++xID){
-			for (int yID=idx1(1); yID<=idx2(1); ++yID){
-				for (int zID=idx1(2); zID<=idx2(2); ++zID){
-					this->setFree(Eigen::Vector3i (xID, yID, zID));
-				}	
-			}
-		}
-	}
-
-	inline void occMap::freeRegions(const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions){
-		for (std::pair<Eigen::Vector3d, Eigen::Vector3d> freeRegion : freeRegions){
-			this->freeRegion(freeRegion.first, freeRegion.second);
-		}
+		this->freeRegions(std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> {std::make_pair(pos1, pos2)});
 	}
 
 	inline void occMap::freeHistRegions(){
-		for (std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> freeRegions : this->histFreeRegions_){
-			this->freeRegions(freeRegions);
+		std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> allRegions;
+		for (const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions : this->histFreeRegions_){
+			allRegions.insert(allRegions.end(), freeRegions.begin(), freeRegions.end());
 		}
+		this->freeRegions(allRegions);
 	}
 
 	inline void occMap::updateFreeRegions(const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions){
@@ -425,6 +646,28 @@ namespace mapManager{
 		else{
 			this->useFreeRegions_ = false;
 		}
+
+		// rasterize all historical free regions (same voxels as freeRegion) for constant time lookup
+		if (this->freeRegionStamp_.empty()){
+			this->freeRegionStamp_.resize(this->occupancy_.size(), 0);
+		}
+		this->freeRegionVersion_ += 1;
+		Eigen::Vector3i idx1, idx2;
+		for (const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& histFreeRegions : this->histFreeRegions_){
+			for (const std::pair<Eigen::Vector3d, Eigen::Vector3d>& freeRegion : histFreeRegions){
+				this->posToIndex(freeRegion.first, idx1);
+				this->posToIndex(freeRegion.second, idx2);
+				this->boundIndex(idx1);
+				this->boundIndex(idx2);
+				for (int xID=idx1(0); xID<=idx2(0); ++xID){
+					for (int yID=idx1(1); yID<=idx2(1); ++yID){
+						this->forEachZRun(xID, yID, idx1(2), idx2(2), [&](int address, int length){
+							std::fill(this->freeRegionStamp_.begin() + address, this->freeRegionStamp_.begin() + address + length, this->freeRegionVersion_);
+						});
+					}
+				}
+			}
+		}
 	}
 
 
@@ -442,29 +685,109 @@ namespace mapManager{
 		currRangeMax = this->currMapRangeMax_;
 	}
 
+	inline integrationStats occMap::getIntegrationStats(){
+		std::lock_guard<std::mutex> lock (this->integrationStatsMutex_);
+		return this->integrationStats_;
+	}
+
 	inline bool occMap::castRay(const Eigen::Vector3d& start, const Eigen::Vector3d& direction, Eigen::Vector3d& end, double maxLength, bool ignoreUnknown){
 		// return true if raycasting successfully find the endpoint, otherwise return false
+		// voxel traversal (Amanatides & Woo) which jumps over free pyramid cells. The start voxel is not checked,
+		// leaving the map counts as a hit and end is the entry point of the blocking voxel.
 
 		Eigen::Vector3d directionNormalized = direction/direction.norm(); // normalize the direction vector
-		int num = ceil(maxLength/this->mapRes_);
-		for (int i=1; i<num; ++i){
-			Eigen::Vector3d point = this->mapRes_ * directionNormalized * i + start;
-			if (ignoreUnknown){
-				if (this->isInflatedOccupied(point)){
-					end = point;
-					return true;
+		uint8_t blockingFlags = ignoreUnknown ? PYRAMID_OCCUPIED : (PYRAMID_OCCUPIED | PYRAMID_UNKNOWN);
+		Eigen::Vector3i idx, step;
+		Eigen::Vector3d tMax, tDelta;
+		this->posToIndex(start, idx);
+		for (int i=0; i<3; ++i){
+			step(i) = (directionNormalized(i) > 0) ? 1 : ((directionNormalized(i) < 0) ? -1 : 0);
+			tDelta(i) = (step(i) != 0) ? this->mapRes_/std::abs(directionNormalized(i)) : std::numeric_limits<double>::max();
+		}
+		// distance along the ray to the next voxel boundary of each axis
+		auto updateTMax = [&](int i){
+			if (step(i) == 0){
+				tMax(i) = std::numeric_limits<double>::max();
+				return;
+			}
+			double boundary = this->mapSizeMin_(i) + (idx(i) + (step(i) > 0 ? 1 : 0)) * this->mapRes_;
+			tMax(i) = (boundary - start(i))/directionNormalized(i);
+		};
+		for (int i=0; i<3; ++i){
+			updateTMax(i);
+		}
+
+		double t = 0.0;
+		while (true){
+			// step into the next voxel
+			int axis = (tMax(0) < tMax(1)) ? ((tMax(0) < tMax(2)) ? 0 : 2) : ((tMax(1) < tMax(2)) ? 1 : 2);
+			t = std::max(t, tMax(axis));
+			if (t > maxLength){
+				break;
+			}
+			idx(axis) += step(axis);
+			tMax(axis) += tDelta(axis);
+
+			if (not this->isInMap(idx)){
+				end = start + t * directionNormalized;
+				return true;
+			}
+
+			int level = this->getFreeCellLevel(idx, blockingFlags);
+			if (level > 0){
+				// jump to the last voxel of the free cell along the ray, the loop then steps out of it
+				double tExit = std::numeric_limits<double>::max();
+				int exitAxis = 0;
+				for (int i=0; i<3; ++i){
+					if (step(i) == 0){
+						continue;
+					}
+					int boundary = (step(i) > 0) ? (((idx(i) >> level) + 1) << level) : ((idx(i) >> level) << level);
+					double tBoundary = (this->mapSizeMin_(i) + boundary * this->mapRes_ - start(i))/directionNormalized(i);
+					if (tBoundary < tExit){
+						tExit = tBoundary;
+						exitAxis = i;
+					}
+				}
+				if (tExit > maxLength){
+					break;
 				}
+				Eigen::Vector3d exitPoint = start + tExit * directionNormalized;
+				Eigen::Vector3i cellMin (idx(0) >> level << level, idx(1) >> level << level, idx(2) >> level << level);
+				for (int i=0; i<3; ++i){
+					if (i == exitAxis){
+						idx(i) = (step(i) > 0) ? (cellMin(i) + (1 << level) - 1) : cellMin(i);
+					}
+					else{
+						idx(i) = floor((exitPoint(i) - this->mapSizeMin_(i))/this->mapRes_);
+						idx(i) = std::min(std::max(idx(i), cellMin(i)), cellMin(i) + (1 << level) - 1);
+					}
+					updateTMax(i);
+				}
+				t = std::max(t, tExit);
+				continue;
 			}
-			else{
-				if (this->isInflatedOccupied(point) or this->isUnknown(point)){
-					end = point;
-					return true;
-				}	
+
+			if (this->isInflatedOccupied(idx) or ((not ignoreUnknown) and this->isUnknown(idx))){
+				end = start + t * directionNormalized;
+				return true;
 			}
 		}
 		end = start;
 		return false;
 	}
+
+	inline int occMap::castRays(const Eigen::Vector3d& start, const std::vector<Eigen::Vector3d>& directions, std::vector<Eigen::Vector3d>& ends, std::vector<bool>& hits, double maxLength, bool ignoreUnknown){
+		// cast many rays from one origin, return the number of rays which hit
+		ends.resize(directions.size());
+		hits.resize(directions.size());
+		int hitNum = 0;
+		for (size_t i=0; i<directions.size(); ++i){
+			hits[i] = this->castRay(start, directions[i], ends[i], maxLength, ignoreUnknown);
+			hitNum += hits[i];
+		}
+		return hitNum;
+	}
 	// end of user functinos
 
 	// helper functions
@@ -484,26 +807,15 @@ namespace mapManager{
 	}
 
 	inline bool occMap::isInMap(const Eigen::Vector3i& idx){
-		if ((idx(0) >= this->mapVoxelMin_(0)) and (idx(0) < this->mapVoxelMax_(0)) and
-		    (idx(1) >= this->mapVoxelMin_(1)) and (idx(1) < this->mapVoxelMax_(1)) and 
-		    (idx(2) >= this->mapVoxelMin_(2)) and (idx(2) < this->mapVoxelMax_(2))){
-			return true;
-		}
-		else{
-			return false;
-		}
+		return this->geometry_.isInMap(idx); // the voxel index range starts at 0 (mapVoxelMin_)
 	}
 
 	inline void occMap::posToIndex(const Eigen::Vector3d& pos, Eigen::Vector3i& idx){
-		idx(0) = floor( (pos(0) - this->mapSizeMin_(0) ) / this->mapRes_ );
-		idx(1) = floor( (pos(1) - this->mapSizeMin_(1) ) / this->mapRes_ );
-		idx(2) = floor( (pos(2) - this->mapSizeMin_(2) ) / this->mapRes_ );
+		this->geometry_.posToIndex(pos, idx);
 	}
 
 	inline void occMap::indexToPos(const Eigen::Vector3i& idx, Eigen::Vector3d& pos){
-		pos(0) = (idx(0) + 0.5) * this->mapRes_ + this->mapSizeMin_(0); 
-		pos(1) = (idx(1) + 0.5) * this->mapRes_ + this->mapSizeMin_(1);
-		pos(2) = (idx(2) + 0.5) * this->mapRes_ + this->mapSizeMin_(2);
+		this->geometry_.indexToPos(idx, pos);
 	}
 
 	inline int occMap::posToAddress(const Eigen::Vector3d& pos){
@@ -518,7 +830,7 @@ namespace mapManager{
 	}
 
 	inline int occMap::indexToAddress(const Eigen::Vector3i& idx){
-		return idx(0) * this->mapVoxelMax_(1) * this->mapVoxelMax_(2) + idx(1) * this->mapVoxelMax_(2) + idx(2);
+		return this->geometry_.address(idx(0), idx(1), idx(2));
 	}
 
 	inline int occMap::indexToAddress(int x, int y, int z){
@@ -526,6 +838,20 @@ namespace mapManager{
 		return this->indexToAddress(idx);
 	}
 
+	inline void occMap::addressToIndex(int address, Eigen::Vector3i& idx){
+		this->geometry_.index(address, idx);
+	}
+
+	template <typename F>
+	inline void occMap::forEachZRun(int x, int y, int zmin, int zmax, F f){
+		// f(address, length) for each part of the z column that is contiguous in memory (the whole column for linear addressing)
+		for (int z=zmin; z<=zmax; ){
+			int zEnd = std::min(zmax, z | (mapAddressing::Z_RUN - 1));
+			f(this->indexToAddress(x, y, z), zEnd - z + 1);
+			z = zEnd + 1;
+		}
+	}
+
 	inline void occMap::boundIndex(Eigen::Vector3i& idx){
 		Eigen::Vector3i temp;
 		temp(0) = std::max(std::min(idx(0), this->mapVoxelMax_(0)-1), this->mapVoxelMin_(0));
@@ -572,7 +898,7 @@ namespace mapManager{
 
 
 	inline bool occMap::isInFreeRegions(const Eigen::Vector3d& pos, const std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>>& freeRegions){
-		for (std::pair<Eigen::Vector3d, Eigen::Vector3d> freeRegion : freeRegions){
+		for (const std::pair<Eigen::Vector3d, Eigen::Vector3d>& freeRegion : freeRegions){
 			if (this->isInFreeRegion(pos, freeRegion)){
 				return true;
 			}
@@ -585,15 +911,26 @@ namespace mapManager{
 	}
 
 	inline bool occMap::isInHistFreeRegions(const Eigen::Vector3d& pos){
-		for (std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> freeRegions : this->histFreeRegions_){
-			if (this->isInFreeRegions(pos, freeRegions)){
-				return true;
-			}
+		Eigen::Vector3i idx;
+		this->posToIndex(pos, idx);
+		return this->isInHistFreeRegions(idx);
+	}
+
+	inline bool occMap::isInHistFreeRegions(const Eigen::Vector3i& idx){
+		// free regions are rasterized in updateFreeRegions (voxels outside the map are never free regions)
+		if (not this->useFreeRegions_ or not this->isInMap(idx)){
+			return false;
 		}
-		return false;
+		return this->freeRegionStamp_[this->indexToAddress(idx)] == this->freeRegionVersion_;
 	}
 
 
+	inline bool occMap::isInUpdateClip(const Eigen::Vector3i& idx){
+		return (idx(0) >= this->updateClip_.rangeMin(0)) and (idx(0) <= this->updateClip_.rangeMax(0)) and
+			   (idx(1) >= this->updateClip_.rangeMin(1)) and (idx(1) <= this->updateClip_.rangeMax(1)) and
+			   (idx(2) >= this->updateClip_.rangeMin(2)) and (idx(2) <= this->updateClip_.rangeMax(2));
+	}
+
 	inline Eigen::Vector3d occMap::adjustPointInMap(const Eigen::Vector3d& point){
 		Eigen::Vector3d pos = this->position_;
 		Eigen::Vector3d diff = point - pos;
@@ -624,18 +961,216 @@ namespace mapManager{
 		return (point - this->position_) * (this->raycastMaxLength_/length) + this->position_;
 	}
 
+	inline int occMap::updateOccupancyInfo(const Eigen::Vector3d& point, int hitNum, int missNum){
+		// weighted update of several points in the same voxel
+		Eigen::Vector3i idx;
+		this->posToIndex(point, idx);
+		int voxelID = this->indexToAddress(idx);
+		voxelCount& count = this->voxelCount_[voxelID];
+		if (count.hitMiss == 0){
+			this->updateVoxelCache_.push_back(voxelID);
+		}
+		int hitMiss = count.hitMiss + hitNum + missNum;
+		int hit = count.hit + hitNum;
+		while (hitMiss > UINT16_MAX){ // keep the hit ratio when the counter is full
+			hitMiss >>= 1;
+			hit >>= 1;
+		}
+		count.hitMiss = hitMiss;
+		count.hit = hit;
+		return voxelID;
+	}
+
 	inline int occMap::updateOccupancyInfo(const Eigen::Vector3d& point, bool isOccupied){
 		Eigen::Vector3i idx;
 		this->posToIndex(point, idx);
 		int voxelID = this->indexToAddress(idx);
-		this->countHitMiss_[voxelID] += 1;
-		if (this->countHitMiss_[voxelID] == 1){
-			this->updateVoxelCache_.push(idx);
+		this->updateOccupancyInfo(voxelID, isOccupied);
+		return voxelID;
+	}
+
+	inline void occMap::updateOccupancyInfo(int voxelID, bool isOccupied){
+		voxelCount& count = this->voxelCount_[voxelID];
+		if (count.hitMiss == 0){
+			this->updateVoxelCache_.push_back(voxelID);
+		}
+		else if (count.hitMiss == UINT16_MAX){ // keep the hit ratio when the counter is full
+			count.hitMiss >>= 1;
+			count.hit >>= 1;
 		}
+		count.hitMiss += 1;
 		if (isOccupied){ // if not adjusted set it to occupied, otherwise it is free
-			this->countHit_[voxelID] += 1;
+			count.hit += 1;
 		}
-		return voxelID;
+	}
+
+	inline bool occMap::traverseVoxel(const Eigen::Vector3i& idx, int frameID){
+		// rays are clipped to the local update range before the walk, idx is always inside it
+		int raycastVoxelID = this->indexToAddress(idx);
+		this->updateOccupancyInfo(raycastVoxelID, false);
+		if (this->flagTraverse_[raycastVoxelID] == frameID){
+			return false;
+		}
+		this->flagTraverse_[raycastVoxelID] = frameID;
+		return true;
+	}
+
+	inline void occMap::markSnapshotDirty(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		Eigen::Vector3i boundedMin = minIdx;
+		Eigen::Vector3i boundedMax = maxIdx;
+		this->boundIndex(boundedMin);
+		this->boundIndex(boundedMax);
+		if (not this->snapshotDirty_){
+			this->snapshotDirtyMin_ = boundedMin;
+			this->snapshotDirtyMax_ = boundedMax;
+			this->snapshotDirty_ = true;
+		}
+		else{
+			this->snapshotDirtyMin_ = this->snapshotDirtyMin_.cwiseMin(boundedMin);
+			this->snapshotDirtyMax_ = this->snapshotDirtyMax_.cwiseMax(boundedMax);
+		}
+	}
+
+	inline int occMap::indexToBlock(const Eigen::Vector3i& idx){
+		return ((idx(0) >> DELTA_BLOCK_SHIFT) * this->blockNum_(1) + (idx(1) >> DELTA_BLOCK_SHIFT)) * this->blockNum_(2) + (idx(2) >> DELTA_BLOCK_SHIFT);
+	}
+
+	inline void occMap::blockToIndex(int block, Eigen::Vector3i& blockMinIdx){
+		blockMinIdx(0) = (block / (this->blockNum_(1) * this->blockNum_(2))) << DELTA_BLOCK_SHIFT;
+		blockMinIdx(1) = ((block / this->blockNum_(2)) % this->blockNum_(1)) << DELTA_BLOCK_SHIFT;
+		blockMinIdx(2) = (block % this->blockNum_(2)) << DELTA_BLOCK_SHIFT;
+	}
+
+	inline void occMap::markBlockDirty(const Eigen::Vector3i& idx){
+		this->queueDirtyBlock(this->indexToBlock(idx));
+	}
+
+	inline void occMap::markRegionDirty(const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx){
+		this->markSnapshotDirty(minIdx, maxIdx);
+		Eigen::Vector3i blockMin = minIdx;
+		Eigen::Vector3i blockMax = maxIdx;
+		this->boundIndex(blockMin);
+		this->boundIndex(blockMax);
+		for (int i=0; i<3; ++i){
+			blockMin(i) >>= DELTA_BLOCK_SHIFT;
+			blockMax(i) >>= DELTA_BLOCK_SHIFT;
+		}
+		for (int bx=blockMin(0); bx<=blockMax(0); ++bx){
+			for (int by=blockMin(1); by<=blockMax(1); ++by){
+				for (int bz=blockMin(2); bz<=blockMax(2); ++bz){
+					this->queueDirtyBlock((bx * this->blockNum_(1) + by) * this->blockNum_(2) + bz);
+				}
+			}
+		}
+	}
+
+	inline void occMap::queueDirtyBlock(int block){
+		// every consumer advances the version when it takes its list, so a block already marked in the current
+		// version is in all lists (most voxel updates of a frame take this path)
+		const uint32_t version = this->mapVersion_;
+		if (this->blockVersion_[block] == version){
+			return;
+		}
+		this->blockVersion_[block] = version;
+		for (int consumer=0; consumer<DIRTY_CONSUMER_NUM; ++consumer){
+			if (not this->blockQueued_[consumer][block]){
+				this->blockQueued_[consumer][block] = 1;
+				this->dirtyBlocks_[consumer].push_back(block);
+			}
+		}
+	}
+
+	inline void occMap::takeDirtyBlocks(int consumer, std::vector<int>& blocks){
+		// called with the map lock held (shared is enough, blocks are only queued under the exclusive lock)
+		blocks.clear();
+		blocks.swap(this->dirtyBlocks_[consumer]);
+		for (int block : blocks){
+			this->blockQueued_[consumer][block] = 0;
+		}
+		this->advanceMapVersion();
+	}
+
+	template <typename F>
+	inline void occMap::forEachMaskedVoxel(const std::vector<uint64_t>& mask, const Eigen::Vector3i& minIdx, const Eigen::Vector3i& maxIdx, F f){
+		// only visit set bits, cost is proportional to the number of blocks in range plus the set voxels
+		Eigen::Vector3i idx;
+		for (int bx=(minIdx(0) >> DELTA_BLOCK_SHIFT); bx<=(maxIdx(0) >> DELTA_BLOCK_SHIFT); ++bx){
+			for (int by=(minIdx(1) >> DELTA_BLOCK_SHIFT); by<=(maxIdx(1) >> DELTA_BLOCK_SHIFT); ++by){
+				for (int bz=(minIdx(2) >> DELTA_BLOCK_SHIFT); bz<=(maxIdx(2) >> DELTA_BLOCK_SHIFT); ++bz){
+					const uint64_t* words = &mask[((bx * this->blockNum_(1) + by) * this->blockNum_(2) + bz) * DELTA_BLOCK_SIZE];
+					for (int dx=0; dx<DELTA_BLOCK_SIZE; ++dx){
+						uint64_t word = words[dx];
+						idx(0) = (bx << DELTA_BLOCK_SHIFT) + dx;
+						if (word == 0 or idx(0) < minIdx(0) or idx(0) > maxIdx(0)){
+							continue;
+						}
+						while (word){
+							int bit = __builtin_ctzll(word);
+							word &= word - 1;
+							idx(1) = (by << DELTA_BLOCK_SHIFT) + (bit >> DELTA_BLOCK_SHIFT);
+							idx(2) = (bz << DELTA_BLOCK_SHIFT) + (bit & (DELTA_BLOCK_SIZE - 1));
+							if (idx(1) < minIdx(1) or idx(1) > maxIdx(1) or idx(2) < minIdx(2) or idx(2) > maxIdx(2)){
+								continue;
+							}
+							f(idx);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	inline int occMap::getFreeCellLevel(const Eigen::Vector3i& idx, uint8_t blockingFlags){
+		// coarsest pyramid level whose cell containing idx has no blocking flag (0 if none)
+		for (int level=PYRAMID_LEVELS; level>=1; --level){
+			const Eigen::Vector3i& dim = this->pyramidDim_[level-1];
+			if (not (this->mapPyramid_[level-1][((idx(0) >> level) * dim(1) + (idx(1) >> level)) * dim(2) + (idx(2) >> level)] & blockingFlags)){
+				return level;
+			}
+		}
+		return 0;
+	}
+
+	inline int occMap::skipFreeSpace(const Eigen::Vector3i& idx, const Eigen::Vector3d& origin, const Eigen::Vector3d& increment, int step, uint8_t blockingFlags){
+		// samples are origin + step * increment. If idx is inside a free pyramid cell,
+		// return the first step which may leave that cell, otherwise return step.
+		int level = this->getFreeCellLevel(idx, blockingFlags);
+		if (level == 0){
+			return step;
+		}
+
+		double exitStep = std::numeric_limits<double>::max();
+		for (int i=0; i<3; ++i){
+			if (increment(i) == 0){
+				continue;
+			}
+			int boundary = (increment(i) > 0) ? (((idx(i) >> level) + 1) << level) : ((idx(i) >> level) << level);
+			exitStep = std::min(exitStep, (this->mapSizeMin_(i) + boundary * this->mapRes_ - origin(i))/increment(i));
+		}
+		// every sample before floor(exitStep) is at least one step inside the cell
+		return std::max(step + 1, int(std::min(exitStep, 1e9)));
+	}
+
+	inline uint32_t occMap::advanceMapVersion(){
+		// changes made after this call carry a newer version
+		return this->mapVersion_++;
+	}
+
+	inline uint8_t occMap::getVoxelState(const Eigen::Vector3i& idx){
+		if (not this->isInMap(idx)){
+			return DELTA_VOXEL_UNKNOWN;
+		}
+		int address = this->indexToAddress(idx);
+		if (this->occupancy_[address] >= this->pOccLog_){
+			return DELTA_VOXEL_OCCUPIED;
+		}
+		else if (this->occupancyInflated_[address]){
+			return DELTA_VOXEL_INFLATED;
+		}
+		else if (this->occupancy_[address] < this->pMinLog_){
+			return DELTA_VOXEL_UNKNOWN;
+		}
+		return DELTA_VOXEL_FREE;
 	}
 
 	inline void occMap::getCameraPose(const geometry_msgs::PoseStampedConstPtr& pose, Eigen::Matrix4d& camPoseMatrix){
@@ -0,0 +1,136 @@
+/*
+	FILE: pcdReader.cpp
+	--------------------------------------
+	function definition of chunked PCD reader
+*/
+#include <map_manager/pcdReader.h>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+namespace mapManager{
+	bool pcdReader::open(const std::string& path){
+		this->file_.close();
+		this->file_.open(path, std::ios::in | std::ios::binary);
+		if (not this->file_.is_open()) return false;
+
+		std::vector<std::string> fields;
+		std::vector<int> sizes, counts;
+		std::vector<char> types;
+		std::string line;
+		while (std::getline(this->file_, line)){
+			std::istringstream ss (line);
+			std::string key;
+			ss >> key;
+			if (key.empty() or key[0] == '#') continue;
+
+			if (key == "FIELDS"){
+				std::string field;
+				while (ss >> field) fields.push_back(field);
+			}
+			else if (key == "SIZE"){
+				int size;
+				while (ss >> size) sizes.push_back(size);
+			}
+			else if (key == "TYPE"){
+				char type;
+				while (ss >> type) types.push_back(type);
+			}
+			else if (key == "COUNT"){
+				int count;
+				while (ss >> count) counts.push_back(count);
+			}
+			else if (key == "POINTS"){
+				ss >> this->pointNum_;
+			}
+			else if (key == "DATA"){
+				std::string data;
+				ss >> data;
+				if (data == "binary"){
+					this->binary_ = true;
+				}
+				else if (data != "ascii"){
+					return false; // compressed data cannot be streamed
+				}
+				break;
+			}
+		}
+		if (counts.empty()) counts.resize(fields.size(), 1);
+		if (fields.empty() or sizes.size() != fields.size() or types.size() != fields.size() or counts.size() != fields.size()) return false;
+
+		// locate x, y, z as byte offsets (binary) or columns (ascii)
+		int found = 0;
+		int byteOffset = 0, column = 0;
+		for (size_t i=0; i<fields.size(); ++i){
+			int axis = (fields[i] == "x") ? 0 : (fields[i] == "y") ? 1 : (fields[i] == "z") ? 2 : -1;
+			if (axis >= 0){
+				if (types[i] != 'F' or (sizes[i] != 4 and sizes[i] != 8)) return false;
+				this->xyzOffset_[axis] = this->binary_ ? byteOffset : column;
+				this->xyzSize_ = sizes[i];
+				++found;
+			}
+			byteOffset += sizes[i] * counts[i];
+			column += counts[i];
+		}
+		this->pointStep_ = byteOffset;
+		this->pointsRead_ = 0;
+		return found == 3;
+	}
+
+	size_t pcdReader::readChunk(std::vector<Eigen::Vector3d>& points, size_t maxPoints){
+		points.clear();
+		size_t num = std::min(maxPoints, this->pointNum_ - this->pointsRead_);
+		if (num == 0) return 0;
+		points.reserve(num);
+
+		if (this->binary_){
+			this->buffer_.resize(num * this->pointStep_);
+			this->file_.read(this->buffer_.data(), this->buffer_.size());
+			num = this->file_.gcount() / this->pointStep_;
+			for (size_t i=0; i<num; ++i){
+				const char* pointPtr = this->buffer_.data() + i * this->pointStep_;
+				Eigen::Vector3d point;
+				for (int axis=0; axis<3; ++axis){
+					if (this->xyzSize_ == 4){
+						float value;
+						memcpy(&value, pointPtr + this->xyzOffset_[axis], sizeof(float));
+						point(axis) = value;
+					}
+					else{
+						memcpy(&point(axis), pointPtr + this->xyzOffset_[axis], sizeof(double));
+					}
+				}
+				points.push_back(point);
+			}
+		}
+		else{
+			std::string line;
+			while (points.size() < num and std::getline(this->file_, line)){
+				const char* ptr = line.c_str();
+				char* end;
+				Eigen::Vector3d point;
+				int column = 0, found = 0;
+				while (found < 3){
+					double value = strtod(ptr, &end);
+					if (end == ptr) break;
+					for (int axis=0; axis<3; ++axis){
+						if (this->xyzOffset_[axis] == column){
+							point(axis) = value;
+							++found;
+						}
+					}
+					ptr = end;
+					++column;
+				}
+				if (found == 3) points.push_back(point);
+			}
+		}
+
+		if (points.empty()){
+			this->pointsRead_ = this->pointNum_; // truncated file
+		}
+		this->pointsRead_ += points.size();
+		return points.size();
+	}
+}
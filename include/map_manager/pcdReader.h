@@ -0,0 +1,37 @@
+/*
+	FILE: pcdReader.h
+	--------------------------------------
+	chunked PCD reader header file
+*/
+#ifndef MAPMANAGER_PCDREADER
+#define MAPMANAGER_PCDREADER
+#include <Eigen/Eigen>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace mapManager{
+	// reads xyz of an ascii/binary PCD file chunk by chunk so large maps never live in memory at once
+	class pcdReader{
+	private:
+		std::ifstream file_;
+		bool binary_ = false;
+		size_t pointNum_ = 0;
+		size_t pointsRead_ = 0;
+		size_t pointStep_ = 0; // bytes per point (binary)
+		int xyzOffset_[3] = {0, 0, 0}; // byte offset (binary) or column (ascii) of x, y, z
+		int xyzSize_ = 4; // float or double
+		std::vector<char> buffer_;
+
+	public:
+		bool open(const std::string& path); // false if not readable or compressed
+		size_t size() const;
+		size_t readChunk(std::vector<Eigen::Vector3d>& points, size_t maxPoints);
+	};
+
+	inline size_t pcdReader::size() const{
+		return this->pointNum_;
+	}
+}
+
+#endif
@@ -326,4 +326,88 @@ bool RayCaster::step(Eigen::Vector3d& ray_pt) {
   }
 
   return true;
-}
\ No newline at end of file
+}
+
+void initVoxelRay(const Eigen::Vector3d& start, const Eigen::Vector3d& end, VoxelRay& ray) {
+  // fixed point precision: the scaled t values stay below 2^62 ((len + 1)^3 * 2^(3 * bits))
+  double maxLength = (end - start).cwiseAbs().maxCoeff() + 2.0;
+  int lengthBits = 0;
+  while ((1 << lengthBits) < maxLength) ++lengthBits;
+  int bits = std::max(0, std::min(16, (62 - 3 * lengthBits) / 3));
+  const double scale = double(int64_t(1) << bits);
+  const int64_t one = int64_t(1) << bits;
+
+  int64_t s[3], d[3], b[3];
+  int v[3], endV[3], step[3];
+  for (int i = 0; i < 3; ++i) {
+    s[i] = (int64_t)std::floor(start(i) * scale);
+    int64_t e = (int64_t)std::floor(end(i) * scale);
+    v[i] = int(s[i] >> bits);  // arithmetic shift floors negative positions
+    endV[i] = int(e >> bits);
+    d[i] = e - s[i];
+    step[i] = d[i] > 0 ? 1 : (d[i] < 0 ? -1 : 0);
+    d[i] = std::abs(d[i]);
+    // distance to the first boundary crossed along this axis
+    b[i] = step[i] > 0 ? ((int64_t(v[i]) + 1) << bits) - s[i] : s[i] - (int64_t(v[i]) << bits);
+  }
+
+  // t = b / d for each axis, scaled by the product of the nonzero lengths
+  int64_t* tMax[3] = {&ray.tMaxX, &ray.tMaxY, &ray.tMaxZ};
+  int64_t* tDelta[3] = {&ray.tDeltaX, &ray.tDeltaY, &ray.tDeltaZ};
+  for (int i = 0; i < 3; ++i) {
+    if (d[i] == 0) {
+      *tMax[i] = INT64_MAX;  // never crossed
+      *tDelta[i] = 0;
+      continue;
+    }
+    int64_t other = 1;
+    for (int j = 0; j < 3; ++j) {
+      if (j != i && d[j] != 0) other *= d[j];
+    }
+    *tMax[i] = b[i] * other;
+    *tDelta[i] = one * other;
+  }
+
+  ray.x = v[0];
+  ray.y = v[1];
+  ray.z = v[2];
+  ray.stepX = step[0];
+  ray.stepY = step[1];
+  ray.stepZ = step[2];
+  ray.stepNum = std::abs(endV[0] - v[0]) + std::abs(endV[1] - v[1]) + std::abs(endV[2] - v[2]);
+}
+
+bool clipVoxelRay(Eigen::Vector3d& start, Eigen::Vector3d& end, const Eigen::Vector3i& boxMin,
+                  const Eigen::Vector3i& boxMax, bool& endClipped) {
+  const Eigen::Vector3d lower = boxMin.cast<double>();
+  const Eigen::Vector3d upper = (boxMax + Eigen::Vector3i::Ones()).cast<double>();
+  const Eigen::Vector3d dir = end - start;
+  double tEnter = 0.0;
+  double tExit = 1.0;
+  for (int i = 0; i < 3; ++i) {
+    if (dir(i) == 0) {
+      if (start(i) < lower(i) || start(i) >= upper(i)) return false;
+      continue;
+    }
+    double t0 = (lower(i) - start(i)) / dir(i);
+    double t1 = (upper(i) - start(i)) / dir(i);
+    if (t0 > t1) std::swap(t0, t1);
+    tEnter = std::max(tEnter, t0);
+    tExit = std::min(tExit, t1);
+  }
+  if (tEnter > tExit) return false;
+
+  // both points are clamped a margin inside the box faces (their voxels stay the same), well above the fixed
+  // point step of initVoxelRay (at most 2^-16). A point on a face would make the walk cross that face at the
+  // same t as the last boundary inside the box, and the tie could step out of the box instead.
+  const Eigen::Vector3d margin = Eigen::Vector3d::Constant(1e-3);
+  const Eigen::Vector3d lowerInside = lower + margin;
+  const Eigen::Vector3d upperInside = upper - margin;
+  endClipped = (end.array() < lower.array()).any() || (end.array() >= upper.array()).any();  // also an end on an upper face
+  if (endClipped) {
+    end = start + tExit * dir;
+  }
+  end = end.cwiseMax(lowerInside).cwiseMin(upperInside);
+  start = (start + tEnter * dir).cwiseMax(lowerInside).cwiseMin(upperInside);
+  return true;
+}
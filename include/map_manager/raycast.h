@@ -11,6 +11,7 @@
 
 #include <Eigen/Eigen>
 #include <vector>
+#include <cstdint>
 
 double signum(double x);
 
@@ -68,4 +69,134 @@ public:
   bool step(Eigen::Vector3d& ray_pt);
 };
 
+// Integer voxel traversal (Amanatides & Woo on fixed point positions).
+// Start and end are continuous voxel coordinates (floor gives the voxel index). The walk visits
+// the start voxel and every voxel crossed before the end voxel (the end voxel is not visited).
+// All t values are scaled by the product of the axis lengths, so stepping only adds and compares
+// integers and ties are resolved exactly.
+struct VoxelRay {
+  int x, y, z;
+  int stepX, stepY, stepZ;
+  int64_t tMaxX, tMaxY, tMaxZ;
+  int64_t tDeltaX, tDeltaY, tDeltaZ;
+  int stepNum;  // voxels left to visit
+};
+
+void initVoxelRay(const Eigen::Vector3d& start, const Eigen::Vector3d& end, VoxelRay& ray);
+
+// Clips the segment from start to end (continuous voxel coordinates) to the voxel box [boxMin, boxMax]
+// with a slab test. Returns false if the segment misses the box. The clipped points lie strictly inside the
+// box (off its faces), so the walk between them only visits voxels of the box. endClipped is set if the end
+// was outside and moved onto the box, its voxel is then the last voxel of the segment in the box and may be
+// visited as well (stepNum + 1), the walk still stays in the box.
+bool clipVoxelRay(Eigen::Vector3d& start, Eigen::Vector3d& end, const Eigen::Vector3i& boxMin,
+                  const Eigen::Vector3i& boxMax, bool& endClipped);
+
+// one step of the walk (same tie order as RayCaster: x, then y, then z)
+inline void stepVoxelRay(VoxelRay& ray) {
+  if (ray.tMaxX < ray.tMaxY) {
+    if (ray.tMaxX < ray.tMaxZ) {
+      ray.x += ray.stepX;
+      ray.tMaxX += ray.tDeltaX;
+    } else {
+      ray.z += ray.stepZ;
+      ray.tMaxZ += ray.tDeltaZ;
+    }
+  } else {
+    if (ray.tMaxY < ray.tMaxZ) {
+      ray.y += ray.stepY;
+      ray.tMaxY += ray.tDeltaY;
+    } else {
+      ray.z += ray.stepZ;
+      ray.tMaxZ += ray.tDeltaZ;
+    }
+  }
+}
+
+// visit(x, y, z) is called for each voxel and returns false to stop the walk
+template <typename Visitor>
+void traverseVoxelRay(VoxelRay& ray, Visitor& visit) {
+  for (; ray.stepNum > 0; --ray.stepNum) {
+    if (!visit(ray.x, ray.y, ray.z)) return;
+    stepVoxelRay(ray);
+  }
+}
+
+// Steps N rays in lockstep. The lane state is kept as structure of arrays and each step is
+// branchless, so the lanes are independent and the compiler can vectorize the update.
+// A lane is free again as soon as its ray ends, so new rays refill the lanes while long rays
+// are still walking. visit(lane, x, y, z) is called for each voxel of each active lane and
+// returns false to stop that lane.
+template <int N>
+class VoxelRayBatch {
+private:
+  int x_[N] = {}, y_[N] = {}, z_[N] = {};
+  int stepX_[N] = {}, stepY_[N] = {}, stepZ_[N] = {};
+  int64_t tMaxX_[N] = {}, tMaxY_[N] = {}, tMaxZ_[N] = {};
+  int64_t tDeltaX_[N] = {}, tDeltaY_[N] = {}, tDeltaZ_[N] = {};
+  int stepNum_[N] = {};  // 0: free lane
+  int laneNum_ = 0;  // active lanes
+
+public:
+  static const int LANE_NUM = N;
+
+  int size() const {
+    return laneNum_;
+  }
+
+  bool full() const {
+    return laneNum_ == N;
+  }
+
+  // returns the lane of the ray (the batch must not be full and the ray must have voxels to visit)
+  int add(const VoxelRay& ray) {
+    int l = 0;
+    while (stepNum_[l] > 0) ++l;
+    ++laneNum_;
+    x_[l] = ray.x;
+    y_[l] = ray.y;
+    z_[l] = ray.z;
+    stepX_[l] = ray.stepX;
+    stepY_[l] = ray.stepY;
+    stepZ_[l] = ray.stepZ;
+    tMaxX_[l] = ray.tMaxX;
+    tMaxY_[l] = ray.tMaxY;
+    tMaxZ_[l] = ray.tMaxZ;
+    tDeltaX_[l] = ray.tDeltaX;
+    tDeltaY_[l] = ray.tDeltaY;
+    tDeltaZ_[l] = ray.tDeltaZ;
+    stepNum_[l] = ray.stepNum;
+    return l;
+  }
+
+  // walks until a lane is free (drain: until all lanes are free)
+  template <typename Visitor>
+  void traverse(Visitor& visit, bool drain) {
+    int activeNum = laneNum_;
+    while (activeNum > 0 && (drain || activeNum == N)) {
+      for (int l = 0; l < N; ++l) {
+        if (stepNum_[l] > 0 && !visit(l, x_[l], y_[l], z_[l])) {
+          stepNum_[l] = 0;
+        }
+      }
+      activeNum = 0;
+      for (int l = 0; l < N; ++l) {
+        int64_t active = -int64_t(stepNum_[l] > 0);  // finished lanes stay where they are
+        int64_t selX = -int64_t((tMaxX_[l] < tMaxY_[l]) & (tMaxX_[l] < tMaxZ_[l])) & active;
+        int64_t selY = -int64_t((tMaxX_[l] >= tMaxY_[l]) & (tMaxY_[l] < tMaxZ_[l])) & active;
+        int64_t selZ = ~(selX | selY) & active;
+        x_[l] += stepX_[l] & int(selX);
+        y_[l] += stepY_[l] & int(selY);
+        z_[l] += stepZ_[l] & int(selZ);
+        tMaxX_[l] += tDeltaX_[l] & selX;
+        tMaxY_[l] += tDeltaY_[l] & selY;
+        tMaxZ_[l] += tDeltaZ_[l] & selZ;
+        stepNum_[l] -= (stepNum_[l] > 0);
+        activeNum += (stepNum_[l] > 0);
+      }
+    }
+    laneNum_ = activeNum;
+  }
+};
+
 #endif  // RAYCAST_H_
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+	FILE: sensorModel.h
+	--------------------------------------
+	range and angle dependent log odds of the sensor models
+*/
+#ifndef MAPMANAGER_SENSORMODEL
+#define MAPMANAGER_SENSORMODEL
+#include <Eigen/Eigen>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace mapManager{
+	// constant log odds (p_hit/p_miss for every measurement)
+	struct constantSensorModel{
+		static const bool GEOMETRIC = false; // no range/angle lookup in the update
+
+		static double angleCos(double axisProj){
+			return 1.0;
+		}
+	};
+
+	// depth camera: off-axis angle is measured from the optical axis (z of the sensor)
+	struct depthCameraModel{
+		static const bool GEOMETRIC = true;
+
+		// cos of the off-axis angle from the ray direction projected on the sensor z axis
+		static double angleCos(double axisProj){
+			return axisProj;
+		}
+
+		// axial noise of structured light/stereo grows quadratically with range
+		static Eigen::Vector3d defaultNoise(){
+			return Eigen::Vector3d (0.001, 0.0, 0.002);
+		}
+	};
+
+	// lidar: off-axis angle is measured from the scan plane (xy plane of the sensor)
+	struct lidarModel{
+		static const bool GEOMETRIC = true;
+
+		static double angleCos(double axisProj){
+			return sqrt(std::max(1.0 - axisProj * axisProj, 0.0));
+		}
+
+		// range noise is nearly constant, beam divergence adds a linear term
+		static Eigen::Vector3d defaultNoise(){
+			return Eigen::Vector3d (0.02, 0.001, 0.0);
+		}
+	};
+
+	// log odds of hit and miss by range and off-axis angle, precomputed for one sensor model
+	// noise sigma(r, angle) = (noise(0) + noise(1) * r + noise(2) * r^2) / max(cos(angle), 0.1)
+	// a measurement whose noise is larger than a voxel is weighted down: p = 0.5 + (p - 0.5) * min(1, res / sigma)
+	class sensorModelTable{
+	private:
+		std::vector<double> logOdds_; // [range][angle][miss, hit]
+		double rangeBinInv_ = 0.0;
+		int rangeBinNum_ = 1, angleBinNum_ = 1;
+
+		static double logit(double p){
+			return log(p / (1 - p));
+		}
+
+		static double probability(double logOdds){
+			return 1.0 / (1.0 + exp(-logOdds));
+		}
+
+	public:
+		static const int ANGLE_BIN_NUM = 16;
+
+		// built from the hit and miss log odds of the map, a non geometric model keeps them as they are
+		template <typename SensorModel>
+		void init(double hitLog, double missLog, const Eigen::Vector3d& noise, double res, double maxRange){
+			if (not SensorModel::GEOMETRIC){
+				this->rangeBinNum_ = this->angleBinNum_ = 1;
+				this->rangeBinInv_ = 0.0;
+				this->logOdds_ = {missLog, hitLog};
+				return;
+			}
+			const double pHit = probability(hitLog);
+			const double pMiss = probability(missLog);
+			// one range bin per voxel up to a little beyond the raycast length (carried rays of a moved sensor)
+			this->rangeBinNum_ = int(ceil(maxRange / res)) + 2;
+			this->angleBinNum_ = ANGLE_BIN_NUM;
+			this->rangeBinInv_ = 1.0 / res;
+			this->logOdds_.resize(this->rangeBinNum_ * this->angleBinNum_ * 2);
+			for (int r=0; r<this->rangeBinNum_; ++r){
+				double range = (r + 0.5) * res;
+				double sigma = noise(0) + noise(1) * range + noise(2) * range * range;
+				for (int a=0; a<this->angleBinNum_; ++a){
+					double angleCos = std::max(SensorModel::angleCos((a + 0.5) / this->angleBinNum_), 0.1);
+					double weight = std::min(1.0, res / (sigma / angleCos));
+					int key = (r * this->angleBinNum_ + a) * 2;
+					this->logOdds_[key] = logit(0.5 + (pMiss - 0.5) * weight);
+					this->logOdds_[key + 1] = logit(0.5 + (pHit - 0.5) * weight);
+				}
+			}
+		}
+
+		// table key of a measurement at offset diff from the sensor (axis: z axis of the sensor)
+		int key(const Eigen::Vector3d& diff, const Eigen::Vector3d& axis) const{
+			double range = diff.norm();
+			double axisProj = std::abs(diff.dot(axis)) / (range + 1e-9);
+			int r = std::min(int(range * this->rangeBinInv_), this->rangeBinNum_ - 1);
+			int a = std::min(int(axisProj * this->angleBinNum_), this->angleBinNum_ - 1);
+			return (r * this->angleBinNum_ + a) * 2;
+		}
+
+		double logOdds(int key, bool isHit) const{
+			return this->logOdds_[key + isHit];
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+	FILE: tripleBuffer.h
+	--------------------------------------
+	lock-free single producer single consumer triple buffer
+*/
+#ifndef MAPMANAGER_TRIPLEBUFFER
+#define MAPMANAGER_TRIPLEBUFFER
+#include <atomic>
+#include <cstdint>
+
+namespace mapManager{
+	// the producer fills writeBuffer() and publishes it, the consumer takes the latest published one
+	// a published buffer that is not consumed before the next publish is dropped (drop oldest)
+	template <typename T>
+	class tripleBuffer{
+	private:
+		static const uint8_t FRESH = 4; // the shared buffer holds a frame that has not been consumed
+		T buffers_[3];
+		uint8_t writeID_ = 0; // owned by the producer
+		uint8_t readID_ = 1; // owned by the consumer
+		std::atomic<uint8_t> sharedID_ {2};
+		std::atomic<uint64_t> publishedNum_ {0};
+		std::atomic<uint64_t> droppedNum_ {0};
+
+	public:
+		// producer
+		T& writeBuffer();
+		void publish();
+
+		// consumer: return false if nothing new was published since the last call
+		bool consume();
+		T& readBuffer();
+
+		uint64_t getPublishedNum() const;
+		uint64_t getDroppedNum() const;
+	};
+
+	template <typename T>
+	inline T& tripleBuffer<T>::writeBuffer(){
+		return this->buffers_[this->writeID_];
+	}
+
+	template <typename T>
+	inline void tripleBuffer<T>::publish(){
+		uint8_t prev = this->sharedID_.exchange(this->writeID_ | FRESH, std::memory_order_acq_rel);
+		if (prev & FRESH){
+			this->droppedNum_.fetch_add(1, std::memory_order_relaxed);
+		}
+		this->writeID_ = prev & (FRESH - 1);
+		this->publishedNum_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	template <typename T>
+	inline bool tripleBuffer<T>::consume(){
+		// only the consumer clears FRESH, so a fresh buffer seen here is still fresh at the exchange
+		if (not (this->sharedID_.load(std::memory_order_relaxed) & FRESH)){
+			return false;
+		}
+		uint8_t prev = this->sharedID_.exchange(this->readID_, std::memory_order_acq_rel);
+		this->readID_ = prev & (FRESH - 1);
+		return true;
+	}
+
+	template <typename T>
+	inline T& tripleBuffer<T>::readBuffer(){
+		return this->buffers_[this->readID_];
+	}
+
+	template <typename T>
+	inline uint64_t tripleBuffer<T>::getPublishedNum() const{
+		return this->publishedNum_.load(std::memory_order_relaxed);
+	}
+
+	template <typename T>
+	inline uint64_t tripleBuffer<T>::getDroppedNum() const{
+		return this->droppedNum_.load(std::memory_order_relaxed);
+	}
+}
+
+#endif
@@ -1,30 +1,47 @@
 #include <ros/ros.h>
-#include <sensor_msgs/PointCloud2.h>
-#include <pcl_conversions/pcl_conversions.h>
-#include <pcl/point_cloud.h>
-#include <pcl/point_types.h>
-
-void mapSaverCB(const sensor_msgs::PointCloud2ConstPtr& cloud_msg){
-    std::cout << "[Map Saver]: Latest Map Message Obtained." << std::endl;
-    
-    pcl::PCLPointCloud2* pclCloud2 = new pcl::PCLPointCloud2;
-    pcl::PointCloud<pcl::PointXYZ> pclCloud;
-
-    pcl_conversions::toPCL(*cloud_msg, *pclCloud2);
-    pcl::fromPCLPointCloud2( *pclCloud2, pclCloud);
-
-    pcl::io::savePCDFileASCII ("./static_map.pcd", pclCloud);
-    std::cerr << "[Map Saver]:" << " Saved " << pclCloud.size () << " data points to static_map.pcd in the current directory." << std::endl;
-}
+#include <map_manager/SaveMap.h>
+#include <map_manager/SaveMapStatus.h>
 
 int main(int argc, char** argv){
 	ros::init(argc, argv, "save_map_node");
-	ros::NodeHandle nh;
-    ros::Subscriber mapSub;
+	ros::NodeHandle nh ("~");
 
-	// subscribe the map
-    mapSub = nh.subscribe("/occupancy_map/voxel_map", 10, mapSaverCB);
+	// usage: rosrun map_manager save_map_node [file_name] [map namespace]
+	std::string mapNs = (argc > 2) ? argv[2] : "occupancy_map";
+	map_manager::SaveMap srv;
+	srv.request.file_name = (argc > 1) ? argv[1] : "./static_map.map";
 
-	ros::spin();
-	return 0;
-}
\ No newline at end of file
+	// optional region of interest: _region_min:="[x, y, z]" _region_max:="[x, y, z]"
+	nh.getParam("region_min", srv.request.region_min);
+	nh.getParam("region_max", srv.request.region_max);
+
+	// the map node streams its own grid to disk
+	std::string serviceName = "/" + mapNs + "/save_map";
+	std::string statusServiceName = "/" + mapNs + "/save_map_status";
+	std::cout << "[Map Saver]: Waiting for " << serviceName << "..." << std::endl;
+	ros::service::waitForService(serviceName);
+	if (not ros::service::call(serviceName, srv)){
+		std::cerr << "[Map Saver]: Failed to call " << serviceName << std::endl;
+		return 1;
+	}
+	std::cout << "[Map Saver]: " << srv.response.message << std::endl;
+	if (not srv.response.queued){
+		return 1;
+	}
+
+	// the file is written in background, wait for the result
+	map_manager::SaveMapStatus status;
+	ros::WallRate rate (5);
+	while (ros::ok()){
+		if (not ros::service::call(statusServiceName, status)){
+			std::cerr << "[Map Saver]: Failed to call " << statusServiceName << std::endl;
+			return 1;
+		}
+		if (not status.response.in_progress){
+			break;
+		}
+		rate.sleep();
+	}
+	std::cout << "[Map Saver]: " << status.response.message << std::endl;
+	return (not status.response.in_progress and status.response.success) ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+/*
+	FILE: test_map_delta.cpp
+	--------------------------------------
+	tests of the block codec of the incremental map stream
+*/
+#include <map_manager/mapDelta.h>
+#include <gtest/gtest.h>
+#include <random>
+
+using namespace mapManager;
+
+TEST(DeltaBlock, UniformBlocksTakeOneByte){
+	uint8_t states[DELTA_BLOCK_VOXELS], decoded[DELTA_BLOCK_VOXELS];
+	for (uint8_t state : {DELTA_VOXEL_UNKNOWN, DELTA_VOXEL_FREE, DELTA_VOXEL_OCCUPIED, DELTA_VOXEL_INFLATED}){
+		std::fill(states, states + DELTA_BLOCK_VOXELS, state);
+		std::vector<uint8_t> payload;
+		encodeDeltaBlock(states, payload);
+		ASSERT_EQ(payload.size(), 1u);
+		EXPECT_EQ(payload[0], state);
+		ASSERT_EQ(decodeDeltaBlock(payload.data(), payload.size(), decoded), 1u);
+		EXPECT_TRUE(std::equal(states, states + DELTA_BLOCK_VOXELS, decoded));
+	}
+}
+
+TEST(DeltaBlock, PackedRoundTrip){
+	std::mt19937 rng (1);
+	uint8_t states[DELTA_BLOCK_VOXELS], decoded[DELTA_BLOCK_VOXELS];
+	for (int n=0; n<1000; ++n){
+		for (int i=0; i<DELTA_BLOCK_VOXELS; ++i){
+			states[i] = (n % 2 == 0) ? rng() % 4 : DELTA_VOXEL_FREE;
+		}
+		states[n % DELTA_BLOCK_VOXELS] = DELTA_VOXEL_OCCUPIED; // at least one voxel differs
+		if (n % 2 == 1){
+			states[(n + 1) % DELTA_BLOCK_VOXELS] = DELTA_VOXEL_FREE;
+			states[(n * 7 + 3) % DELTA_BLOCK_VOXELS] = DELTA_VOXEL_INFLATED;
+		}
+		std::vector<uint8_t> payload;
+		encodeDeltaBlock(states, payload);
+		ASSERT_EQ(payload.size(), size_t(1 + DELTA_BLOCK_VOXELS/4));
+		EXPECT_EQ(payload[0], DELTA_BLOCK_PACKED);
+		ASSERT_EQ(decodeDeltaBlock(payload.data(), payload.size(), decoded), payload.size());
+		ASSERT_TRUE(std::equal(states, states + DELTA_BLOCK_VOXELS, decoded)) << "block " << n;
+	}
+}
+
+TEST(DeltaBlock, ConsecutiveBlocksInOnePayload){
+	// a message concatenates block payloads, each decode consumes exactly its block
+	std::mt19937 rng (2);
+	std::vector<std::vector<uint8_t>> blocks (20, std::vector<uint8_t> (DELTA_BLOCK_VOXELS));
+	std::vector<uint8_t> payload;
+	for (size_t b=0; b<blocks.size(); ++b){
+		for (uint8_t& state : blocks[b]){
+			state = (b % 3 == 0) ? uint8_t(b % 4) : uint8_t(rng() % 4);
+		}
+		encodeDeltaBlock(blocks[b].data(), payload);
+	}
+	size_t offset = 0;
+	uint8_t decoded[DELTA_BLOCK_VOXELS];
+	for (size_t b=0; b<blocks.size(); ++b){
+		size_t size = decodeDeltaBlock(payload.data() + offset, payload.size() - offset, decoded);
+		ASSERT_GT(size, 0u);
+		EXPECT_TRUE(std::equal(blocks[b].begin(), blocks[b].end(), decoded)) << "block " << b;
+		offset += size;
+	}
+	EXPECT_EQ(offset, payload.size());
+}
+
+TEST(DeltaBlock, MalformedPayloads){
+	uint8_t decoded[DELTA_BLOCK_VOXELS];
+	std::vector<uint8_t> payload (1 + DELTA_BLOCK_VOXELS/4, 0);
+	EXPECT_EQ(decodeDeltaBlock(payload.data(), 0, decoded), 0u); // empty
+	payload[0] = DELTA_BLOCK_PACKED;
+	EXPECT_EQ(decodeDeltaBlock(payload.data(), payload.size() - 1, decoded), 0u); // truncated
+	payload[0] = DELTA_BLOCK_PACKED + 1;
+	EXPECT_EQ(decodeDeltaBlock(payload.data(), payload.size(), decoded), 0u); // unknown mode
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
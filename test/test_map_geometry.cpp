@@ -0,0 +1,133 @@
+/*
+	FILE: test_map_geometry.cpp
+	--------------------------------------
+	tests of the voxel addressing policies and the map index math
+*/
+#include <map_manager/mapGeometry.h>
+#include <gtest/gtest.h>
+
+using namespace mapManager;
+
+namespace{
+	// map sizes with power of two, multiple of 8 and odd axes (the policies pad axes differently)
+	const Eigen::Vector3i MAP_SIZES[] = {Eigen::Vector3i (1, 1, 1), Eigen::Vector3i (37, 21, 13), Eigen::Vector3i (64, 32, 16), Eigen::Vector3i (9, 130, 3)};
+}
+
+template <typename Addressing>
+class AddressingTest : public testing::Test{};
+
+typedef testing::Types<linearAddressing, linearPow2Addressing, tiledAddressing, mortonAddressing> addressingTypes;
+TYPED_TEST_SUITE(AddressingTest, addressingTypes);
+
+TYPED_TEST(AddressingTest, AddressIndexRoundTrip){
+	for (const Eigen::Vector3i& mapSize : MAP_SIZES){
+		TypeParam addressing;
+		addressing.init(mapSize);
+		ASSERT_GE(addressing.size(), mapSize.prod());
+		std::vector<uint8_t> used (addressing.size(), 0);
+		Eigen::Vector3i idx;
+		for (int x=0; x<mapSize(0); ++x){
+			for (int y=0; y<mapSize(1); ++y){
+				for (int z=0; z<mapSize(2); ++z){
+					int address = addressing.address(x, y, z);
+					ASSERT_GE(address, 0);
+					ASSERT_LT(address, addressing.size());
+					EXPECT_FALSE(used[address]) << "address " << address << " used twice";
+					used[address] = 1;
+					addressing.index(address, idx);
+					ASSERT_EQ(idx, Eigen::Vector3i (x, y, z)) << "map " << mapSize.transpose();
+				}
+			}
+		}
+	}
+}
+
+TYPED_TEST(AddressingTest, ZRunsAreContiguous){
+	// forEachZRun relies on aligned z runs of Z_RUN voxels having consecutive addresses
+	for (const Eigen::Vector3i& mapSize : MAP_SIZES){
+		TypeParam addressing;
+		addressing.init(mapSize);
+		for (int x=0; x<mapSize(0); ++x){
+			for (int y=0; y<mapSize(1); ++y){
+				for (int z=1; z<mapSize(2); ++z){
+					if (z % TypeParam::Z_RUN != 0){
+						ASSERT_EQ(addressing.address(x, y, z), addressing.address(x, y, z-1) + 1) << "map " << mapSize.transpose();
+					}
+				}
+			}
+		}
+	}
+}
+
+TYPED_TEST(AddressingTest, MonotonicInEachAxis){
+	// a box lies between the addresses of its corners (incremental snapshot writes)
+	for (const Eigen::Vector3i& mapSize : MAP_SIZES){
+		TypeParam addressing;
+		addressing.init(mapSize);
+		for (int x=0; x<mapSize(0); ++x){
+			for (int y=0; y<mapSize(1); ++y){
+				for (int z=0; z<mapSize(2); ++z){
+					int address = addressing.address(x, y, z);
+					if (x > 0){
+						ASSERT_GT(address, addressing.address(x-1, y, z));
+					}
+					if (y > 0){
+						ASSERT_GT(address, addressing.address(x, y-1, z));
+					}
+					if (z > 0){
+						ASSERT_GT(address, addressing.address(x, y, z-1));
+					}
+				}
+			}
+		}
+	}
+}
+
+TEST(MapAddressing, SelectedByDefine){
+	EXPECT_EQ(uint32_t(mapAddressing::ID), uint32_t(MAP_ADDRESSING));
+	EXPECT_EQ(uint32_t(linearAddressing::ID), uint32_t(MAP_ADDRESSING_LINEAR));
+	EXPECT_EQ(uint32_t(linearPow2Addressing::ID), uint32_t(MAP_ADDRESSING_LINEAR_POW2));
+	EXPECT_EQ(uint32_t(tiledAddressing::ID), uint32_t(MAP_ADDRESSING_TILED));
+	EXPECT_EQ(uint32_t(mortonAddressing::ID), uint32_t(MAP_ADDRESSING_MORTON));
+}
+
+TEST(MapGeometry, PositionIndexRoundTrip){
+	mapGeometry<mapAddressing> geometry;
+	const Eigen::Vector3d origin (-20.0, -10.0, -0.1);
+	const double res = 0.1;
+	const Eigen::Vector3i mapSize (400, 200, 30);
+	geometry.init(origin, res, mapSize);
+	Eigen::Vector3d pos;
+	Eigen::Vector3i idx, roundTrip;
+	for (int x=0; x<mapSize(0); x+=7){
+		for (int y=0; y<mapSize(1); y+=5){
+			for (int z=0; z<mapSize(2); ++z){
+				idx = Eigen::Vector3i (x, y, z);
+				geometry.indexToPos(idx, pos);
+				geometry.posToIndex(pos, roundTrip);
+				ASSERT_EQ(roundTrip, idx);
+				// anywhere inside the voxel maps to it
+				geometry.posToIndex(pos + Eigen::Vector3d (0.49, -0.49, 0.3) * res, roundTrip);
+				ASSERT_EQ(roundTrip, idx);
+				ASSERT_TRUE(geometry.isInMap(idx));
+			}
+		}
+	}
+}
+
+TEST(MapGeometry, FloorAndBounds){
+	mapGeometry<mapAddressing> geometry;
+	geometry.init(Eigen::Vector3d (-1.0, -1.0, -1.0), 0.5, Eigen::Vector3i (4, 4, 4));
+	Eigen::Vector3i idx;
+	geometry.posToIndex(Eigen::Vector3d (-1.2, -1.0, 0.99), idx); // negative positions floor down
+	EXPECT_EQ(idx, Eigen::Vector3i (-1, 0, 3));
+	EXPECT_FALSE(geometry.isInMap(idx));
+	EXPECT_FALSE(geometry.isInMap(Eigen::Vector3i (0, 4, 0)));
+	EXPECT_TRUE(geometry.isInMap(Eigen::Vector3i (3, 3, 3)));
+	EXPECT_EQ(geometry.posToVoxel(Eigen::Vector3d (0.25, -1.0, 1.0)), Eigen::Vector3d (2.5, 0.0, 4.0));
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
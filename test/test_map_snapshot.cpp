@@ -0,0 +1,151 @@
+/*
+	FILE: test_map_snapshot.cpp
+	--------------------------------------
+	tests of the binary map snapshot and the run length encoded compact map file
+*/
+#include <map_manager/mapSnapshot.h>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace mapManager;
+
+namespace{
+	std::string tempPath(const std::string& name){
+		return testing::TempDir() + "map_manager_" + name;
+	}
+}
+
+TEST(MapSnapshot, LayerRoundTrip){
+	const std::string path = tempPath("snapshot.snap");
+	const uint64_t voxelNum = 12345; // layers are not page sized
+	std::mt19937 rng (1);
+	std::uniform_real_distribution<double> value (-5.0, 5.0);
+	std::vector<double> occupancy (voxelNum), esdf (voxelNum);
+	std::vector<uint8_t> inflated (voxelNum);
+	for (uint64_t i=0; i<voxelNum; ++i){
+		occupancy[i] = value(rng);
+		esdf[i] = value(rng);
+		inflated[i] = rng() & 1;
+	}
+
+	snapshotHeader header;
+	mapSnapshot::initHeader(header, SNAPSHOT_LAYER_OCCUPANCY | SNAPSHOT_LAYER_INFLATED | SNAPSHOT_LAYER_ESDF, voxelNum);
+	header.resolution = 0.1;
+	header.mapVoxelMax[0] = 15; header.mapVoxelMax[1] = 823; header.mapVoxelMax[2] = 1;
+	header.currMapRangeMin[0] = -1.5;
+	header.pOccLog = 1.2;
+	EXPECT_EQ(header.occupancyOffset % 4096, 0u);
+	EXPECT_EQ(header.inflatedOffset % 4096, 0u);
+	EXPECT_EQ(header.esdfOffset % 4096, 0u);
+	{
+		mapSnapshot snapshot;
+		ASSERT_TRUE(snapshot.create(path, header));
+		memcpy(snapshot.occupancy(), occupancy.data(), voxelNum * sizeof(double));
+		memcpy(snapshot.inflated(), inflated.data(), voxelNum);
+		memcpy(snapshot.esdf(), esdf.data(), voxelNum * sizeof(double));
+		ASSERT_TRUE(snapshot.sync());
+	}
+
+	ASSERT_TRUE(mapSnapshot::isSnapshotFile(path));
+	mapSnapshot snapshot;
+	ASSERT_TRUE(snapshot.open(path));
+	EXPECT_TRUE(snapshot.isCompatible(header));
+	EXPECT_EQ(snapshot.header().voxelNum, voxelNum);
+	EXPECT_EQ(snapshot.header().mapVoxelMax[1], 823);
+	EXPECT_EQ(snapshot.header().currMapRangeMin[0], -1.5);
+	EXPECT_EQ(snapshot.header().pOccLog, 1.2);
+	EXPECT_EQ(memcmp(snapshot.occupancy(), occupancy.data(), voxelNum * sizeof(double)), 0);
+	EXPECT_EQ(memcmp(snapshot.inflated(), inflated.data(), voxelNum), 0);
+	EXPECT_EQ(memcmp(snapshot.esdf(), esdf.data(), voxelNum * sizeof(double)), 0);
+
+	// another geometry or layer set is not compatible
+	snapshotHeader other = header;
+	other.mapVoxelMax[2] = 2;
+	EXPECT_FALSE(snapshot.isCompatible(other));
+	mapSnapshot::initHeader(other, SNAPSHOT_LAYER_OCCUPANCY, voxelNum);
+	EXPECT_FALSE(snapshot.isCompatible(other));
+	snapshot.close();
+	std::remove(path.c_str());
+}
+
+TEST(MapSnapshot, MissingLayers){
+	const std::string path = tempPath("occupancy_only.snap");
+	snapshotHeader header;
+	mapSnapshot::initHeader(header, SNAPSHOT_LAYER_OCCUPANCY, 100);
+	mapSnapshot snapshot;
+	ASSERT_TRUE(snapshot.create(path, header));
+	EXPECT_NE(snapshot.occupancy(), nullptr);
+	EXPECT_EQ(snapshot.inflated(), nullptr);
+	EXPECT_EQ(snapshot.esdf(), nullptr);
+	snapshot.close();
+	std::remove(path.c_str());
+}
+
+TEST(MapSnapshot, RejectsOtherFiles){
+	const std::string path = tempPath("not_a_snapshot.snap");
+	std::ofstream (path) << "# .PCD v0.7 - Point Cloud Data file format\n" << std::string(8192, ' '); // longer than a header
+	EXPECT_FALSE(mapSnapshot::isSnapshotFile(path));
+	mapSnapshot snapshot;
+	EXPECT_FALSE(snapshot.open(path));
+	EXPECT_FALSE(mapSnapshot::isSnapshotFile(tempPath("missing.snap")));
+	std::remove(path.c_str());
+}
+
+TEST(CompactMap, RunLengthRoundTrip){
+	// runs encoded in one, two and three varint bytes
+	const std::string path = tempPath("compact.map");
+	compactMapHeader header;
+	initCompactMapHeader(header);
+	header.resolution = 0.1;
+	header.origin[0] = -3.0; header.origin[1] = 2.5; header.origin[2] = 0.0;
+	header.dim[0] = 37; header.dim[1] = 29; header.dim[2] = 41;
+	std::vector<uint8_t> states (size_t(header.dim[0]) * header.dim[1] * header.dim[2]);
+	std::mt19937 rng (2);
+	size_t i = 0;
+	while (i < states.size()){
+		size_t length = (rng() % 4 == 0) ? 1 + rng() % 20000 : 1 + rng() % 40;
+		uint8_t state = rng() % 3;
+		for (size_t end=std::min(states.size(), i + length); i<end; ++i){
+			states[i] = state;
+		}
+	}
+	std::remove(path.c_str());
+	EXPECT_FALSE(isCompactMapFile(path));
+	ASSERT_TRUE(writeCompactMap(path, header, states));
+	EXPECT_TRUE(isCompactMapFile(path));
+	EXPECT_GT(header.runNum, 0u);
+
+	compactMapHeader readHeader;
+	std::vector<uint8_t> readStates;
+	ASSERT_TRUE(readCompactMap(path, readHeader, readStates));
+	EXPECT_EQ(readHeader.runNum, header.runNum);
+	EXPECT_EQ(readHeader.origin[1], 2.5);
+	EXPECT_EQ(readHeader.dim[2], 41);
+	EXPECT_EQ(readStates, states);
+	std::remove(path.c_str());
+}
+
+TEST(CompactMap, RejectsWrongVoxelNumber){
+	const std::string path = tempPath("compact_short.map");
+	compactMapHeader header;
+	initCompactMapHeader(header);
+	header.dim[0] = 4; header.dim[1] = 4; header.dim[2] = 4;
+	std::vector<uint8_t> states (63, COMPACT_VOXEL_FREE); // one voxel short
+	ASSERT_TRUE(writeCompactMap(path, header, states));
+	compactMapHeader readHeader;
+	std::vector<uint8_t> readStates;
+	EXPECT_FALSE(readCompactMap(path, readHeader, readStates));
+
+	states.resize(65, COMPACT_VOXEL_OCCUPIED); // one voxel too many
+	ASSERT_TRUE(writeCompactMap(path, header, states));
+	EXPECT_FALSE(readCompactMap(path, readHeader, readStates));
+	std::remove(path.c_str());
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
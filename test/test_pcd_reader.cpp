@@ -0,0 +1,134 @@
+/*
+	FILE: test_pcd_reader.cpp
+	--------------------------------------
+	tests of the chunked PCD reader
+*/
+#include <map_manager/pcdReader.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace mapManager;
+
+namespace{
+	std::string tempPath(const std::string& name){
+		return testing::TempDir() + "map_manager_" + name;
+	}
+
+	std::vector<Eigen::Vector3d> randomPoints(size_t num){
+		std::mt19937 rng (1);
+		std::uniform_real_distribution<float> coordinate (-50.0f, 50.0f); // exact in float and double files
+		std::vector<Eigen::Vector3d> points (num);
+		for (Eigen::Vector3d& point : points){
+			point = Eigen::Vector3d (coordinate(rng), coordinate(rng), coordinate(rng));
+		}
+		return points;
+	}
+
+	// writes the points with an intensity field in front of xyz (the reader has to locate x, y, z)
+	void writePCD(const std::string& path, const std::vector<Eigen::Vector3d>& points, const std::string& data, int xyzSize){
+		std::ofstream file (path, std::ios::binary);
+		file << "# .PCD v0.7 - Point Cloud Data file format\n";
+		file << "VERSION 0.7\nFIELDS intensity x y z\nSIZE 4 " << xyzSize << " " << xyzSize << " " << xyzSize << "\n";
+		file << "TYPE F F F F\nCOUNT 1 1 1 1\n";
+		file << "WIDTH " << points.size() << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS " << points.size() << "\nDATA " << data << "\n";
+		for (size_t i=0; i<points.size(); ++i){
+			float intensity = float(i);
+			if (data == "ascii"){
+				file << intensity << " " << float(points[i](0)) << " " << float(points[i](1)) << " " << float(points[i](2)) << "\n";
+				continue;
+			}
+			file.write(reinterpret_cast<const char*>(&intensity), sizeof(float));
+			for (int axis=0; axis<3; ++axis){
+				if (xyzSize == 4){
+					float value = points[i](axis);
+					file.write(reinterpret_cast<const char*>(&value), sizeof(float));
+				}
+				else{
+					double value = points[i](axis);
+					file.write(reinterpret_cast<const char*>(&value), sizeof(double));
+				}
+			}
+		}
+	}
+
+	std::vector<Eigen::Vector3d> readAll(pcdReader& reader, size_t chunkSize){
+		std::vector<Eigen::Vector3d> points, chunk;
+		while (reader.readChunk(chunk, chunkSize) > 0){
+			EXPECT_LE(chunk.size(), chunkSize);
+			points.insert(points.end(), chunk.begin(), chunk.end());
+		}
+		return points;
+	}
+}
+
+TEST(PcdReader, BinaryFloatInChunks){
+	const std::string path = tempPath("binary_float.pcd");
+	std::vector<Eigen::Vector3d> points = randomPoints(10007);
+	writePCD(path, points, "binary", 4);
+	pcdReader reader;
+	ASSERT_TRUE(reader.open(path));
+	EXPECT_EQ(reader.size(), points.size());
+	EXPECT_EQ(readAll(reader, 1000), points);
+	std::remove(path.c_str());
+}
+
+TEST(PcdReader, BinaryDouble){
+	const std::string path = tempPath("binary_double.pcd");
+	std::vector<Eigen::Vector3d> points = randomPoints(777);
+	writePCD(path, points, "binary", 8);
+	pcdReader reader;
+	ASSERT_TRUE(reader.open(path));
+	EXPECT_EQ(readAll(reader, 100), points);
+	std::remove(path.c_str());
+}
+
+TEST(PcdReader, AsciiInChunks){
+	const std::string path = tempPath("ascii.pcd");
+	std::vector<Eigen::Vector3d> points = randomPoints(2500);
+	writePCD(path, points, "ascii", 4);
+	pcdReader reader;
+	ASSERT_TRUE(reader.open(path));
+	std::vector<Eigen::Vector3d> readPoints = readAll(reader, 333);
+	ASSERT_EQ(readPoints.size(), points.size());
+	for (size_t i=0; i<points.size(); ++i){
+		EXPECT_LT((readPoints[i] - points[i]).norm(), 1e-4) << "point " << i;
+	}
+	std::remove(path.c_str());
+}
+
+TEST(PcdReader, TruncatedBinaryFile){
+	const std::string path = tempPath("truncated.pcd");
+	std::vector<Eigen::Vector3d> points = randomPoints(100);
+	writePCD(path, points, "binary", 4);
+	{
+		// claim more points than the file holds
+		std::ifstream file (path, std::ios::binary);
+		std::string content ((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		size_t pos = content.find("POINTS 100");
+		content.replace(pos, 10, "POINTS 150");
+		std::ofstream (path, std::ios::binary) << content;
+	}
+	pcdReader reader;
+	ASSERT_TRUE(reader.open(path));
+	EXPECT_EQ(readAll(reader, 64), points); // stops at the end of the data
+	std::remove(path.c_str());
+}
+
+TEST(PcdReader, RejectsCompressedAndInvalidFiles){
+	const std::string path = tempPath("compressed.pcd");
+	writePCD(path, randomPoints(10), "binary_compressed", 4);
+	pcdReader reader;
+	EXPECT_FALSE(reader.open(path));
+
+	std::ofstream (path) << "VERSION 0.7\nFIELDS x y\nSIZE 4 4\nTYPE F F\nCOUNT 1 1\nPOINTS 0\nDATA ascii\n"; // no z
+	EXPECT_FALSE(reader.open(path));
+	EXPECT_FALSE(reader.open(tempPath("missing.pcd")));
+	std::remove(path.c_str());
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,189 @@
+/*
+	FILE: test_raycast.cpp
+	--------------------------------------
+	tests of the integer voxel ray traversal
+*/
+#include <map_manager/raycast.h>
+#include <gtest/gtest.h>
+#include <random>
+
+namespace{
+	// walks the segment clipped to the box as the map integration does (end voxel visited if the end was clipped)
+	std::vector<Eigen::Vector3i> walkClipped(Eigen::Vector3d start, Eigen::Vector3d end, const Eigen::Vector3i& boxMin, const Eigen::Vector3i& boxMax){
+		std::vector<Eigen::Vector3i> voxels;
+		bool endClipped;
+		if (not clipVoxelRay(start, end, boxMin, boxMax, endClipped)){
+			return voxels;
+		}
+		VoxelRay ray;
+		initVoxelRay(start, end, ray);
+		ray.stepNum += endClipped;
+		auto visit = [&](int x, int y, int z){voxels.push_back(Eigen::Vector3i (x, y, z)); return true;};
+		traverseVoxelRay(ray, visit);
+		return voxels;
+	}
+
+	bool isInBox(const Eigen::Vector3i& idx, const Eigen::Vector3i& boxMin, const Eigen::Vector3i& boxMax){
+		return (idx.array() >= boxMin.array()).all() and (idx.array() <= boxMax.array()).all();
+	}
+
+	std::vector<Eigen::Vector3i> walk(const Eigen::Vector3d& start, const Eigen::Vector3d& end){
+		std::vector<Eigen::Vector3i> voxels;
+		VoxelRay ray;
+		initVoxelRay(start, end, ray);
+		auto visit = [&](int x, int y, int z){voxels.push_back(Eigen::Vector3i (x, y, z)); return true;};
+		traverseVoxelRay(ray, visit);
+		return voxels;
+	}
+
+	// textbook DDA on endpoints given in 1/64 voxel units: the t of the next boundary of each axis is recomputed from the
+	// boundary position every step and compared exactly (cross multiplied). Ties go to the axis stepVoxelRay takes.
+	std::vector<Eigen::Vector3i> referenceWalk(const Eigen::Vector3i& start, const Eigen::Vector3i& end){
+		const int64_t unit = 64;
+		std::vector<Eigen::Vector3i> voxels;
+		Eigen::Vector3i voxel, endVoxel, step;
+		int64_t length[3];
+		for (int i=0; i<3; ++i){
+			voxel(i) = int(std::floor(double(start(i)) / unit));
+			endVoxel(i) = int(std::floor(double(end(i)) / unit));
+			step(i) = (end(i) > start(i)) - (end(i) < start(i));
+			length[i] = std::abs(int64_t(end(i)) - start(i));
+		}
+		// t of the next boundary along axis i as a fraction (distance / length), infinite if the axis is not crossed
+		auto less = [&](int i, int j){
+			if (length[i] == 0) return false;
+			if (length[j] == 0) return true;
+			int64_t boundaryI = (step(i) > 0) ? (int64_t(voxel(i)) + 1) * unit - start(i) : start(i) - int64_t(voxel(i)) * unit;
+			int64_t boundaryJ = (step(j) > 0) ? (int64_t(voxel(j)) + 1) * unit - start(j) : start(j) - int64_t(voxel(j)) * unit;
+			return boundaryI * length[j] < boundaryJ * length[i];
+		};
+		// one step per crossed boundary (an end exactly on a boundary ends with the tie order as well)
+		for (int n=(endVoxel - voxel).cwiseAbs().sum(); n>0; --n){
+			voxels.push_back(voxel);
+			int axis = less(0, 1) ? (less(0, 2) ? 0 : 2) : (less(1, 2) ? 1 : 2);
+			voxel(axis) += step(axis);
+		}
+		return voxels;
+	}
+}
+
+TEST(VoxelRay, MatchesReferenceDDA){
+	// endpoints on a 1/64 grid are exact in the fixed point walk, including ties on voxel corners and edges
+	std::mt19937 rng (2);
+	std::uniform_int_distribution<int> coordinate (-20 * 64, 20 * 64);
+	std::uniform_int_distribution<int> corner (-20, 20);
+	for (int i=0; i<100000; ++i){
+		Eigen::Vector3i start, end;
+		for (int k=0; k<3; ++k){
+			start(k) = (i % 4 == 0) ? 64 * corner(rng) : coordinate(rng);
+			end(k) = (i % 3 == 0) ? 64 * corner(rng) + 32 : coordinate(rng);
+		}
+		if (i % 5 == 0){
+			end(i % 3) = start(i % 3); // axis parallel
+		}
+		std::vector<Eigen::Vector3i> voxels = walk(start.cast<double>() / 64, end.cast<double>() / 64);
+		std::vector<Eigen::Vector3i> reference = referenceWalk(start, end);
+		ASSERT_EQ(voxels.size(), reference.size()) << "start " << start.transpose() << " end " << end.transpose();
+		for (size_t n=0; n<voxels.size(); ++n){
+			ASSERT_EQ(voxels[n], reference[n]) << "start " << start.transpose() << " end " << end.transpose() << " step " << n;
+		}
+	}
+}
+
+TEST(VoxelRay, ContinuousEndpointsAreConnected){
+	// every step moves to a face neighbour and the walk stops right before the end voxel
+	std::mt19937 rng (3);
+	std::uniform_real_distribution<double> coordinate (-30.0, 30.0);
+	for (int i=0; i<100000; ++i){
+		Eigen::Vector3d start (coordinate(rng), coordinate(rng), coordinate(rng));
+		Eigen::Vector3d end (coordinate(rng), coordinate(rng), coordinate(rng));
+		std::vector<Eigen::Vector3i> voxels = walk(start, end);
+		Eigen::Vector3i startVoxel = start.array().floor().cast<int>();
+		Eigen::Vector3i endVoxel = end.array().floor().cast<int>();
+		ASSERT_EQ(int(voxels.size()), (endVoxel - startVoxel).cwiseAbs().sum());
+		if (voxels.empty()){
+			continue;
+		}
+		EXPECT_EQ(voxels.front(), startVoxel);
+		voxels.push_back(endVoxel);
+		for (size_t n=1; n<voxels.size(); ++n){
+			ASSERT_EQ((voxels[n] - voxels[n-1]).cwiseAbs().sum(), 1) << "start " << start.transpose() << " end " << end.transpose();
+		}
+	}
+}
+
+TEST(VoxelRayBatch, MatchesSingleRays){
+	// rays of different lengths refill the lanes while others are still walking
+	std::mt19937 rng (4);
+	std::uniform_real_distribution<double> coordinate (-10.0, 10.0);
+	const int rayNum = 1000;
+	std::vector<std::vector<Eigen::Vector3i>> reference (rayNum), voxels (rayNum);
+	VoxelRayBatch<8> batch;
+	int laneRay[8];
+	auto visit = [&](int lane, int x, int y, int z){voxels[laneRay[lane]].push_back(Eigen::Vector3i (x, y, z)); return true;};
+	for (int r=0; r<rayNum; ++r){
+		Eigen::Vector3d start (coordinate(rng), coordinate(rng), coordinate(rng));
+		Eigen::Vector3d end = start + (r % 7 + 1) * Eigen::Vector3d (coordinate(rng), coordinate(rng), coordinate(rng)) / 10;
+		reference[r] = walk(start, end);
+		VoxelRay ray;
+		initVoxelRay(start, end, ray);
+		if (ray.stepNum == 0){
+			continue;
+		}
+		if (batch.full()){
+			batch.traverse(visit, false);
+		}
+		laneRay[batch.add(ray)] = r;
+	}
+	batch.traverse(visit, true);
+	EXPECT_EQ(batch.size(), 0);
+	for (int r=0; r<rayNum; ++r){
+		EXPECT_EQ(voxels[r], reference[r]) << "ray " << r;
+	}
+}
+
+TEST(ClipVoxelRay, NearTieStaysInBox){
+	const Eigen::Vector3i boxMin (3, 4, 5);
+	const Eigen::Vector3i boxMax (30, 35, 25);
+	std::vector<Eigen::Vector3i> voxels = walkClipped(Eigen::Vector3d (10.428070690773326, 40.876342079521507, 27.493250122946115),
+	                                                  Eigen::Vector3d (25.849989453683563, 15.014299216705311, 3.6879852843512584), boxMin, boxMax);
+	ASSERT_FALSE(voxels.empty());
+	for (const Eigen::Vector3i& idx : voxels){
+		EXPECT_TRUE(isInBox(idx, boxMin, boxMax)) << idx.transpose();
+	}
+}
+
+TEST(ClipVoxelRay, RandomSegmentsStayInBox){
+	// endpoints on voxel corners, faces and at random positions, inside and outside the box
+	const Eigen::Vector3i boxMin (3, 4, 5);
+	const Eigen::Vector3i boxMax (30, 35, 25);
+	std::mt19937 rng (1);
+	std::uniform_real_distribution<double> real (-5.0, 45.0);
+	std::uniform_int_distribution<int> integer (-5, 45);
+	int clippedNum = 0;
+	for (int i=0; i<200000; ++i){
+		Eigen::Vector3d start, end;
+		for (int k=0; k<3; ++k){
+			start(k) = (i % 3 == 0) ? integer(rng) : ((i % 3 == 1) ? 0.5 * integer(rng) : real(rng));
+			end(k) = (i % 2 == 0) ? integer(rng) : real(rng);
+		}
+		std::vector<Eigen::Vector3i> voxels = walkClipped(start, end, boxMin, boxMax);
+		clippedNum += not voxels.empty();
+		for (const Eigen::Vector3i& idx : voxels){
+			ASSERT_TRUE(isInBox(idx, boxMin, boxMax)) << "start " << start.transpose() << " end " << end.transpose() << " voxel " << idx.transpose();
+		}
+	}
+	EXPECT_GT(clippedNum, 0);
+}
+
+TEST(ClipVoxelRay, MissingSegment){
+	Eigen::Vector3d start (0.5, 0.5, 0.5);
+	Eigen::Vector3d end (0.5, 10.5, 0.5);
+	bool endClipped;
+	EXPECT_FALSE(clipVoxelRay(start, end, Eigen::Vector3i (2, 2, 2), Eigen::Vector3i (5, 5, 5), endClipped));
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
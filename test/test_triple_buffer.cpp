@@ -0,0 +1,93 @@
+/*
+	FILE: test_triple_buffer.cpp
+	--------------------------------------
+	tests of the single producer single consumer triple buffer
+*/
+#include <map_manager/tripleBuffer.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using namespace mapManager;
+
+TEST(TripleBuffer, NothingPublished){
+	tripleBuffer<int> buffer;
+	EXPECT_FALSE(buffer.consume());
+	EXPECT_EQ(buffer.getPublishedNum(), 0u);
+}
+
+TEST(TripleBuffer, ConsumesLatestAndDropsOldest){
+	tripleBuffer<int> buffer;
+	buffer.writeBuffer() = 1;
+	buffer.publish();
+	ASSERT_TRUE(buffer.consume());
+	EXPECT_EQ(buffer.readBuffer(), 1);
+	EXPECT_FALSE(buffer.consume()); // consumed once
+	EXPECT_EQ(buffer.readBuffer(), 1); // the read buffer stays valid
+
+	for (int i=2; i<=4; ++i){
+		buffer.writeBuffer() = i;
+		buffer.publish();
+	}
+	ASSERT_TRUE(buffer.consume());
+	EXPECT_EQ(buffer.readBuffer(), 4);
+	EXPECT_EQ(buffer.getPublishedNum(), 4u);
+	EXPECT_EQ(buffer.getDroppedNum(), 2u);
+}
+
+TEST(TripleBuffer, ProducerNeverWritesTheReadBuffer){
+	tripleBuffer<int> buffer;
+	buffer.writeBuffer() = 1;
+	buffer.publish();
+	ASSERT_TRUE(buffer.consume());
+	int* readBuffer = &buffer.readBuffer();
+	for (int i=2; i<10; ++i){
+		EXPECT_NE(&buffer.writeBuffer(), readBuffer);
+		buffer.writeBuffer() = i;
+		buffer.publish();
+	}
+	EXPECT_EQ(*readBuffer, 1);
+}
+
+TEST(TripleBuffer, ThreadedHandoff){
+	// the consumer only sees complete frames, in publish order
+	struct frame{
+		uint64_t sequence = 0;
+		std::vector<uint64_t> data = std::vector<uint64_t> (256, 0);
+	};
+	tripleBuffer<frame> buffer;
+	const uint64_t frameNum = 200000;
+	std::thread producer ([&]{
+		for (uint64_t sequence=1; sequence<=frameNum; ++sequence){
+			frame& f = buffer.writeBuffer();
+			f.sequence = sequence;
+			std::fill(f.data.begin(), f.data.end(), sequence);
+			buffer.publish();
+		}
+	});
+
+	uint64_t lastSequence = 0, consumedNum = 0;
+	bool consistent = true;
+	while (lastSequence < frameNum){
+		if (not buffer.consume()){
+			std::this_thread::yield();
+			continue;
+		}
+		const frame& f = buffer.readBuffer();
+		consistent = consistent and (f.sequence > lastSequence);
+		for (uint64_t value : f.data){
+			consistent = consistent and (value == f.sequence);
+		}
+		lastSequence = f.sequence;
+		++consumedNum;
+	}
+	producer.join();
+	EXPECT_TRUE(consistent);
+	EXPECT_EQ(buffer.getPublishedNum(), frameNum);
+	EXPECT_EQ(consumedNum + buffer.getDroppedNum(), frameNum);
+}
+
+int main(int argc, char** argv){
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}